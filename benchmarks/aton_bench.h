@@ -0,0 +1,36 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Server side shared by the benchmarks
+
+#ifndef ATON_BENCH_H_
+#define ATON_BENCH_H_
+
+#include "aton_server.h"
+
+#include <atomic>
+#include <thread>
+
+// Counts incoming buckets
+class Receiver: public ServerHandler
+{
+public:
+    Receiver(): received(0) {}
+    
+    void header_received(Session& /*session*/, DataHeader& /*dh*/) {}
+    void pixels_received(Session& /*session*/, DataPixels& /*dp*/) { received++; }
+    
+    // Blocks until the server has handled as many buckets as were sent
+    void wait(const long long& sent) const
+    {
+        while (received < sent)
+            std::this_thread::yield();
+    }
+    
+    std::atomic<long long> received;
+};
+
+#endif // ATON_BENCH_H_
@@ -0,0 +1,146 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Heap allocations the Server makes per bucket once a session is warm,
+// for each pixels protocol. Exits with 1 if any steady state bucket
+// allocated. Pass a non loopback address of this machine as the host
+// to go through the codec and delta paths as well.
+// Usage: aton_bench_alloc [host] [buckets] [bucket_size] [aovs]
+
+#include "aton_client.h"
+#include "aton_server.h"
+#include "aton_bench.h"
+
+#include <atomic>
+#include <thread>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static std::atomic<long long> allocations(0);
+
+// Set on the Server's thread once it has taken the first session
+static thread_local bool server_thread = false;
+
+void* operator new(size_t size)
+{
+    if (server_thread)
+        allocations++;
+
+    void* ptr = malloc(size ? size : 1);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+
+// Counts incoming buckets and the allocations of the server's thread
+class AllocReceiver: public Receiver
+{
+public:
+    void session_opened(Session& /*session*/) { server_thread = true; }
+};
+
+int main(int argc, char* argv[])
+{
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+    const int buckets = argc > 2 ? atoi(argv[2]) : 2000;
+    const int bucket = argc > 3 ? atoi(argv[3]) : 64;
+    const int aovs = argc > 4 ? atoi(argv[4]) : 8;
+
+    // A single thread, so every allocation of the session gets counted
+    AllocReceiver receiver;
+    Server server;
+    server.connect(get_port(), true);
+    server.start(&receiver, 1);
+
+    const float cam_matrix[16] = {0};
+    const int samples[6] = {0};
+    std::vector<float> pixels(bucket * bucket * 4, 0.5f);
+
+    // Aov names get a different pointer for every bucket, like a driver's
+    std::vector<std::string> names(aovs);
+    for (int a = 0; a < aovs; ++a)
+        names[a] = a == 0 ? "RGBA" : "aov_" + std::to_string(a);
+
+    const int protocols[5] = {protocol_legacy, protocol_framed, protocol_shared,
+                              protocol_reduced, protocol_delta};
+    const int formats[5] = {format_float, format_float, format_float,
+                            format_half, format_half};
+    const char* labels[5] = {"legacy", "framed", "shared", "reduced", "delta"};
+
+    printf("%s, %d buckets of %dpx, %d aovs\n", host, buckets, bucket, aovs);
+
+    bool failed = false;
+    for (int m = 0; m < 5; ++m)
+    {
+        Client client(host, server.get_port());
+        client.set_protocol(protocols[m]);
+        if (protocols[m] == protocol_framed)
+            client.set_shm_size(0);
+
+        DataHeader dh(get_unique_id(), bucket * 16, bucket * 16, 1.0f, bucket * bucket * 256,
+                      0, 1.0f, 0.0f, cam_matrix, samples, "bench");
+
+        client.send_header(dh);
+
+        // A first pass over every tile warms the session up,
+        // the buckets after it get counted
+        const int warmup = 256 * aovs;
+        const long long start = allocations;
+        long long warm = 0, counted = 0, sent = 0;
+        for (int i = 0; i < warmup + buckets; ++i)
+        {
+            const int tile = i / aovs % 256;
+            const std::string name = names[i % aovs];
+            pixels[i % pixels.size()] += 0.001f;
+
+            DataPixels dp(dh.session(), bucket * 16, bucket * 16,
+                          tile % 16 * bucket, tile / 16 * bucket,
+                          bucket, bucket, 4, 0, 0,
+                          name.c_str(), &pixels[0], formats[m]);
+            client.send_pixels(dp);
+            sent++;
+
+            if (i == warmup - 1)
+            {
+                receiver.wait(sent);
+                counted = allocations;
+                warm = counted - start;
+            }
+        }
+
+        receiver.wait(sent);
+        counted = allocations - counted;
+        client.close_image();
+
+        printf("%-8s protocol %d, %lld allocations warming up, then %.3f per bucket\n",
+               labels[m], client.protocol(), warm, double(counted) / buckets);
+        failed |= counted > 0;
+
+        receiver.received = 0;
+        while (server.sessions() > 0)
+            std::this_thread::yield();
+    }
+
+    server.quit();
+    return failed;
+}
@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Engine style row reads, one channel at a time across a row, from the
+// former interleaved AOV layout and from the planar AOVBuffer.
+// Usage: aton_bench_aovbuffer [xres] [yres] [aovs]
+
+#include "aton_aovbuffer.h"
+
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+// Former layout, RGB triplets plus a separate alpha vector
+struct RenderColor { float _val[3]; };
+
+struct InterleavedBuffer
+{
+    InterleavedBuffer(int w, int h): color(w * h), alpha(w * h)
+    {
+        for (size_t i = 0; i < color.size(); ++i)
+            color[i]._val[0] = color[i]._val[1] = color[i]._val[2] = alpha[i] = 0.5f;
+    }
+    
+    float get(int index, int c) const { return c < 3 ? color[index]._val[c] : alpha[index]; }
+    
+    std::vector<RenderColor> color;
+    std::vector<float> alpha;
+};
+
+template <typename Read>
+static double run(const char* name, int xres, int yres, int aovs, Read read)
+{
+    std::vector<float> out(xres);
+    const auto start = std::chrono::steady_clock::now();
+    
+    float sum = 0.0f;
+    for (int y = 0; y < yres; ++y)
+        for (int b = 0; b < aovs; ++b)
+            for (int c = 0; c < 4; ++c)
+            {
+                read(b, c, y, &out[0]);
+                sum += out[y % xres];
+            }
+    
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const double rows = double(yres) * aovs * 4;
+    printf("%-12s %8.1f ns/row %8.2f GB/s (%g)\n", name, secs * 1e9 / rows,
+           rows * xres * sizeof(float) / secs / 1e9, sum);
+    return secs;
+}
+
+int main(int argc, char* argv[])
+{
+    const int xres = argc > 1 ? atoi(argv[1]) : 3840;
+    const int yres = argc > 2 ? atoi(argv[2]) : 2160;
+    const int aovs = argc > 3 ? atoi(argv[3]) : 4;
+    
+    printf("%dx%d, %d RGBA aovs\n", xres, yres, aovs);
+    
+    std::vector<InterleavedBuffer> interleaved(aovs, InterleavedBuffer(xres, yres));
+    std::vector<AOVBuffer> planar(aovs, AOVBuffer(xres, yres, 4));
+    for (int b = 0; b < aovs; ++b)
+        for (int c = 0; c < 4; ++c)
+            for (int y = 0; y < yres; ++y)
+                std::fill(planar[b].row(c, y), planar[b].row(c, y) + xres, 0.5f);
+    
+    const double before = run("interleaved", xres, yres, aovs, [&](int b, int c, int y, float* out)
+    {
+        const InterleavedBuffer& buffer = interleaved[b];
+        for (int x = 0; x < xres; ++x)
+            out[x] = buffer.get(y * xres + x, c);
+    });
+    
+    const double after = run("planar", xres, yres, aovs, [&](int b, int c, int y, float* out)
+    {
+        const float* row = planar[b].row(c, y);
+        for (int x = 0; x < xres; ++x)
+            out[x] = row[x];
+    });
+    
+    printf("speedup      %8.2fx\n", before / after);
+    return 0;
+}
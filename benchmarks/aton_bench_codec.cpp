@@ -0,0 +1,144 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Compression ratio and speed of the pixel codec on render-like buckets,
+// with the decoding spread over several threads like the Server does,
+// the sizes of the reduced formats with and without the codec, and the
+// size of a second AA pass sent as a delta to the first.
+// Usage: aton_bench_codec [bucket_size] [buckets] [threads]
+
+#include "aton_codec.h"
+#include "aton_format.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Smooth shading with a bit of sampling noise, a flat alpha,
+// and a mostly empty aov
+static void make_bucket(const int& size, const int& index, const int& spp, std::vector<float>& pixels)
+{
+    pixels.resize(size * size * spp);
+    srand(index);
+
+    for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
+            for (int c = 0; c < spp; ++c)
+            {
+                float& p = pixels[(y * size + x) * spp + c];
+                if (spp == 1)
+                    p = (x + y + index) % 97 == 0 ? 1.0f : 0.0f;
+                else if (c == 3)
+                    p = 1.0f;
+                else
+                    p = 0.5f + 0.4f * sinf((x + index * 7) * 0.03f + c) * cosf(y * 0.02f) +
+                        0.002f * (rand() % 100);
+            }
+}
+
+int main(int argc, char* argv[])
+{
+    const int size = argc > 1 ? atoi(argv[1]) : 64;
+    const int count = argc > 2 ? atoi(argv[2]) : 2000;
+    const int threads = argc > 3 ? atoi(argv[3]) : 4;
+
+    const int spps[3] = {4, 3, 1};
+    std::vector<std::vector<float> > buckets(count);
+    std::vector<std::vector<char> > encoded(count);
+
+    double raw = 0, packed = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        make_bucket(size, i, spps[i % 3], buckets[i]);
+        raw += buckets[i].size() * sizeof(float);
+    }
+
+    // Encode
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i)
+        packed += encode_pixels(&buckets[i][0], size * size, spps[i % 3], encoded[i]);
+    const double encode_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Decode on one thread
+    std::vector<float> out(size * size * 4);
+    int bad = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i)
+    {
+        bad += !decode_pixels(&encoded[i][0], encoded[i].size(), size * size, spps[i % 3], &out[0]);
+        bad += memcmp(&out[0], &buckets[i][0], buckets[i].size() * sizeof(float)) != 0;
+    }
+    const double decode_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Decode on several threads
+    std::atomic<int> next(0);
+    std::vector<std::thread> pool;
+    start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t)
+        pool.push_back(std::thread([&]
+        {
+            std::vector<float> pixels(size * size * 4);
+            for (int i = next++; i < count; i = next++)
+                decode_pixels(&encoded[i][0], encoded[i].size(), size * size, spps[i % 3], &pixels[0]);
+        }));
+    for (int t = 0; t < threads; ++t)
+        pool[t].join();
+    const double parallel_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const double mb = raw / (1 << 20);
+    printf("%d buckets of %dpx, %.1f MB raw\n", count, size, mb);
+    printf("ratio          %.2fx\n", raw / packed);
+    printf("encode         %.0f MB/s\n", mb / encode_secs);
+    printf("decode         %.0f MB/s\n", mb / decode_secs);
+    printf("decode x%-2d     %.0f MB/s\n", threads, mb / parallel_secs);
+    printf("mismatches     %d\n", bad);
+    
+    // Reduced formats, as the Client sends them
+    const int formats[3] = {format_half, format_u16, format_u8};
+    const char* names[3] = {"half", "u16", "u8"};
+    std::vector<char> reduced;
+    for (int f = 0; f < 3; ++f)
+    {
+        double plain = 0, coded = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            float offset, scale;
+            reduced.resize(buckets[i].size() * format_bytes(formats[f]));
+            plain += pack_samples(&buckets[i][0], buckets[i].size(), formats[f],
+                                  &reduced[0], offset, scale);
+            coded += encode_pixels(&reduced[0], size * size, spps[i % 3],
+                                   encoded[i], static_cast<int>(format_bytes(formats[f])));
+        }
+        printf("%-6s         %.2fx, %.2fx with the codec\n", names[f], raw / plain, raw / coded);
+    }
+    
+    // Second AA pass, refining the first by a little noise
+    double pass = 0, delta = 0;
+    std::vector<char> reference;
+    for (int i = 0; i < count; ++i)
+    {
+        std::vector<float> refined = buckets[i];
+        srand(count + i);
+        for (size_t s = 0; s < refined.size(); ++s)
+            if (rand() % 4 == 0)
+                refined[s] += 0.001f * (rand() % 10 - 5);
+        
+        pass += encode_pixels(&refined[0], size * size, spps[i % 3], encoded[i]);
+        
+        const size_t bytes = refined.size() * sizeof(float);
+        reference.assign(reinterpret_cast<const char*>(&buckets[i][0]),
+                         reinterpret_cast<const char*>(&buckets[i][0]) + bytes);
+        delta_encode(reinterpret_cast<char*>(&refined[0]), &reference[0], bytes);
+        delta += encode_pixels(&refined[0], size * size, spps[i % 3], encoded[i]);
+    }
+    printf("pass 2         %.1f MB, %.1f MB as deltas\n", pass / (1 << 20), delta / (1 << 20));
+    return bad != 0;
+}
@@ -0,0 +1,303 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Hot paths of the ingest, the engine and the capture for an image of
+// the given size and aovs, written as JSON to track them across releases.
+// The first aov is RGBA, the others have 3 samples like most utility aovs.
+// Usage: aton_bench_suite [xres] [yres] [aovs] [bucket] [output.json]
+
+#include "aton_client.h"
+#include "aton_server.h"
+#include "aton_codec.h"
+#include "aton_framebuffer.h"
+#include "aton_bench.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+
+typedef std::chrono::steady_clock Clock;
+
+// Each benchmark runs at least this long
+static const double min_secs = 0.25;
+
+struct Result
+{
+    std::string name;
+    std::string unit;
+    long long ops;
+    double secs;
+    double bytes;
+};
+
+// Runs fn, which does ops units of work on bytes of pixels, until it
+// took long enough. The first run only warms the caches up.
+template <typename Fn>
+static Result measure(const char* name,
+                      const char* unit,
+                      const long long& ops,
+                      const double& bytes,
+                      Fn fn)
+{
+    fn();
+
+    Result result = {name, unit, 0, 0.0, 0.0};
+    const Clock::time_point start = Clock::now();
+    do
+    {
+        fn();
+        result.ops += ops;
+        result.bytes += bytes;
+        result.secs = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    while (result.secs < min_secs);
+
+    fprintf(stderr, "%-16s %10.1f ns/%s %10.1f MB/s\n", name,
+            result.secs * 1e9 / result.ops, unit, result.bytes / 1048576.0 / result.secs);
+    return result;
+}
+
+// A bucket of the image, origin from the top left like Arnold's
+struct Tile
+{
+    int x, y, w, h;
+};
+
+// Sends every bucket of every aov through a loopback connection
+// and waits for the server to have decoded them
+static Result wire(const char* name,
+                   const size_t& shm_size,
+                   const int& xres,
+                   const int& yres,
+                   const std::vector<Tile>& tiles,
+                   const std::vector<std::string>& names,
+                   const std::vector<int>& spps,
+                   const std::vector<std::vector<float> >& pixels,
+                   const double& bytes)
+{
+    Receiver receiver;
+    Server server;
+    server.connect(get_port(), true);
+    server.start(&receiver, 1);
+
+    Client client("127.0.0.1", server.get_port());
+    client.set_shm_size(shm_size);
+
+    const float cam_matrix[16] = {0};
+    const int samples[6] = {0};
+    DataHeader dh(get_unique_id(), xres, yres, 1.0f, static_cast<long long>(xres) * yres,
+                  0, 1.0f, 0.0f, cam_matrix, samples, "bench");
+    client.send_header(dh);
+
+    long long sent = 0;
+    const Result result = measure(name, "bucket", static_cast<long long>(tiles.size()), bytes, [&]()
+    {
+        for (size_t t = 0; t < tiles.size(); ++t)
+            for (size_t a = 0; a < names.size(); ++a)
+            {
+                const Tile& tile = tiles[t];
+                DataPixels dp(dh.session(), xres, yres, tile.x, tile.y, tile.w, tile.h,
+                              spps[a], 0, 0, names[a].c_str(), &pixels[a][0]);
+                client.send_pixels(dp);
+                sent++;
+            }
+
+        receiver.wait(sent);
+    });
+
+    client.close_image();
+    server.quit();
+    return result;
+}
+
+static void write_json(FILE* out,
+                       const std::vector<Result>& results,
+                       const int& xres,
+                       const int& yres,
+                       const int& aovs,
+                       const int& bucket)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"suite\": \"aton_bench_suite\",\n");
+    fprintf(out, "  \"protocol\": %d,\n", protocol_current);
+    fprintf(out, "  \"params\": {\"xres\": %d, \"yres\": %d, \"aovs\": %d, \"bucket\": %d},\n",
+            xres, yres, aovs, bucket);
+    fprintf(out, "  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const Result& r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %lld, \"seconds\": %.6f, "
+                     "\"ns_per_op\": %.3f, \"ops_per_s\": %.3f, \"mb_per_s\": %.3f}%s\n",
+                r.name.c_str(), r.unit.c_str(), r.ops, r.secs,
+                r.secs * 1e9 / r.ops, r.ops / r.secs, r.bytes / 1048576.0 / r.secs,
+                i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const int xres = argc > 1 ? atoi(argv[1]) : 1920;
+    const int yres = argc > 2 ? atoi(argv[2]) : 1080;
+    const int aovs = argc > 3 ? atoi(argv[3]) : 4;
+    const int bucket = argc > 4 ? atoi(argv[4]) : 64;
+    const char* path = argc > 5 ? argv[5] : NULL;
+
+    if (xres <= 0 || yres <= 0 || aovs <= 0 || bucket <= 0)
+    {
+        fprintf(stderr, "Usage: aton_bench_suite [xres] [yres] [aovs] [bucket] [output.json]\n");
+        return 1;
+    }
+
+    std::vector<Tile> tiles;
+    for (int y = 0; y < yres; y += bucket)
+        for (int x = 0; x < xres; x += bucket)
+        {
+            Tile tile = {x, y, std::min(bucket, xres - x), std::min(bucket, yres - y)};
+            tiles.push_back(tile);
+        }
+
+    // Smooth pixels with some noise, full size buckets of each aov
+    std::vector<std::string> names(aovs);
+    std::vector<int> spps(aovs);
+    std::vector<std::vector<float> > pixels(aovs);
+    double frame_bytes = 0.0;
+    for (int a = 0; a < aovs; ++a)
+    {
+        names[a] = a == 0 ? "RGBA" : "aov_" + std::to_string(a);
+        spps[a] = a == 0 ? 4 : 3;
+        frame_bytes += sizeof(float) * xres * yres * spps[a];
+
+        std::vector<float>& data = pixels[a];
+        data.resize(bucket * bucket * spps[a]);
+        for (size_t i = 0; i < data.size(); ++i)
+            data[i] = 0.5f + 0.4f * std::sin(i * 0.01f + a) + (i * 7919 % 101) * 1e-4f;
+    }
+
+    fprintf(stderr, "%dx%d, %d aovs, %zu buckets of %dpx\n", xres, yres, aovs, tiles.size(), bucket);
+
+    std::vector<Result> results;
+    const long long buckets = static_cast<long long>(tiles.size());
+
+    // Codec, a full frame of buckets per run
+    std::vector<std::vector<char> > encoded(tiles.size() * aovs);
+    results.push_back(measure("wire_encode", "bucket", buckets, frame_bytes, [&]()
+    {
+        for (size_t t = 0; t < tiles.size(); ++t)
+            for (int a = 0; a < aovs; ++a)
+                encode_pixels(&pixels[a][0], tiles[t].w * tiles[t].h, spps[a],
+                              encoded[t * aovs + a]);
+    }));
+
+    std::vector<float> decoded(bucket * bucket * 4);
+    bool corrupt = false;
+    results.push_back(measure("wire_decode", "bucket", buckets, frame_bytes, [&]()
+    {
+        for (size_t t = 0; t < tiles.size(); ++t)
+            for (int a = 0; a < aovs; ++a)
+            {
+                const std::vector<char>& src = encoded[t * aovs + a];
+                corrupt |= !decode_pixels(&src[0], src.size(), tiles[t].w * tiles[t].h,
+                                          spps[a], &decoded[0]);
+            }
+    }));
+
+    // Client to Server, through the socket and through shared memory
+    results.push_back(wire("wire_socket", 0, xres, yres, tiles, names, spps, pixels, frame_bytes));
+    results.push_back(wire("wire_shared", get_shm_size(), xres, yres, tiles, names, spps, pixels, frame_bytes));
+
+    // Buckets written into a RenderBuffer like the writer does
+    DataHeader dh(get_unique_id(), xres, yres, 1.0f, static_cast<long long>(xres) * yres,
+                  0, 1.0f, 0.0f, NULL, NULL, "bench");
+    FrameBuffer fb;
+    RenderBuffer* rb = fb.add_renderbuffer(&dh);
+    for (int a = 0; a < aovs; ++a)
+        rb->add_aov(names[a].c_str(), spps[a]);
+
+    results.push_back(measure("blit", "bucket", buckets, frame_bytes, [&]()
+    {
+        for (size_t t = 0; t < tiles.size(); ++t)
+        {
+            const Tile& tile = tiles[t];
+            for (int a = 0; a < aovs; ++a)
+                rb->write_bucket(a, tile.x, tile.y, tile.w, tile.h, spps[a], &pixels[a][0]);
+        }
+    }));
+
+    // Engine style, one channel at a time across every row
+    std::vector<float> row(xres);
+    float sum = 0.0f;
+    long long rows = 0;
+    for (int a = 0; a < aovs; ++a)
+        rows += static_cast<long long>(yres) * spps[a];
+
+    results.push_back(measure("engine_rows", "row", rows, frame_bytes, [&]()
+    {
+        for (int y = 0; y < yres; ++y)
+        {
+            RowGuard lock(rb, y);
+            for (int a = 0; a < aovs; ++a)
+                for (int c = 0; c < spps[a]; ++c)
+                {
+                    rb->read_aov_row(a, c, y, 0, xres, &row[0]);
+                    sum += row[y % xres];
+                }
+        }
+    }));
+
+    // Aov of every bucket looked up by name, as the writer does
+    int found = 0;
+    results.push_back(measure("aov_lookup", "lookup", buckets * aovs, 0.0, [&]()
+    {
+        for (long long i = 0; i < buckets; ++i)
+            for (int a = 0; a < aovs; ++a)
+                found += rb->find_aov(names[a].c_str());
+    }));
+
+    // Snapshot of the framebuffer, its tiles are shared until written
+    // so there's no rate of bytes to it
+    results.push_back(measure("snapshot_copy", "copy", 1, 0.0, [&]()
+    {
+        FrameBuffer snapshot(fb);
+        found += static_cast<int>(snapshot.size());
+    }));
+
+    // Capture to disk and back, the way images get spilled and restored
+    const char* tmp = getenv("TMPDIR");
+    const std::string dir = std::string(tmp != NULL ? tmp : "/tmp") + "/aton_bench_suite";
+    bool failed = false;
+    results.push_back(measure("capture", "image", 1, frame_bytes, [&]()
+    {
+        failed |= !rb->spill(dir);
+        rb->restore();
+    }));
+
+    fprintf(stderr, "(%g %d)\n", sum, found);
+
+    if (corrupt || failed)
+    {
+        fprintf(stderr, "aton_bench_suite: %s\n", corrupt ? "decoded corrupt buckets"
+                                                          : "could not capture to disk");
+        return 1;
+    }
+
+    FILE* out = path != NULL ? fopen(path, "w") : stdout;
+    if (out == NULL)
+    {
+        fprintf(stderr, "aton_bench_suite: could not write %s\n", path);
+        return 1;
+    }
+
+    write_json(out, results, xres, yres, aovs, bucket);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
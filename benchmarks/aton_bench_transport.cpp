@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Loopback throughput of the legacy, framed and shared memory pixels protocol.
+// Usage: aton_bench_transport [xres] [yres] [bucket_size] [aovs]
+
+#include "aton_client.h"
+#include "aton_server.h"
+#include "aton_bench.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+
+int main(int argc, char* argv[])
+{
+    const int xres = argc > 1 ? atoi(argv[1]) : 3840;
+    const int yres = argc > 2 ? atoi(argv[2]) : 2160;
+    const int bucket = argc > 3 ? atoi(argv[3]) : 64;
+    const int aovs = argc > 4 ? atoi(argv[4]) : 20;
+
+    Receiver receiver;
+    Server server;
+    server.connect(get_port(), true);
+    server.start(&receiver);
+
+    const float cam_matrix[16] = {0};
+    const int samples[6] = {0};
+    std::vector<float> pixels(bucket * bucket * 4, 0.5f);
+
+    const int modes[3] = {protocol_legacy, protocol_framed, protocol_shared};
+    const char* names[3] = {"legacy", "framed", "shared"};
+
+    printf("%dx%d, %dpx buckets, %d aovs\n", xres, yres, bucket, aovs);
+
+    for (int m = 0; m < 3; ++m)
+    {
+        Client client("127.0.0.1", server.get_port());
+        client.set_protocol(modes[m]);
+
+        DataHeader dh(get_unique_id(), xres, yres, 1.0f, xres * yres,
+                      0, 1.0f, 0.0f, cam_matrix, samples, "bench");
+        client.send_header(dh);
+
+        receiver.received = 0;
+        long long sent = 0;
+        const auto start = std::chrono::steady_clock::now();
+
+        for (int y = 0; y < yres; y += bucket)
+        {
+            for (int x = 0; x < xres; x += bucket)
+            {
+                const int w = std::min(bucket, xres - x);
+                const int h = std::min(bucket, yres - y);
+                for (int a = 0; a < aovs; ++a)
+                {
+                    const int spp = a == 0 ? 4 : (a % 3 ? 3 : 1);
+                    std::string name = a == 0 ? "RGBA" : "aov_" + std::to_string(a);
+                    DataPixels dp(dh.session(), xres, yres, x, y, w, h,
+                                  spp, 0, 0, name.c_str(), &pixels[0]);
+                    client.send_pixels(dp);
+                    ++sent;
+                }
+            }
+        }
+
+        receiver.wait(sent);
+
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        client.close_image();
+
+        printf("%-8s protocol %d: %lld buckets in %.3fs, %.0f buckets/s\n",
+               names[m], client.protocol(), sent, secs, sent / secs);
+    }
+
+    server.quit();
+    return 0;
+}
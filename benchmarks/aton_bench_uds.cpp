@@ -0,0 +1,96 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Throughput of TCP loopback against a Unix domain socket,
+// framed protocol without the shared memory ring.
+// Usage: aton_bench_uds [xres] [yres] [bucket_size] [aovs] [socket_path]
+
+#include "aton_client.h"
+#include "aton_server.h"
+#include "aton_bench.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+
+// Sends a whole synthetic render, returns buckets per second
+double render(const std::string& endpoint,
+              const int& xres,
+              const int& yres,
+              const int& bucket,
+              const int& aovs)
+{
+    Receiver receiver;
+    Server server;
+    server.connect(endpoint, true);
+    server.start(&receiver);
+
+    const std::string host = server.get_path().empty() ? "127.0.0.1" : endpoint;
+    Client client(host, server.get_port());
+    client.set_protocol(protocol_framed);
+    client.set_shm_size(0);
+
+    const float cam_matrix[16] = {0};
+    const int samples[6] = {0};
+    std::vector<float> pixels(bucket * bucket * 4, 0.5f);
+
+    DataHeader dh(get_unique_id(), xres, yres, 1.0f, xres * yres,
+                  0, 1.0f, 0.0f, cam_matrix, samples, "bench");
+    client.send_header(dh);
+
+    receiver.received = 0;
+    long long sent = 0, bytes = 0;
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int y = 0; y < yres; y += bucket)
+    {
+        for (int x = 0; x < xres; x += bucket)
+        {
+            const int w = std::min(bucket, xres - x);
+            const int h = std::min(bucket, yres - y);
+            for (int a = 0; a < aovs; ++a)
+            {
+                const int spp = a == 0 ? 4 : (a % 3 ? 3 : 1);
+                std::string name = a == 0 ? "RGBA" : "aov_" + std::to_string(a);
+                DataPixels dp(dh.session(), xres, yres, x, y, w, h,
+                              spp, 0, 0, name.c_str(), &pixels[0]);
+                client.send_pixels(dp);
+                bytes += w * h * spp * sizeof(float);
+                ++sent;
+            }
+        }
+    }
+
+    receiver.wait(sent);
+
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    client.close_image();
+    server.quit();
+
+    printf("%-6s %lld buckets in %.3fs, %.0f buckets/s, %.0f MB/s\n",
+           get_unix_path(endpoint).empty() ? "tcp" : "unix",
+           sent, secs, sent / secs, bytes / secs / (1 << 20));
+    return sent / secs;
+}
+
+int main(int argc, char* argv[])
+{
+    const int xres = argc > 1 ? atoi(argv[1]) : 3840;
+    const int yres = argc > 2 ? atoi(argv[2]) : 2160;
+    const int bucket = argc > 3 ? atoi(argv[3]) : 64;
+    const int aovs = argc > 4 ? atoi(argv[4]) : 20;
+    const std::string path = argc > 5 ? argv[5] : "/tmp/aton_bench.sock";
+
+    printf("%dx%d, %dpx buckets, %d aovs\n", xres, yres, bucket, aovs);
+
+    const double tcp = render(std::to_string(get_port()), xres, yres, bucket, aovs);
+    const double uds = render("unix:" + path, xres, yres, bucket, aovs);
+
+    printf("speedup %.2fx\n", uds / tcp);
+    return 0;
+}
@@ -0,0 +1,540 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_aovbuffer.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <istream>
+#include <ostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ATON_X86
+#include <immintrin.h>
+#endif
+
+// Floats per cache line
+static const size_t line = 64 / sizeof(float);
+
+// Scalar deinterleave, also finishes the tails of the SIMD kernels
+template <int spp>
+static void deinterleave_scalar(const float* src,
+                                const int& n,
+                                float* const* dst)
+{
+    for (int i = 0; i < n; ++i, src += spp)
+        for (int c = 0; c < spp; ++c)
+            dst[c][i] = src[c];
+}
+
+#ifdef ATON_X86
+// SIMD kernels return the number of pixels they handled
+
+// 4 pixels of RGB per iteration
+static int deinterleave_rgb_sse(const float* src,
+                                const int& n,
+                                float* const* dst)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4, src += 12)
+    {
+        // r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3
+        const __m128 a = _mm_loadu_ps(src);
+        const __m128 b = _mm_loadu_ps(src + 4);
+        const __m128 c = _mm_loadu_ps(src + 8);
+        
+        const __m128 r = _mm_shuffle_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 3, 0, 0)),
+                                        _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 1, 0, 2)),
+                                        _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 g = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 0, 1)),
+                                        _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 2, 0, 3)),
+                                        _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 bl = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 1, 0, 2)),
+                                         _mm_shuffle_ps(c, c, _MM_SHUFFLE(0, 3, 0, 0)),
+                                         _MM_SHUFFLE(2, 0, 2, 0));
+        
+        _mm_storeu_ps(dst[0] + i, r);
+        _mm_storeu_ps(dst[1] + i, g);
+        _mm_storeu_ps(dst[2] + i, bl);
+    }
+    return i;
+}
+
+// 4 pixels of RGBA per iteration
+static int deinterleave_rgba_sse(const float* src,
+                                 const int& n,
+                                 float* const* dst)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4, src += 16)
+    {
+        __m128 p0 = _mm_loadu_ps(src);
+        __m128 p1 = _mm_loadu_ps(src + 4);
+        __m128 p2 = _mm_loadu_ps(src + 8);
+        __m128 p3 = _mm_loadu_ps(src + 12);
+        
+        _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+        
+        _mm_storeu_ps(dst[0] + i, p0);
+        _mm_storeu_ps(dst[1] + i, p1);
+        _mm_storeu_ps(dst[2] + i, p2);
+        _mm_storeu_ps(dst[3] + i, p3);
+    }
+    return i;
+}
+
+// 8 pixels of RGBA per iteration
+__attribute__((target("avx")))
+static int deinterleave_rgba_avx(const float* src,
+                                 const int& n,
+                                 float* const* dst)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8, src += 32)
+    {
+        // Two pixels per register
+        const __m256 l0 = _mm256_loadu_ps(src);
+        const __m256 l1 = _mm256_loadu_ps(src + 8);
+        const __m256 l2 = _mm256_loadu_ps(src + 16);
+        const __m256 l3 = _mm256_loadu_ps(src + 24);
+        
+        // Pixels 0-3 in the low lanes, 4-7 in the high lanes
+        const __m256 m0 = _mm256_permute2f128_ps(l0, l2, 0x20);
+        const __m256 m1 = _mm256_permute2f128_ps(l0, l2, 0x31);
+        const __m256 m2 = _mm256_permute2f128_ps(l1, l3, 0x20);
+        const __m256 m3 = _mm256_permute2f128_ps(l1, l3, 0x31);
+        
+        // In lane 4x4 transpose
+        const __m256 t0 = _mm256_unpacklo_ps(m0, m1);
+        const __m256 t1 = _mm256_unpackhi_ps(m0, m1);
+        const __m256 t2 = _mm256_unpacklo_ps(m2, m3);
+        const __m256 t3 = _mm256_unpackhi_ps(m2, m3);
+        
+        _mm256_storeu_ps(dst[0] + i, _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)));
+        _mm256_storeu_ps(dst[1] + i, _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2)));
+        _mm256_storeu_ps(dst[2] + i, _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)));
+        _mm256_storeu_ps(dst[3] + i, _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2)));
+    }
+    return i;
+}
+
+typedef int (*Kernel)(const float*, const int&, float* const*);
+
+// Picked once at load time
+static Kernel select_rgba()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+        return deinterleave_rgba_avx;
+    return deinterleave_rgba_sse;
+}
+
+static const Kernel deinterleave_rgba = select_rgba();
+#endif
+
+void deinterleave(const float* src,
+                  const int& n,
+                  const int& spp,
+                  float* const* dst)
+{
+    int done = 0;
+    switch (spp)
+    {
+        case 1:
+            memcpy(dst[0], src, n * sizeof(float));
+            return;
+        case 3:
+        {
+#ifdef ATON_X86
+            done = deinterleave_rgb_sse(src, n, dst);
+#endif
+            float* const tail[3] = {dst[0] + done, dst[1] + done, dst[2] + done};
+            deinterleave_scalar<3>(src + done * 3, n - done, tail);
+            return;
+        }
+        case 4:
+        {
+#ifdef ATON_X86
+            done = deinterleave_rgba(src, n, dst);
+#endif
+            float* const tail[4] = {dst[0] + done, dst[1] + done, dst[2] + done, dst[3] + done};
+            deinterleave_scalar<4>(src + done * 4, n - done, tail);
+            return;
+        }
+        default:
+            for (int i = 0; i < n; ++i, src += spp)
+                for (int c = 0; c < spp; ++c)
+                    dst[c][i] = src[c];
+    }
+}
+
+// AOVBuffer class
+const int AOVBuffer::band;
+
+AOVBuffer::AOVBuffer(const unsigned int& width,
+                     const unsigned int& height,
+                     const int& spp,
+                     const int& format): _spp(spp),
+                                         _format(format),
+                                         _bytes(format_bytes(format)),
+                                         _bands(0),
+                                         _width(0),
+                                         _height(0),
+                                         _stride(0),
+                                         _rows_size(0),
+                                         _tile_size(0)
+{
+    if (_bytes == 0)
+    {
+        _format = format_float;
+        _bytes = sizeof(float);
+    }
+    resize(width, height);
+}
+
+void AOVBuffer::resize(const unsigned int& width,
+                       const unsigned int& height)
+{
+    // Pad the rows to whole cache lines
+    const size_t per_line = 64 / _bytes;
+    _width = width;
+    _height = height;
+    _stride = (width + per_line - 1) / per_line * per_line;
+    _bands = (height + band - 1) / band;
+    
+    // Quantized tiles keep their range on a line of their own
+    _rows_size = _stride * _bytes * band / sizeof(float);
+    _tile_size = _rows_size + (format_quantized(_format) ? line : 0);
+    
+    // Every tile starts as the same blank one,
+    // zeros are zeros in every format
+    _blank.reset();
+    _tiles.assign(_spp * _bands, AOVTile());
+    if (!_tiles.empty())
+    {
+        _blank = std::make_shared<AOVPlane>(_tile_size, 0.0f);
+        std::fill(_tiles.begin(), _tiles.end(), _blank);
+    }
+}
+
+void AOVBuffer::write_row(const int& c,
+                          const int& y,
+                          const int& x,
+                          const int& n,
+                          const float* src)
+{
+    AOVPlane& tile = writable(c, y);
+    char* dst = samples(tile, y) + x * _bytes;
+    
+    if (!format_quantized(_format))
+    {
+        quantize_samples(src, n, _format, 0.0f, 0.0f, dst);
+        return;
+    }
+    
+    float lo, hi;
+    sample_range(src, n, lo, hi);
+    widen(tile, y - y % band, lo, hi);
+    
+    const float* r = range(tile);
+    quantize_samples(src, n, _format, r[0], r[1], dst);
+}
+
+void AOVBuffer::read_row(const int& c,
+                         const int& y,
+                         const int& x,
+                         const int& n,
+                         float* dst) const
+{
+    const AOVPlane& tile = *_tiles[c * _bands + y / band];
+    const char* src = samples(tile, y) + x * _bytes;
+    
+    if (format_quantized(_format))
+    {
+        const float* r = range(tile);
+        unpack_samples(src, n, _format, r[0], r[1], dst);
+    }
+    else
+        unpack_samples(src, n, _format, 0.0f, 0.0f, dst);
+}
+
+// Moves n steps, every spp-th one of src, onto another grid. The steps
+// get base added, then are shifted right by shift, rounding, or left
+// by -shift, then get top added.
+template <typename T>
+static void move_steps(const T* src,
+                       const int& spp,
+                       T* dst,
+                       const unsigned int& n,
+                       const long long& base,
+                       const int& shift,
+                       const long long& top,
+                       const long long& steps)
+{
+    const long long half = shift > 0 ? 1LL << (shift - 1) : 0;
+    const long long factor = shift < 0 ? 1LL << -shift : 1;
+    for (unsigned int i = 0; i < n; ++i, src += spp)
+    {
+        long long step = base + *src;
+        step = (shift > 0 ? (step + half) >> shift : step * factor) + top;
+        dst[i] = static_cast<T>(std::min(std::max(step, 0LL), steps));
+    }
+}
+
+// Smallest and largest of n steps, every spp-th one of src
+template <typename T>
+static void step_bounds(const T* src,
+                        const int& spp,
+                        const unsigned int& n,
+                        long long& lo,
+                        long long& hi)
+{
+    lo = hi = *src;
+    for (unsigned int i = 1; i < n; ++i)
+    {
+        src += spp;
+        lo = std::min<long long>(lo, *src);
+        hi = std::max<long long>(hi, *src);
+    }
+}
+
+// Steps of a step_range's offset, false if it isn't one
+static bool range_steps(const float& offset, const float& scale, long long& first)
+{
+    int e;
+    if (!(scale > 0.0f) || std::frexp(scale, &e) != 0.5f)
+        return false;
+    
+    const double steps = static_cast<double>(offset) / scale;
+    if (std::fabs(steps) >= 1e12 || steps != std::floor(steps))
+        return false;
+    
+    first = static_cast<long long>(steps);
+    return true;
+}
+
+bool AOVBuffer::write_steps(const int& c,
+                            const int& y,
+                            const int& x,
+                            const int& n,
+                            const void* src,
+                            const int& spp,
+                            const float& offset,
+                            const float& scale)
+{
+    long long first;
+    if (!format_quantized(_format) || n <= 0 || !range_steps(offset, scale, first))
+        return false;
+    
+    const bool u8 = _format == format_u8;
+    const unsigned char* src8 = static_cast<const unsigned char*>(src);
+    const unsigned short* src16 = static_cast<const unsigned short*>(src);
+    
+    // The range of the steps actually used
+    long long lo, hi;
+    if (u8)
+        step_bounds(src8, spp, n, lo, hi);
+    else
+        step_bounds(src16, spp, n, lo, hi);
+    
+    AOVPlane& tile = writable(c, y);
+    widen(tile, y - y % band, offset + lo * scale, offset + hi * scale);
+    
+    // Blank tiles left as they are take the floats
+    long long tile_first;
+    const float* r = range(tile);
+    if (!range_steps(r[0], r[1], tile_first))
+        return false;
+    
+    // Coarser tiles round the steps once, finer ones take them exactly
+    const int shift = std::ilogb(r[1]) - std::ilogb(scale);
+    if (shift > 40 || shift < -20)
+        return false;
+    
+    long long base = first, top = -tile_first;
+    if (shift > 0)
+    {
+        base = first - tile_first * (1LL << shift);
+        top = 0;
+    }
+    
+    char* dst = samples(tile, y) + x * _bytes;
+    if (u8)
+        move_steps(src8, spp, reinterpret_cast<unsigned char*>(dst), n, base, shift, top, 255);
+    else
+        move_steps(src16, spp, reinterpret_cast<unsigned short*>(dst), n, base, shift, top, 65535);
+    return true;
+}
+
+void AOVBuffer::widen(AOVPlane& tile,
+                      const int& y0,
+                      const float& lo,
+                      const float& hi)
+{
+    float* r = range(tile);
+    const float steps = format_steps(_format);
+    const float old_lo = r[0];
+    const float old_hi = r[0] + r[1] * steps;
+    
+    // Blank tiles cover just 0, which the unwritten pixels still are
+    if (lo >= old_lo && hi <= old_hi)
+        return;
+    
+    float new_lo = std::min(lo, old_lo);
+    float new_hi = std::max(hi, old_hi);
+    const int rows = std::min<int>(band, _height - y0);
+    
+    // Ranges are step_ranges, so a range 2^shift times wider takes the
+    // written steps over by a shift. Every pixel is rounded once per
+    // widening and the error stays within a step of the final range,
+    // where requantizing through floats would add up one per widening.
+    long long first;
+    if (range_steps(r[0], r[1], first))
+    {
+        for (int shift = 1; shift <= 24; ++shift)
+        {
+            const double new_scale = std::ldexp(static_cast<double>(r[1]), shift);
+            const double new_first = std::floor(new_lo / new_scale);
+            if ((new_first + steps) * new_scale < new_hi)
+                continue;
+            
+            const long long base = first - static_cast<long long>(std::ldexp(new_first, shift));
+            for (int y = y0; y < y0 + rows; ++y)
+            {
+                char* row = samples(tile, y);
+                if (_format == format_u8)
+                    move_steps(reinterpret_cast<unsigned char*>(row), 1,
+                               reinterpret_cast<unsigned char*>(row), _width, base, shift, 0, 255);
+                else
+                    move_steps(reinterpret_cast<unsigned short*>(row), 1,
+                               reinterpret_cast<unsigned short*>(row), _width, base, shift, 0, 65535);
+            }
+            
+            r[0] = static_cast<float>(new_first * new_scale);
+            r[1] = static_cast<float>(new_scale);
+            return;
+        }
+    }
+    
+    // First range of a blank tile, or one too far off the old one.
+    // Some headroom, so a growing range doesn't requantize every time.
+    const float margin = (new_hi - new_lo) / 8.0f;
+    if (lo < old_lo)
+        new_lo -= margin;
+    if (hi > old_hi)
+        new_hi += margin;
+    
+    float new_offset, new_scale;
+    step_range(new_lo, new_hi, _format, new_offset, new_scale);
+    
+    // Move the written steps over to the new range
+    std::vector<float> values(_width);
+    for (int y = y0; y < y0 + rows; ++y)
+    {
+        char* row = samples(tile, y);
+        unpack_samples(row, _width, _format, r[0], r[1], values.data());
+        quantize_samples(values.data(), _width, _format, new_offset, new_scale, row);
+    }
+    
+    r[0] = new_offset;
+    r[1] = new_scale;
+}
+
+size_t AOVBuffer::bytes() const
+{
+    size_t count = 0;
+    std::vector<AOVTile>::const_iterator it;
+    for (it = _tiles.begin(); it != _tiles.end(); ++it)
+        if (*it != _blank)
+            ++count;
+    return count * _tile_size * sizeof(float);
+}
+
+size_t AOVBuffer::band_bytes(const int& b) const
+{
+    if (b < 0 || b >= _bands || _tiles.empty())
+        return 0;
+    
+    size_t count = 0;
+    for (int c = 0; c < _spp; ++c)
+        if (_tiles[c * _bands + b] != _blank)
+            ++count;
+    return count * _tile_size * sizeof(float);
+}
+
+size_t AOVBuffer::unique_bytes() const
+{
+    size_t count = 0;
+    std::vector<AOVTile>::const_iterator it;
+    for (it = _tiles.begin(); it != _tiles.end(); ++it)
+        if (it->use_count() == 1)
+            ++count;
+    return count * _tile_size * sizeof(float);
+}
+
+void AOVBuffer::write(std::ostream& os) const
+{
+    for (int t = 0; t < static_cast<int>(_tiles.size()); ++t)
+    {
+        const char blank = _tiles[t] == _blank;
+        os.put(blank);
+        if (blank)
+            continue;
+        
+        // Only the rows inside the buffer, without their padding
+        const int y0 = (t % _bands) * band;
+        const int rows = std::min<int>(band, _height - y0);
+        const AOVPlane& tile = *_tiles[t];
+        for (int y = y0; y < y0 + rows; ++y)
+            os.write(samples(tile, y), _width * _bytes);
+        
+        if (format_quantized(_format))
+            os.write(reinterpret_cast<const char*>(range(tile)), 2 * sizeof(float));
+    }
+}
+
+bool AOVBuffer::read(std::istream& is)
+{
+    resize(_width, _height);
+    
+    for (int t = 0; t < static_cast<int>(_tiles.size()); ++t)
+    {
+        const int blank = is.get();
+        if (blank != 0)
+        {
+            if (blank != 1)
+                return false;
+            continue;
+        }
+        
+        const int y0 = (t % _bands) * band;
+        const int rows = std::min<int>(band, _height - y0);
+        AOVTile tile = std::make_shared<AOVPlane>(_tile_size, 0.0f);
+        for (int y = y0; y < y0 + rows; ++y)
+            is.read(samples(*tile, y), _width * _bytes);
+        
+        if (format_quantized(_format))
+            is.read(reinterpret_cast<char*>(range(*tile)), 2 * sizeof(float));
+        
+        if (!is)
+            return false;
+        _tiles[t] = tile;
+    }
+    return true;
+}
+
+void AOVBuffer::release()
+{
+    _blank.reset();
+    std::vector<AOVTile>().swap(_tiles);
+}
+
+void AOVBuffer::detach(AOVTile& tile)
+{
+    tile = std::make_shared<AOVPlane>(*tile);
+}
@@ -0,0 +1,170 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef AOVBuffer_h
+#define AOVBuffer_h
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <iosfwd>
+#include <boost/align/aligned_allocator.hpp>
+
+#include "aton_format.h"
+
+// Cache line aligned float storage
+typedef std::vector<float, boost::alignment::aligned_allocator<float, 64> > AOVPlane;
+
+// A band of rows of one plane, shared between copies until written
+typedef std::shared_ptr<AOVPlane> AOVTile;
+
+// Splits n interleaved pixels of spp floats into spp planar rows
+// Uses SSE or AVX kernels where the CPU supports them.
+void deinterleave(const float* src,
+                  const int& n,
+                  const int& spp,
+                  float* const* dst);
+
+// AOV Buffer class
+// Pixels are stored planar, one plane per channel. Every row of a plane
+// starts on a 64 byte boundary, so a row of one channel is contiguous.
+// Planes are split in tiles of whole rows, copies of the buffer share
+// their tiles and a tile is only copied when one of its rows is written.
+// Samples are kept in the buffer's pixel_format. Quantized tiles carry
+// their own step_range after the rows, widened as brighter or darker
+// pixels arrive. Widening coarsens the steps by powers of two, so the rows
+// already written move over by a shift of their steps, and so do the
+// steps of buckets received in the format.
+class AOVBuffer
+{
+    friend class RenderBuffer;
+    
+public:
+    // Rows per tile
+    static const int band = 16;
+    
+    AOVBuffer(const unsigned int& width = 0,
+              const unsigned int& height = 0,
+              const int& spp = 0,
+              const int& format = format_float);
+    
+    // Samples-per-pixel, aka number of planes
+    const int& spp() const { return _spp; }
+    
+    // Format of the samples
+    const int& format() const { return _format; }
+    
+    // Samples from one row of a plane to the next
+    const size_t& stride() const { return _stride; }
+    
+    // Row y of plane c of a format_float buffer,
+    // writable rows get their tile copied if it's shared
+    float* row(const int& c, const int& y)
+    {
+        return reinterpret_cast<float*>(samples(writable(c, y), y));
+    }
+    
+    const float* row(const int& c, const int& y) const
+    {
+        return reinterpret_cast<const float*>(samples(*_tiles[c * _bands + y / band], y));
+    }
+    
+    // Convert n floats into row y of plane c from x on, any format
+    void write_row(const int& c,
+                   const int& y,
+                   const int& x,
+                   const int& n,
+                   const float* src);
+    
+    // Store n steps of a bucket in the buffer's quantized format, every
+    // spp-th one from src on, in row y of plane c from x on. Steps on the
+    // tile's grid are stored as they are, the others move over by a shift.
+    // Returns false if the bucket's range isn't a step_range.
+    bool write_steps(const int& c,
+                     const int& y,
+                     const int& x,
+                     const int& n,
+                     const void* src,
+                     const int& spp,
+                     const float& offset,
+                     const float& scale);
+    
+    // Convert n samples of row y of plane c from x on to floats
+    void read_row(const int& c,
+                  const int& y,
+                  const int& x,
+                  const int& n,
+                  float* dst) const;
+    
+    // Resize all planes, clearing their pixels
+    void resize(const unsigned int& width,
+                const unsigned int& height);
+    
+    // Bytes of the written tiles, and of those not shared with other buffers
+    size_t bytes() const;
+    size_t unique_bytes() const;
+    
+    // Bytes of the written tiles of a band of rows, over all planes
+    size_t band_bytes(const int& b) const;
+    
+    // Write the pixels, leaving out the blank tiles and the rows padding
+    void write(std::ostream& os) const;
+    
+    // Read the pixels back from write, returns false on a short read
+    bool read(std::istream& is);
+    
+    // Drop the pixels but keep the size, read brings them back
+    void release();
+    
+private:
+    // Give the tile its own copy of the pixels
+    static void detach(AOVTile& tile);
+    
+    // Tile of row y of plane c, copied if it's shared
+    AOVPlane& writable(const int& c, const int& y)
+    {
+        AOVTile& tile = _tiles[c * _bands + y / band];
+        if (tile.use_count() != 1)
+            detach(tile);
+        return *tile;
+    }
+    
+    // Start of row y in its tile
+    char* samples(AOVPlane& tile, const int& y) const
+    {
+        return reinterpret_cast<char*>(tile.data()) + (y % band) * _stride * _bytes;
+    }
+    
+    const char* samples(const AOVPlane& tile, const int& y) const
+    {
+        return reinterpret_cast<const char*>(tile.data()) + (y % band) * _stride * _bytes;
+    }
+    
+    // Offset and scale of a quantized tile, after its rows
+    float* range(AOVPlane& tile) const { return tile.data() + _rows_size; }
+    const float* range(const AOVPlane& tile) const { return tile.data() + _rows_size; }
+    
+    // Widen a quantized tile's range to cover lo and hi, at least doubling
+    // its scale, which costs the steps already written a bit each time
+    void widen(AOVPlane& tile,
+               const int& y0,
+               const float& lo,
+               const float& hi);
+    
+    int _spp;
+    int _format;
+    size_t _bytes;
+    int _bands;
+    unsigned int _width;
+    unsigned int _height;
+    size_t _stride;
+    size_t _rows_size;
+    size_t _tile_size;
+    AOVTile _blank;
+    std::vector<AOVTile> _tiles;
+};
+
+#endif /* AOVBuffer_h */
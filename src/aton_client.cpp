@@ -5,6 +5,9 @@ All rights reserved. See COPYING.txt for more details.
 */
 
 #include "aton_client.h"
+#include <chrono>
+#include <cstring>
+#include <boost/array.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
@@ -36,11 +39,21 @@ const std::string get_host()
 
 const bool host_exists(const char* host)
 {
+    if (!get_unix_path(host).empty())
+        return true;
+    
     boost::system::error_code ec;
     ip::address::from_string(host, ec);
     return !ec;
 }
 
+const std::string get_unix_path(const std::string& host)
+{
+    if (host.compare(0, 5, "unix:") != 0)
+        return std::string();
+    return host.substr(5);
+}
+
 const long long get_unique_id()
 {
     using namespace boost::posix_time;
@@ -55,6 +68,56 @@ const int pack_4_int(int a, int b, int c, int d)
     return a * 1000000 + b * 10000 + c * 100 + d;
 }
 
+size_t get_shm_size()
+{
+    const char* def_size = getenv("ATON_SHM_SIZE");
+    
+    // In megabytes
+    size_t aton_size = 32;
+    if (def_size != NULL)
+        aton_size = atoi(def_size);
+    
+    return aton_size << 20;
+}
+
+int get_codec()
+{
+    const char* def_codec = getenv("ATON_CODEC");
+    
+    if (def_codec == NULL)
+        return codec_shuffle_lz;
+    
+    return atoi(def_codec);
+}
+
+size_t get_delta_size()
+{
+    const char* def_size = getenv("ATON_DELTA_SIZE");
+    
+    // In megabytes
+    size_t aton_size = 256;
+    if (def_size != NULL)
+        aton_size = atoi(def_size);
+    
+    return aton_size << 20;
+}
+
+int get_handshake_timeout()
+{
+    const char* def_timeout = getenv("ATON_HANDSHAKE_TIMEOUT");
+    
+    if (def_timeout == NULL)
+        return 0;
+    
+    return atoi(def_timeout);
+}
+
+long long get_clock()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
 // Data Class
 DataHeader::DataHeader(const long long& index,
                        const int& xres,
@@ -70,8 +133,8 @@ DataHeader::DataHeader(const long long& index,
                                                  mXres(xres),
                                                  mYres(yres),
                                                  mPixAspectRatio(pix_aspect),
-                                                 mRArea(region_area),
                                                  mVersion(version),
+                                                 mRArea(region_area),
                                                  mFrame(frame),
                                                  mCamFov(cam_fov),
                                                  mOutputName(output_name)
@@ -85,12 +148,6 @@ DataHeader::DataHeader(const long long& index,
 
 DataHeader::~DataHeader() {}
 
-void DataHeader::free()
-{
-    delete[] mOutputName;
-    mOutputName = NULL;
-}
-
 DataPixels::DataPixels(const long long& session,
                        const int& xres,
                        const int& yres,
@@ -102,7 +159,8 @@ DataPixels::DataPixels(const long long& session,
                        const long long& ram,
                        const int& time,
                        const char* aovName,
-                       const float* data) : mSession(session),
+                       const float* data,
+                       const int& format) : mSession(session),
                                             mXres(xres),
                                             mYres(yres),
                                             mBucket_xo(bucket_xo),
@@ -112,30 +170,43 @@ DataPixels::DataPixels(const long long& session,
                                             mSpp(spp),
                                             mRam(ram),
                                             mTime(time),
-                                            mAovName(aovName)
-
+                                            mAovName(aovName),
+                                            mFormat(format),
+                                            mStamp(0),
+                                            mReceived(0),
+                                            mpData(const_cast<float*>(data)),
+                                            mpSteps(NULL),
+                                            mOffset(0.0f),
+                                            mScale(0.0f)
 {
-    if (data != NULL)
-        mpData = const_cast<float*>(data);
 }
 
 DataPixels::~DataPixels() {}
 
-void DataPixels::free()
-{
-    delete[] mAovName;
-    mAovName = NULL;
-}
-
 
 // Client Class
 Client::Client(std::string hostname, int port): mHost(hostname),
                                                 mPort(port),
                                                 mImageId(-1),
-                                                mSocket(mIoService),
-                                                mIsConnected(false)
+                                                mProtocol(0),
+                                                mMaxProtocol(protocol_current),
+                                                mHandshakeTimeout(get_handshake_timeout()),
+                                                mTimedOut(false),
+                                                mIsConnected(false),
+                                                mShmSize(get_shm_size()),
+                                                mIsLocal(false),
+                                                mCodec(get_codec()),
+                                                mUseCodec(false),
+                                                mDeltaSize(get_delta_size()),
+                                                mDeltaBudget(0),
+                                                mDeltaBytes(0),
+                                                mUseDelta(false),
+                                                mClockOffset(0),
+                                                mLastStamp(0),
+                                                mSocket(mIoService)
 {
     mPort_str = std::to_string(port);
+    mStats = WireStats();
 }
 
 Client::~Client()
@@ -145,30 +216,223 @@ Client::~Client()
 
 void Client::connect()
 {
+    boost::system::error_code error = boost::asio::error::host_not_found;
+    
+    // A new session on the server, which knows nothing of the old one
+    mRing.close();
+    mDeltaTiles.clear();
+    mDeltaBytes = 0;
+    mLastStamp = 0;
+    
+    // Unix domain socket
+    const std::string path = get_unix_path(mHost);
+    if (!path.empty())
+    {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        mSocket.close();
+        mSocket.connect(local::stream_protocol::endpoint(path), error);
+#endif
+        if (error)
+            throw boost::system::system_error(error);
+        mIsLocal = true;
+        return;
+    }
+    
     using boost::asio::ip::tcp;
     tcp::resolver resolver(mIoService);
     tcp::resolver::query query(mHost.c_str(), mPort_str.c_str());
     tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
     tcp::resolver::iterator end;
-    boost::system::error_code error = boost::asio::error::host_not_found;
     while (error && endpoint_iterator != end)
     {
+        const tcp::endpoint endpoint = *endpoint_iterator++;
+        mIsLocal = endpoint.address().is_loopback();
         mSocket.close();
-        mSocket.connect(*endpoint_iterator++, error);
+        mSocket.connect(endpoint, error);
     }
     if (error)
         throw boost::system::system_error(error);
+    
+    // Don't hold back the small messages
+    mSocket.set_option(tcp::no_delay(true), error);
 }
 
 void Client::disconnect()
 {
     mSocket.close();
+    mRing.close();
+}
+
+void Client::handshake()
+{
+    mProtocol = protocol_legacy;
+    mTimedOut = false;
+    if (mMaxProtocol <= protocol_legacy)
+        return;
+    
+    // Ask for the server's protocol version
+    int key = 3;
+    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+    
+    // Servers predating the handshake silently skip the unknown key,
+    // so give up waiting after a while and keep the legacy protocol.
+    // Remote servers get longer, their reply may be on its way.
+    int timeout = mHandshakeTimeout;
+    if (timeout <= 0)
+        timeout = mIsLocal ? 250 : 5000;
+    
+    int version = 0;
+    bool replied = false;
+    deadline_timer timer(mIoService, boost::posix_time::milliseconds(timeout));
+    
+    async_read(mSocket, buffer(reinterpret_cast<char*>(&version), sizeof(int)),
+               [&](const boost::system::error_code& ec, size_t)
+               {
+                   replied = !ec;
+                   timer.cancel();
+               });
+    
+    timer.async_wait([&](const boost::system::error_code& ec)
+                     {
+                         if (!ec)
+                             mSocket.cancel();
+                     });
+    mIoService.reset();
+    mIoService.run();
+    
+    if (replied)
+        mProtocol = std::min(version, mMaxProtocol);
+    
+    // A late reply would be read as the server's, so start
+    // over on a connection which never asked for one
+    else
+    {
+        mTimedOut = true;
+        connect();
+    }
+    
+    // Only servers on this machine can map our memory,
+    // the others keep getting the pixels through the socket
+    if (mProtocol >= protocol_shared)
+        attach_ring();
+    
+    // Compression only pays off over the network
+    mUseCodec = mProtocol >= protocol_codec && !mIsLocal && mCodec == codec_shuffle_lz;
+    
+    // Both sides keep the references, so the smaller budget of the two
+    // holds. Older servers can't tell theirs and disconnect past it.
+    mDeltaBudget = mDeltaSize;
+    if (mProtocol >= protocol_budget)
+    {
+        key = 12;
+        unsigned long long budget = 0;
+        write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+        read(mSocket, buffer(reinterpret_cast<char*>(&budget), sizeof(unsigned long long)));
+        mDeltaBudget = std::min<size_t>(mDeltaSize, budget);
+    }
+    
+    // And so do deltas, which only pay off compressed
+    mUseDelta = mProtocol >= protocol_delta && mUseCodec && mDeltaBudget > 0;
+}
+
+bool Client::alive()
+{
+    if (!mSocket.is_open())
+        return false;
+    
+    // Anything to read, the end of the stream included, means it's gone
+    boost::system::error_code ec, nb;
+    char byte;
+    mSocket.non_blocking(true, nb);
+    mSocket.receive(buffer(&byte, 1), 0, ec);
+    mSocket.non_blocking(false, nb);
+    
+    return ec == boost::asio::error::would_block;
+}
+
+bool Client::sync()
+{
+    if (mProtocol < protocol_framed || !mSocket.is_open())
+        return false;
+    
+    // A session handles its messages in order, so the answer to
+    // a handshake only comes back once the buckets before it are done
+    int key = 3, version = 0;
+    boost::system::error_code ec;
+    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)), ec);
+    if (!ec)
+        read(mSocket, buffer(reinterpret_cast<char*>(&version), sizeof(int)), ec);
+    
+    return !ec;
+}
+
+void Client::sync_clock()
+{
+    // The server's time is taken half way through the round trip,
+    // more or less, so the shortest of a few gives the best estimate
+    long long best = -1;
+    for (int i = 0; i < 3; ++i)
+    {
+        int key = 11;
+        long long server = 0;
+        const long long sent = get_clock();
+        write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+        read(mSocket, buffer(reinterpret_cast<char*>(&server), sizeof(long long)));
+        const long long now = get_clock();
+        
+        if (best < 0 || now - sent < best)
+        {
+            best = now - sent;
+            mClockOffset = server - (sent + now) / 2;
+        }
+    }
+}
+
+bool Client::attach_ring()
+{
+    if (!mIsLocal || mShmSize == 0 || !mRing.create(mShmSize))
+        return false;
+    
+    // Send the ring's name and wait for the server to map it
+    int key = 5;
+    const unsigned int name_size = static_cast<unsigned int>(mRing.name().size());
+    boost::array<const_buffer, 3> message = {{
+        buffer(reinterpret_cast<const char*>(&key), sizeof(int)),
+        buffer(reinterpret_cast<const char*>(&name_size), sizeof(unsigned int)),
+        buffer(mRing.name()) }};
+    write(mSocket, message);
+    
+    int mapped = 0;
+    read(mSocket, buffer(reinterpret_cast<char*>(&mapped), sizeof(int)));
+    
+    // Both sides have it mapped, nothing to leak if either dies
+    mRing.unlink();
+    
+    if (!mapped)
+        mRing.close();
+    
+    return mapped != 0;
 }
 
 void Client::send_header(DataHeader& header)
 {
-    // Connect to port!
-    connect();
+    // Servers speaking the delta protocol keep the connection between
+    // images, and with it the buckets the next pass' deltas refer to
+    if (mProtocol < protocol_delta || !alive())
+    {
+        // Connect to port!
+        connect();
+        
+        // Negotiate the protocol version
+        handshake();
+    }
+    
+    // Clocks drift, so measure them again for every image
+    if (mProtocol >= protocol_timed)
+        sync_clock();
+    
+    mStats = WireStats();
+    mLastStamp = 0;
 
     // Send image header message with image desc information
     int key = 0;
@@ -199,16 +463,113 @@ void Client::send_header(DataHeader& header)
 
 void Client::send_pixels(DataPixels& pixels)
 {
-    // Send data for image_id
-    int key = 1;
-    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
-
     // Get size of aov name
     size_t aov_size = strlen(pixels.mAovName) + 1;
 
     // Get size of overall samples
     const int num_samples = pixels.mBucket_size_x * pixels.mBucket_size_y * pixels.mSpp;
     
+    mStats.buckets++;
+    mStats.raw_bytes += sizeof(float) * num_samples;
+    
+    // The aovs of a bucket share its stamp, which goes out once before
+    // them, converted to the server's clock
+    if (mProtocol >= protocol_timed && pixels.mStamp != 0 && pixels.mStamp != mLastStamp)
+    {
+        int key = 10;
+        const long long stamp = pixels.mStamp + mClockOffset;
+        boost::array<const_buffer, 2> message = {{
+            buffer(reinterpret_cast<const char*>(&key), sizeof(int)),
+            buffer(reinterpret_cast<const char*>(&stamp), sizeof(long long)) }};
+        
+        mStats.wire_bytes += write(mSocket, message);
+        mLastStamp = pixels.mStamp;
+    }
+    
+    if (mProtocol >= protocol_framed)
+    {
+        PixelsFrame frame = { pixels.mSession,
+                              pixels.mXres,
+                              pixels.mYres,
+                              pixels.mBucket_xo,
+                              pixels.mBucket_yo,
+                              pixels.mBucket_size_x,
+                              pixels.mBucket_size_y,
+                              pixels.mSpp,
+                              pixels.mRam,
+                              pixels.mTime,
+                              static_cast<unsigned int>(aov_size) };
+        
+        // Reduced pixels and deltas always go through the socket,
+        // at a fraction of the size
+        if (mUseDelta || (pixels.mFormat != format_float && mProtocol >= protocol_reduced))
+        {
+            send_reduced(pixels, frame);
+            return;
+        }
+        
+        // Copy the bucket into the ring and only send where it is,
+        // falling back to the socket if the server doesn't make room
+        if (mRing.is_open())
+        {
+            const size_t offset = shm_pixels_offset(frame.aov_size);
+            const size_t size = (offset + sizeof(float) * num_samples + 63) / 64 * 64;
+            
+            ShmPixelsFrame shm_frame = { 0, static_cast<unsigned int>(size) };
+            char* record = mRing.reserve(size, 1000, shm_frame.position);
+            
+            if (record != NULL)
+            {
+                memcpy(record, &frame, sizeof(PixelsFrame));
+                memcpy(record + sizeof(PixelsFrame), pixels.mAovName, aov_size);
+                memcpy(record + offset, pixels.mpData, sizeof(float) * num_samples);
+                mRing.commit(shm_frame.position, size);
+                
+                int key = 6;
+                boost::array<const_buffer, 2> message = {{
+                    buffer(reinterpret_cast<const char*>(&key), sizeof(int)),
+                    buffer(reinterpret_cast<const char*>(&shm_frame), sizeof(ShmPixelsFrame)) }};
+                
+                mStats.wire_bytes += write(mSocket, message);
+                return;
+            }
+        }
+        
+        // Compress it for remote servers
+        if (mUseCodec)
+        {
+            const int count = pixels.mBucket_size_x * pixels.mBucket_size_y;
+            CodecPixelsFrame codec_frame = { frame, static_cast<unsigned int>(mCodec), 0 };
+            codec_frame.size = static_cast<unsigned int>(encode_pixels(pixels.mpData, count,
+                                                                       pixels.mSpp, mEncoded));
+            
+            int key = 7;
+            boost::array<const_buffer, 4> message = {{
+                buffer(reinterpret_cast<const char*>(&key), sizeof(int)),
+                buffer(reinterpret_cast<const char*>(&codec_frame), sizeof(CodecPixelsFrame)),
+                buffer(pixels.mAovName, aov_size),
+                buffer(mEncoded) }};
+            
+            mStats.wire_bytes += write(mSocket, message);
+            return;
+        }
+        
+        // Send the whole bucket with a single gathered write
+        int key = 4;
+        boost::array<const_buffer, 4> message = {{
+            buffer(reinterpret_cast<const char*>(&key), sizeof(int)),
+            buffer(reinterpret_cast<const char*>(&frame), sizeof(PixelsFrame)),
+            buffer(pixels.mAovName, aov_size),
+            buffer(reinterpret_cast<const char*>(&pixels.mpData[0]), sizeof(float)*num_samples) }};
+        
+        mStats.wire_bytes += write(mSocket, message);
+        return;
+    }
+    
+    // Send data for image_id
+    int key = 1;
+    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
+
     // Sending data to buffer
     write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mSession), sizeof(long long)));
     write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mXres), sizeof(int)));
@@ -223,6 +584,81 @@ void Client::send_pixels(DataPixels& pixels)
     write(mSocket, buffer(reinterpret_cast<char*>(&aov_size), sizeof(size_t)));
     write(mSocket, buffer(pixels.mAovName, aov_size));
     write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mpData[0]), sizeof(float)*num_samples));
+    
+    mStats.wire_bytes += sizeof(int) + sizeof(LegacyPixelsFrame) + aov_size + sizeof(float) * num_samples;
+}
+
+void Client::send_reduced(DataPixels& pixels, const PixelsFrame& frame)
+{
+    const size_t num_samples = static_cast<size_t>(pixels.mBucket_size_x) *
+                               pixels.mBucket_size_y * pixels.mSpp;
+    const int bytes = static_cast<int>(format_bytes(pixels.mFormat));
+    
+    // Quantized formats cover the range of the bucket
+    float offset, scale;
+    mReduced.resize(num_samples * bytes);
+    size_t size = pack_samples(pixels.mpData, num_samples, pixels.mFormat,
+                               &mReduced[0], offset, scale);
+    const std::vector<char>* payload = &mReduced;
+    
+    DeltaPixelsFrame delta_frame = { { frame,
+                                       static_cast<unsigned int>(pixels.mFormat),
+                                       codec_none, offset, scale, 0 },
+                                     delta_none };
+    ReducedPixelsFrame& reduced_frame = delta_frame.reduced;
+    
+    // Only what changed since the last pass
+    if (mUseDelta)
+        delta_frame.delta = delta_code(pixels, size);
+    
+    // Compressed on top for remote servers
+    if (mUseCodec)
+    {
+        reduced_frame.codec = mCodec;
+        size = encode_pixels(&mReduced[0], pixels.mBucket_size_x * pixels.mBucket_size_y,
+                             pixels.mSpp, mEncoded, bytes);
+        payload = &mEncoded;
+    }
+    reduced_frame.size = static_cast<unsigned int>(size);
+    
+    int key = mUseDelta ? 9 : 8;
+    boost::array<const_buffer, 4> message = {{
+        buffer(reinterpret_cast<const char*>(&key), sizeof(int)),
+        buffer(reinterpret_cast<const char*>(&delta_frame),
+               mUseDelta ? sizeof(DeltaPixelsFrame) : sizeof(ReducedPixelsFrame)),
+        buffer(pixels.mAovName, frame.aov_size),
+        buffer(&(*payload)[0], size) }};
+    
+    mStats.wire_bytes += write(mSocket, message);
+}
+
+unsigned int Client::delta_code(const DataPixels& pixels, const size_t& size)
+{
+    // The aov name followed by the bucket's geometry and format
+    const int tile[6] = { pixels.mBucket_xo,
+                          pixels.mBucket_yo,
+                          pixels.mBucket_size_x,
+                          pixels.mBucket_size_y,
+                          pixels.mSpp,
+                          pixels.mFormat };
+    mDeltaKey.assign(pixels.mAovName);
+    mDeltaKey.append(reinterpret_cast<const char*>(tile), sizeof(tile));
+    
+    // First pass over the tile, keep it if there's room left
+    std::unordered_map<std::string, std::vector<char> >::iterator it = mDeltaTiles.find(mDeltaKey);
+    if (it == mDeltaTiles.end())
+    {
+        if (mDeltaBytes + size > mDeltaBudget)
+            return delta_none;
+        
+        mDeltaTiles[mDeltaKey].assign(mReduced.begin(), mReduced.begin() + size);
+        mDeltaBytes += size;
+        return delta_key;
+    }
+    
+    delta_encode(&mReduced[0], &it->second[0], size);
+    mStats.deltas++;
+    return delta_xor;
 }
 
 void Client::close_image()
@@ -234,11 +670,3 @@ void Client::close_image()
     // Disconnect from port!
     disconnect();
 }
-
-void Client::quit()
-{
-    connect();
-    int key = 9;
-    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
-    disconnect();
-}
@@ -8,18 +8,154 @@ All rights reserved. See COPYING.txt for more details.
 #define ATON_CLIENT_H_
 
 #include <vector>
+#include <string>
+#include <unordered_map>
 #include <boost/asio.hpp>
 
+#include "aton_shm.h"
+#include "aton_codec.h"
+#include "aton_format.h"
+
 const int get_port();
 
 const std::string get_host();
 
 const bool host_exists(const char* host);
 
+// Socket path of a "unix:/path" host, empty for TCP hosts
+const std::string get_unix_path(const std::string& host);
+
 const long long get_unique_id();
 
 const int pack_4_int(int a, int b, int c, int d);
 
+// Shared memory ring size for local servers in bytes, 0 disables it
+size_t get_shm_size();
+
+// Pixel codec for remote servers
+int get_codec();
+
+// Memory for the buckets deltas refer to in bytes, 0 disables deltas
+size_t get_delta_size();
+
+// Time to wait for the handshake's reply in milliseconds,
+// 0 waits 250 ms for local servers and 5 s for remote ones
+int get_handshake_timeout();
+
+// Monotonic clock in nanoseconds, buckets get stamped with it
+long long get_clock();
+
+// Wire protocol versions, negotiated by the Client on send_header()
+enum protocol
+{
+    protocol_legacy = 1,    // One write per field
+    protocol_framed = 2,    // Packed pixels header and gathered payload
+    protocol_shared = 3,    // Pixels through shared memory for local servers
+    protocol_codec = 4,     // Compressed pixels for remote servers
+    protocol_reduced = 5,   // Half and quantized pixels
+    protocol_delta = 6,     // Deltas to the previous pass, connections kept between images
+    protocol_timed = 7,     // Buckets stamped with the time they were rendered
+    protocol_budget = 8,    // Server's delta budget asked for after the handshake
+    protocol_current = protocol_budget
+};
+
+#pragma pack(push, 1)
+// Fixed size part of a framed pixels message,
+// followed on the wire by the aov name and the pixel data
+struct PixelsFrame
+{
+    long long session;
+    int xres, yres;
+    int bucket_xo, bucket_yo;
+    int bucket_size_x, bucket_size_y;
+    int spp;
+    long long ram;
+    unsigned int time;
+    unsigned int aov_size;
+};
+
+// Fixed size part of a header message,
+// followed on the wire by the output name
+struct HeaderFrame
+{
+    long long session;
+    int xres, yres;
+    float pix_aspect;
+    long long region_area;
+    int version;
+    float frame;
+    float cam_fov;
+    float cam_matrix[16];
+    int samples[6];
+    size_t output_size;
+};
+
+// Fixed size part of a legacy pixels message, as written field by field
+struct LegacyPixelsFrame
+{
+    long long session;
+    int xres, yres;
+    int bucket_xo, bucket_yo;
+    int bucket_size_x, bucket_size_y;
+    int spp;
+    long long ram;
+    unsigned int time;
+    size_t aov_size;
+};
+
+// Fixed size part of a compressed pixels message,
+// followed on the wire by the aov name and the encoded pixels
+struct CodecPixelsFrame
+{
+    PixelsFrame pixels;
+    unsigned int codec;
+    unsigned int size;
+};
+
+// Fixed size part of a reduced pixels message, followed on the wire by
+// the aov name and the samples in the format, encoded with the codec
+struct ReducedPixelsFrame
+{
+    PixelsFrame pixels;
+    unsigned int format;
+    unsigned int codec;
+    float offset;
+    float scale;
+    unsigned int size;
+};
+
+// Fixed size part of a delta pixels message, followed on the wire as
+// a reduced one, with the samples delta coded before the codec
+struct DeltaPixelsFrame
+{
+    ReducedPixelsFrame reduced;
+    unsigned int delta;
+};
+
+// Shared memory pixels message, the record holds a PixelsFrame,
+// the aov name and the pixel data from shm_pixels_offset on
+struct ShmPixelsFrame
+{
+    unsigned long long position;
+    unsigned int size;
+};
+#pragma pack(pop)
+
+// Offset of the pixels in a shared memory record, 16 bytes aligned
+inline size_t shm_pixels_offset(const unsigned int& aov_size)
+{
+    return (sizeof(PixelsFrame) + aov_size + 15) / 16 * 16;
+}
+
+
+// Pixel traffic of the current image, reset by send_header()
+struct WireStats
+{
+    long long buckets;      // Buckets sent
+    long long deltas;       // Of those, sent as deltas to the previous pass
+    long long raw_bytes;    // Float pixels handed to send_pixels
+    long long wire_bytes;   // Pixel messages written, shared memory aside
+};
 
 class Client;
 
@@ -27,6 +163,7 @@ class DataHeader
 {
     friend class Client;
     friend class Server;
+    friend class Session;
     
 public:
     
@@ -74,9 +211,6 @@ public:
     const std::vector<int>& samples() const { return mSamplesStore; }
     
     const char* output_name() const { return mOutputName; }
-    
-    // Deallocate output name
-    void free();
 
 private:
     // Session index
@@ -116,6 +250,7 @@ class DataPixels
 {
     friend class Client;
     friend class Server;
+    friend class Session;
     
 public:
     DataPixels(const long long& session = 0,
@@ -129,7 +264,8 @@ public:
                const long long& ram = 0,
                const int& time = 0,
                const char* aovName = NULL,
-               const float* data = NULL);
+               const float* data = NULL,
+               const int& format = format_float);
     
     ~DataPixels();
     
@@ -166,14 +302,29 @@ public:
     // Get Aov name
     const char* aov_name() const { return mAovName; }
     
+    // Format the pixels are sent and stored in, the data is always floats
+    const int& format() const { return mFormat; }
+    
+    // get_clock() time the renderer finished the bucket, 0 if unknown.
+    // Servers get it in their own clock.
+    const long long& stamp() const { return mStamp; }
+    void set_stamp(const long long& stamp) { mStamp = stamp; }
+    
+    // Server's get_clock() time the bucket's message started coming in
+    const long long& received() const { return mReceived; }
+    
     // Pointer to pixel data owned by the display driver (client-side)
     const float* data() const { return mpData; }
     
-    // Reference to pixel data owned by this object (server-side)
-    const float& pixel(int index = 0) { return mPixelStore[index]; }
+    // Reference to received pixel data (server-side), either in this
+    // object's storage or in the shared memory ring
+    const float& pixel(int index = 0) { return mpData[index]; }
     
-    // Deallocate Aov name
-    void free();
+    // Received samples of a quantized format as they came in, interleaved
+    // like the floats, and their range. NULL for the other formats.
+    const void* steps() const { return mpSteps; }
+    const float& offset() const { return mOffset; }
+    const float& scale() const { return mScale; }
     
 private:
     // Session index
@@ -200,9 +351,19 @@ private:
     // AOV Name
     const char *mAovName;
     
+    // Pixel format
+    int mFormat;
+    
+    // Render and receive times
+    long long mStamp, mReceived;
+    
     // Our pixel data pointer (for driver-owned pixels)
     float *mpData;
     
+    // Quantized samples and their range (server-side)
+    const void* mpSteps;
+    float mOffset, mScale;
+    
     // Our persistent pixel storage (for Data-owned pixels)
     std::vector<float> mPixelStore;
 };
@@ -215,7 +376,6 @@ private:
 // call open_image(), send_pixels(), and close_image() to send an image to the Server
 class Client
 {
-    friend class Server;
 public:
     // Creates a new Client object and tell it to connect any messages to
     // the specified host/port
@@ -241,21 +401,104 @@ public:
     void close_image();
     
     bool connected() { return mIsConnected; }
+    
+    // Negotiated wire protocol version, 0 until the first header was sent
+    const int& protocol() const { return mProtocol; }
+    
+    // Caps the protocol version used with the server,
+    // protocol_legacy skips the handshake entirely
+    void set_protocol(const int& version) { mMaxProtocol = version; }
+    
+    // Size of the shared memory ring used with local servers, 0 disables it
+    void set_shm_size(const size_t& size) { mShmSize = size; }
+    
+    // Pixel codec used with remote servers, codec_none disables it
+    void set_codec(const int& codec) { mCodec = codec; }
+    
+    // Codec in use, codec_none until the first header was sent
+    int codec() const { return mUseCodec ? mCodec : codec_none; }
+    
+    // Whether the pixels go through a shared memory ring
+    bool shared() const { return mRing.is_open(); }
+    
+    // Time to wait for the handshake's reply in milliseconds, 0 for the default
+    void set_handshake_timeout(const int& ms) { mHandshakeTimeout = ms; }
+    
+    // Whether the last handshake went unanswered, which
+    // leaves the connection on protocol_legacy
+    bool timed_out() const { return mTimedOut; }
+    
+    // Memory for the buckets deltas refer to, 0 disables deltas
+    // The server's budget caps it further, once the handshake is done
+    void set_delta_size(const size_t& size) { mDeltaSize = size; }
+    
+    // Whether buckets are sent as deltas to the previous pass
+    bool delta() const { return mUseDelta; }
+    
+    // Traffic since the last header
+    const WireStats& wire_stats() const { return mStats; }
+    
+    // Blocks until the server has handled everything sent so far,
+    // false if the connection is gone or its protocol can't tell
+    bool sync();
 
     void connect();
     void disconnect();
 private:
-    void quit();
+    // Asks the server which protocol version it speaks
+    void handshake();
+    
+    // Hands a shared memory ring to a local server
+    bool attach_ring();
+    
+    // Whether the connection is still up, servers never talk unasked
+    bool alive();
+    
+    // Sends the pixels in their reduced format, or as a delta
+    void send_reduced(DataPixels& pixels, const PixelsFrame& frame);
+    
+    // Delta codes the packed samples against the tile's last ones
+    unsigned int delta_code(const DataPixels& pixels, const size_t& size);
+    
+    // Measures the offset of the server's clock to ours
+    void sync_clock();
     
     // Store the port we should connect to
     std::string mHost;
     std::string mPort_str;
     int mPort, mImageId;
+    int mProtocol, mMaxProtocol;
+    int mHandshakeTimeout;
+    bool mTimedOut;
     bool mIsConnected;
     
-    // TCP stuff
+    // Shared memory stuff
+    size_t mShmSize;
+    ShmRing mRing;
+    
+    // Whether the server is on this machine
+    bool mIsLocal;
+    
+    // Compression stuff
+    int mCodec;
+    bool mUseCodec;
+    std::vector<char> mEncoded;
+    std::vector<char> mReduced;
+    
+    // Delta stuff, the last samples sent per aov and tile
+    size_t mDeltaSize, mDeltaBudget, mDeltaBytes;
+    bool mUseDelta;
+    std::string mDeltaKey;
+    std::unordered_map<std::string, std::vector<char> > mDeltaTiles;
+    
+    WireStats mStats;
+    
+    // Server's clock minus ours, and the last stamp sent
+    long long mClockOffset, mLastStamp;
+    
+    // TCP or Unix domain socket stuff
     boost::asio::io_service mIoService;
-    boost::asio::ip::tcp::socket mSocket;
+    boost::asio::generic::stream_protocol::socket mSocket;
 };
 
 #endif // ATON_CLIENT_H_
@@ -0,0 +1,522 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_codec.h"
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+
+// Shortest match worth a sequence
+static const size_t min_match = 4;
+
+// Farthest match the 16 bit offsets reach
+static const size_t max_offset = 65535;
+
+// Matches don't start in, nor run into, the last bytes
+static const size_t end_literals = 12;
+
+// Match finder table size
+static const int hash_bits = 13;
+
+// Planes stored as is have this bit set in their size
+static const unsigned int stored = 0x80000000u;
+
+// Smallest buckets worth decoding on several threads
+static const size_t parallel_samples = 4096;
+
+// Threads decoding the byte planes of large buckets, shared by every
+// caller. A caller takes part in its own batch while it waits for it,
+// so batches of concurrent callers never wait on each other.
+class PlanePool
+{
+public:
+    static PlanePool& instance()
+    {
+        static PlanePool pool;
+        return pool;
+    }
+    
+    // Worker threads besides the calling one
+    size_t workers() const { return mThreads.size(); }
+    
+    // Calls fn(context, i) for every i below n, in any order, returns
+    // once all calls returned. The tasks' storage is kept, so batches
+    // don't allocate once the pool is warm.
+    void run(const int& n, void (*fn)(void*, int), void* context)
+    {
+        Batch batch = { fn, context, {n} };
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (int i = 1; i < n; ++i)
+            {
+                Task task = { &batch, i };
+                mTasks.push_back(task);
+            }
+        }
+        mWork.notify_all();
+        
+        Task first = { &batch, 0 };
+        execute(first);
+        
+        while (true)
+        {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mDone.wait(lock, [this, &batch] { return batch.left == 0 || !mTasks.empty(); });
+                if (batch.left == 0)
+                    return;
+                task = mTasks.back();
+                mTasks.pop_back();
+            }
+            execute(task);
+        }
+    }
+    
+private:
+    struct Batch
+    {
+        void (*fn)(void*, int);
+        void* context;
+        std::atomic<int> left;
+    };
+    
+    struct Task
+    {
+        Batch* batch;
+        int index;
+    };
+    
+    PlanePool(): mStop(false)
+    {
+        // Floats have 4 planes, the caller decodes one of them
+        const unsigned int cores = std::thread::hardware_concurrency();
+        const unsigned int threads = std::min(cores > 1 ? cores - 1 : 0u, 3u);
+        for (unsigned int i = 0; i < threads; ++i)
+            mThreads.push_back(std::thread(&PlanePool::work, this));
+    }
+    
+    ~PlanePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWork.notify_all();
+        
+        std::vector<std::thread>::iterator it;
+        for (it = mThreads.begin(); it != mThreads.end(); ++it)
+            it->join();
+    }
+    
+    void work()
+    {
+        while (true)
+        {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mWork.wait(lock, [this] { return mStop || !mTasks.empty(); });
+                if (mTasks.empty())
+                    return;
+                task = mTasks.back();
+                mTasks.pop_back();
+            }
+            execute(task);
+        }
+    }
+    
+    // The batch's caller checks left under the lock, so the last task
+    // takes it before waking the callers
+    void execute(const Task& task)
+    {
+        task.batch->fn(task.batch->context, task.index);
+        if (--task.batch->left == 0)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mDone.notify_all();
+        }
+    }
+    
+    bool mStop;
+    std::vector<Task> mTasks;
+    std::vector<std::thread> mThreads;
+    std::mutex mMutex;
+    std::condition_variable mWork, mDone;
+};
+
+static inline unsigned int read32(const unsigned char* p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int hash4(const unsigned int& v)
+{
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+static inline unsigned char* write_length(unsigned char* op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = static_cast<unsigned char>(length);
+    return op;
+}
+
+static inline bool read_length(const unsigned char*& ip,
+                               const unsigned char* end,
+                               size_t& length)
+{
+    unsigned char b;
+    do
+    {
+        if (ip >= end)
+            return false;
+        b = *ip++;
+        length += b;
+    }
+    while (b == 255);
+    return true;
+}
+
+size_t lz_bound(const size_t& n)
+{
+    return n + n / 255 + 16;
+}
+
+size_t lz_compress(const unsigned char* src,
+                   const size_t& n,
+                   unsigned char* dst)
+{
+    unsigned int table[1 << hash_bits];
+    std::fill(table, table + (1 << hash_bits), 0u);
+
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;
+    const unsigned char* end = src + n;
+    const unsigned char* limit = n > end_literals ? end - end_literals : src;
+    unsigned char* op = dst;
+
+    while (ip < limit)
+    {
+        const unsigned int sequence = read32(ip);
+        const unsigned int h = hash4(sequence);
+        const unsigned char* ref = src + table[h];
+        table[h] = static_cast<unsigned int>(ip - src);
+
+        if (ref >= ip || static_cast<size_t>(ip - ref) > max_offset || read32(ref) != sequence)
+        {
+            // Skip faster through data that doesn't compress
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        // Extend the match
+        const unsigned char* match_end = ip + min_match;
+        const unsigned char* match_limit = end - 5;
+        for (const unsigned char* rp = ref + min_match;
+             match_end < match_limit && *match_end == *rp; ++match_end, ++rp);
+
+        const size_t literals = ip - anchor;
+        const size_t match = match_end - ip - min_match;
+
+        unsigned char* token = op++;
+        *token = static_cast<unsigned char>((std::min<size_t>(literals, 15) << 4) |
+                                             std::min<size_t>(match, 15));
+        if (literals >= 15)
+            op = write_length(op, literals - 15);
+        memcpy(op, anchor, literals);
+        op += literals;
+
+        const size_t offset = ip - ref;
+        *op++ = static_cast<unsigned char>(offset & 255);
+        *op++ = static_cast<unsigned char>(offset >> 8);
+
+        if (match >= 15)
+            op = write_length(op, match - 15);
+
+        anchor = ip = match_end;
+    }
+
+    // The rest as the last literals, without a match
+    const size_t literals = end - anchor;
+    *op++ = static_cast<unsigned char>(std::min<size_t>(literals, 15) << 4);
+    if (literals >= 15)
+        op = write_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - dst;
+}
+
+bool lz_decompress(const unsigned char* src,
+                   const size_t& size,
+                   unsigned char* dst,
+                   const size_t& n)
+{
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + size;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + n;
+
+    while (ip < iend)
+    {
+        const unsigned int token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(ip, iend, literals))
+            return false;
+
+        if (literals > static_cast<size_t>(iend - ip) ||
+            literals > static_cast<size_t>(oend - op))
+            return false;
+
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        // The last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return false;
+
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > static_cast<size_t>(op - dst))
+            return false;
+
+        size_t match = token & 15;
+        if (match == 15 && !read_length(ip, iend, match))
+            return false;
+        match += min_match;
+
+        if (match > static_cast<size_t>(oend - op))
+            return false;
+
+        // Overlapping matches repeat the last offset bytes
+        const unsigned char* ref = op - offset;
+        if (offset >= match)
+            memcpy(op, ref, match);
+        else
+            for (size_t i = 0; i < match; ++i)
+                op[i] = ref[i];
+        op += match;
+    }
+
+    return op == oend;
+}
+
+size_t encode_pixels(const void* src,
+                     const int& count,
+                     const int& spp,
+                     std::vector<char>& dst,
+                     const int& bytes)
+{
+    const size_t samples = static_cast<size_t>(count) * spp;
+    
+    dst.clear();
+    if (samples == 0 || bytes <= 0)
+        return 0;
+    
+    static thread_local std::vector<unsigned char> planes;
+    planes.resize(bytes * samples);
+    
+    // Byte b of channel c of pixel i goes to planes[b][c][i]
+    const unsigned char* in = static_cast<const unsigned char*>(src);
+    for (int i = 0; i < count; ++i)
+        for (int c = 0; c < spp; ++c, in += bytes)
+            for (int b = 0; b < bytes; ++b)
+                planes[b * samples + c * count + i] = in[b];
+    
+    // Differences to the previous byte
+    for (int b = 0; b < bytes; ++b)
+    {
+        unsigned char* plane = &planes[b * samples];
+        unsigned char previous = 0;
+        for (size_t k = 0; k < samples; ++k)
+        {
+            const unsigned char value = plane[k];
+            plane[k] = value - previous;
+            previous = value;
+        }
+    }
+    
+    // Each plane as [size][data], stored as is if it doesn't shrink
+    dst.resize(encode_bound(samples, bytes));
+    size_t pos = 0;
+    
+    for (int b = 0; b < bytes; ++b)
+    {
+        const unsigned char* plane = &planes[b * samples];
+        unsigned char* out = reinterpret_cast<unsigned char*>(&dst[pos + sizeof(unsigned int)]);
+        
+        size_t length = lz_compress(plane, samples, out);
+        unsigned int header = static_cast<unsigned int>(length);
+        
+        if (length >= samples)
+        {
+            memcpy(out, plane, samples);
+            length = samples;
+            header = static_cast<unsigned int>(samples) | stored;
+        }
+        
+        memcpy(&dst[pos], &header, sizeof(unsigned int));
+        pos += sizeof(unsigned int) + length;
+    }
+    
+    dst.resize(pos);
+    return pos;
+}
+
+size_t encode_bound(const size_t& samples, const int& bytes)
+{
+    return bytes * (sizeof(unsigned int) + lz_bound(samples));
+}
+
+// A bucket decode_pixels splits in tasks, one per byte plane
+struct PlaneDecode
+{
+    const char* src;
+    const unsigned int* headers;
+    const size_t* starts;
+    unsigned char* planes;
+    unsigned char* dst;
+    size_t samples;
+    int count, spp, bytes;
+    std::atomic<bool> corrupt;
+    
+    // Decompresses plane b and undoes its differences
+    static void decode(void* context, int b)
+    {
+        PlaneDecode& job = *static_cast<PlaneDecode*>(context);
+        const size_t& samples = job.samples;
+        const size_t length = job.headers[b] & ~stored;
+        const unsigned char* in = reinterpret_cast<const unsigned char*>(job.src + job.starts[b]);
+        unsigned char* plane = job.planes + b * samples;
+        
+        if (job.headers[b] & stored)
+            memcpy(plane, in, samples);
+        else if (!lz_decompress(in, length, plane, samples))
+        {
+            job.corrupt = true;
+            return;
+        }
+        
+        unsigned char previous = 0;
+        for (size_t k = 0; k < samples; ++k)
+            previous = plane[k] = plane[k] + previous;
+    }
+    
+    // Gathers the bytes of the chunk's range of pixels into samples,
+    // the pixels are split in as many chunks as there are planes
+    static void gather(void* context, int chunk)
+    {
+        PlaneDecode& job = *static_cast<PlaneDecode*>(context);
+        const int& count = job.count;
+        const int& spp = job.spp;
+        const int& bytes = job.bytes;
+        const int begin = static_cast<int>(static_cast<long long>(count) * chunk / bytes);
+        const int end = static_cast<int>(static_cast<long long>(count) * (chunk + 1) / bytes);
+        
+        unsigned char* out = job.dst + static_cast<size_t>(begin) * spp * bytes;
+        for (int i = begin; i < end; ++i)
+            for (int c = 0; c < spp; ++c, out += bytes)
+                for (int b = 0; b < bytes; ++b)
+                    out[b] = job.planes[b * job.samples + c * count + i];
+    }
+};
+
+bool decode_pixels(const char* src,
+                   const size_t& size,
+                   const int& count,
+                   const int& spp,
+                   void* dst,
+                   const int& bytes)
+{
+    const size_t samples = static_cast<size_t>(count) * spp;
+    
+    if (samples == 0 || bytes <= 0)
+        return size == 0;
+    
+    static thread_local std::vector<unsigned char> planes;
+    planes.resize(bytes * samples);
+    
+    // Where each plane starts, its sizes are read first
+    static thread_local std::vector<unsigned int> headers;
+    static thread_local std::vector<size_t> starts;
+    headers.resize(bytes);
+    starts.resize(bytes);
+    
+    size_t pos = 0;
+    for (int b = 0; b < bytes; ++b)
+    {
+        if (size - pos < sizeof(unsigned int))
+            return false;
+        memcpy(&headers[b], src + pos, sizeof(unsigned int));
+        pos += sizeof(unsigned int);
+        
+        const size_t length = headers[b] & ~stored;
+        if (length > size - pos || ((headers[b] & stored) && length != samples))
+            return false;
+        
+        starts[b] = pos;
+        pos += length;
+    }
+    
+    if (pos != size)
+        return false;
+    
+    // Then the planes independently of each other, and the samples
+    // gathered back from them a range of pixels at a time
+    PlaneDecode job = { src, &headers[0], &starts[0], &planes[0],
+                        static_cast<unsigned char*>(dst),
+                        samples, count, spp, bytes, {false} };
+    
+    PlanePool& pool = PlanePool::instance();
+    if (samples >= parallel_samples && bytes > 1 && pool.workers() > 0)
+    {
+        pool.run(bytes, &PlaneDecode::decode, &job);
+        if (job.corrupt)
+            return false;
+        pool.run(bytes, &PlaneDecode::gather, &job);
+        return true;
+    }
+    
+    for (int b = 0; b < bytes && !job.corrupt; ++b)
+        PlaneDecode::decode(&job, b);
+    if (job.corrupt)
+        return false;
+    
+    for (int chunk = 0; chunk < bytes; ++chunk)
+        PlaneDecode::gather(&job, chunk);
+    return true;
+}
+
+void delta_encode(char* data, char* reference, const size_t& n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        const char value = data[i];
+        data[i] ^= reference[i];
+        reference[i] = value;
+    }
+}
+
+void delta_decode(char* data, char* reference, const size_t& n)
+{
+    for (size_t i = 0; i < n; ++i)
+        reference[i] = data[i] ^= reference[i];
+}
@@ -0,0 +1,74 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_CODEC_H_
+#define ATON_CODEC_H_
+
+#include <vector>
+#include <cstddef>
+
+// Pixel codecs, a Client only uses one the server has acknowledged
+enum codec
+{
+    codec_none = 0,
+    codec_shuffle_lz = 1    // Byte planes per channel, delta coded, then LZ
+};
+
+// Encodes count pixels of spp interleaved samples of the given bytes,
+// floats by default, with codec_shuffle_lz. Each byte of the samples
+// goes to its own plane, channel by channel, and every plane stores the
+// difference to the previous byte. Flat and smooth areas turn into runs
+// of zeros there, which the LZ stage squeezes.
+// Returns the encoded size.
+size_t encode_pixels(const void* src,
+                     const int& count,
+                     const int& spp,
+                     std::vector<char>& dst,
+                     const int& bytes = sizeof(float));
+
+// Most bytes encode_pixels writes for the given number of samples
+size_t encode_bound(const size_t& samples, const int& bytes = sizeof(float));
+
+// Decodes count pixels of spp samples, false if the data is corrupt.
+// The byte planes of large buckets are decoded in parallel, on a few
+// threads shared by the process and the calling one.
+bool decode_pixels(const char* src,
+                   const size_t& size,
+                   const int& count,
+                   const int& spp,
+                   void* dst,
+                   const int& bytes = sizeof(float));
+
+// Delta coding of a bucket against the last one sent for the same tile
+enum delta
+{
+    delta_none = 0,     // Sent as is
+    delta_key = 1,      // Sent as is and kept as the tile's reference
+    delta_xor = 2       // XORed with the tile's reference, then replaces it
+};
+
+// XORs n bytes of data with the reference, which takes the former data.
+// Samples barely changing between passes leave mostly zero bytes.
+void delta_encode(char* data, char* reference, const size_t& n);
+
+// Undoes delta_encode, the reference takes the restored data
+void delta_decode(char* data, char* reference, const size_t& n);
+
+// Byte oriented LZ77, literal runs and matches of 4 bytes or more
+// within the last 64KB. Needs lz_bound(n) bytes of room.
+size_t lz_bound(const size_t& n);
+
+size_t lz_compress(const unsigned char* src,
+                   const size_t& n,
+                   unsigned char* dst);
+
+// False unless the input decodes to exactly n bytes
+bool lz_decompress(const unsigned char* src,
+                   const size_t& size,
+                   unsigned char* dst,
+                   const size_t& n);
+
+#endif // ATON_CODEC_H_
@@ -6,6 +6,10 @@ All rights reserved. See COPYING.txt for more details.
 
 #include <ai.h>
 #include "aton_client.h"
+#include "aton_send_queue.h"
+
+#include <sstream>
+#include <algorithm>
 
 AI_DRIVER_NODE_EXPORT_METHODS(AtonDriverMtd);
 
@@ -33,10 +37,42 @@ inline const long long calc_rarea(int minx,
 struct ShaderData
 {
     Client* client;
+    SendQueue* queue;
     long long session;
     int xres, yres, min_x, min_y, max_x, max_y;
+    int reduced_format;
+    std::vector<std::string> reduced_aovs;
+    bool preview;
 };
 
+// AOV names separated by spaces or commas
+inline std::vector<std::string> split_aovs(std::string aovs)
+{
+    std::replace(aovs.begin(), aovs.end(), ',', ' ');
+    std::istringstream stream(aovs);
+    
+    std::vector<std::string> names;
+    std::string name;
+    while (stream >> name)
+        names.push_back(name);
+    return names;
+}
+
+// Format an AOV is sent in, "*" reduces every AOV but the beauty.
+// Integer AOVs hold ID bits in their floats, which no reduced format
+// keeps, so they always go as they are.
+inline int aov_format(const ShaderData* data, const char* aov_name, const int& pixel_type)
+{
+    if (pixel_type == AI_TYPE_INT || pixel_type == AI_TYPE_UINT)
+        return format_float;
+    
+    const std::vector<std::string>& aovs = data->reduced_aovs;
+    if (std::find(aovs.begin(), aovs.end(), aov_name) != aovs.end() ||
+        (strcmp(aov_name, "RGBA") != 0 && std::find(aovs.begin(), aovs.end(), "*") != aovs.end()))
+        return data->reduced_format;
+    return format_float;
+}
+
 enum reconnect
 {
     disabled = 0,
@@ -51,6 +87,18 @@ node_parameters
     AiParameterStr("output", "");
     AiParameterInt("session", 0);
     AiParameterInt("reconnect", reconnect::disabled);
+    AiParameterInt("queue_size", 64);
+    AiParameterInt("queue_policy", SendQueue::block);
+    AiParameterStr("reduced_aovs", "");
+    AiParameterInt("reduced_format", format_half);
+    
+    // Reduced formats are lossy: half keeps 11 bits, u16 and u8 are steps of
+    // a range per tile in Nuke, which loses a bit of the pixels already
+    // written whenever brighter or darker ones widen it
+    AiMetaDataSetStr(nentry, "reduced_format", AtString("desc"),
+                     AtString("Format of the reduced AOVs: 0 float, 1 half, 2 u16, 3 u8. "
+                              "Half keeps 11 bits of precision, u16 and u8 store steps of "
+                              "a range which coarsens as brighter or darker pixels arrive."));
     
     AiMetaDataSetStr(nentry, NULL, AtString("maya.translator"), AtString("aton"));
     AiMetaDataSetStr(nentry, NULL, AtString("maya.attr_prefix"), AtString(""));
@@ -60,8 +108,11 @@ node_parameters
 
 node_initialize
 {
-    ShaderData* data = (ShaderData*)AiMalloc(sizeof(ShaderData));
+    ShaderData* data = new ShaderData();
     data->client = NULL;
+    data->queue = NULL;
+    data->reduced_format = format_float;
+    data->preview = false;
     
     data->session = AiNodeGetInt(node, AtString("session"));
     if (data->session == 0)
@@ -153,6 +204,17 @@ driver_open
 
     const char* output = AiNodeGetStr(node, AtString("output"));
     
+    // Progressive passes below one AA sample get rendered over by later
+    // ones, their buckets may be dropped by a full queue
+    data->preview = aa_samples < 1;
+    
+    // Utility AOVs sent as half or quantized, the beauty stays float
+    const char* reduced_aovs = AiNodeGetStr(node, AtString("reduced_aovs"));
+    data->reduced_aovs = split_aovs(reduced_aovs);
+    data->reduced_format = AiNodeGetInt(node, AtString("reduced_format"));
+    if (format_bytes(data->reduced_format) == 0)
+        data->reduced_format = format_float;
+    
     // Make image header & send to server
     DataHeader dh(data->session,
                   data->xres,
@@ -173,9 +235,35 @@ driver_open
     if (data->client == NULL)
         data->client = new Client(host, port);
     
+    // Send queue, buckets are sent from the render threads if disabled
+    const int queue_size = AiNodeGetInt(node, AtString("queue_size"));
+    const int queue_policy = AiNodeGetInt(node, AtString("queue_policy"));
+    
+    // Built again if they changed since the last render,
+    // sending what's left in the old one first
+    if (data->queue != NULL &&
+        (queue_size <= 0 ||
+         data->queue->capacity() != static_cast<size_t>(queue_size) ||
+         data->queue->policy() != queue_policy))
+    {
+        delete data->queue;
+        data->queue = NULL;
+    }
+    
+    if (data->queue == NULL && queue_size > 0)
+        data->queue = new SendQueue(data->client, queue_size, queue_policy);
+    
+    // Previous image has to go out before the new header
+    if (data->queue != NULL)
+        data->queue->flush();
+    
     try
     {
         data->client->send_header(dh);
+        
+        if (data->client->timed_out())
+            AiMsgWarning("ATON | Host %s with Port %i didn't answer the handshake, "
+                         "falling back to the legacy protocol", host, port);
     }
     catch(const std::exception &e)
     {
@@ -204,15 +292,38 @@ driver_write_bucket
     if (data->min_y < 0)
         bucket_yo = bucket_yo - data->min_y;
     
+    const long long memory = AiMsgUtilGetUsedMemory();
+    const unsigned int time = AiMsgUtilGetElapsedTime();
+    
+    // Arnold is done with the bucket, the server measures its latency from here
+    const long long stamp = get_clock();
+    
+    // Queued bucket, copied here and sent from the queue's thread
+    SendBucket* bucket = NULL;
+    if (data->queue != NULL)
+    {
+        bucket = data->queue->acquire();
+        bucket->session = data->session;
+        bucket->xres = data->xres;
+        bucket->yres = data->yres;
+        bucket->bucket_xo = bucket_xo;
+        bucket->bucket_yo = bucket_yo;
+        bucket->bucket_size_x = bucket_size_x;
+        bucket->bucket_size_y = bucket_size_y;
+        bucket->ram = memory;
+        bucket->time = time;
+        bucket->stamp = stamp;
+        bucket->preview = data->preview;
+        bucket->reconnect = reconnect_mode != reconnect::disabled;
+        bucket->disconnect = reconnect_mode == reconnect::always;
+    }
     // Reconnect to server
-    if (reconnect_mode)
+    else if (reconnect_mode)
         data->client->connect();
 
     while (AiOutputIteratorGetNext(iterator, &aov_name, &pixel_type, &bucket_data))
     {
         const float* ptr = reinterpret_cast<const float*>(bucket_data);
-        const long long memory = AiMsgUtilGetUsedMemory();
-        const unsigned int time = AiMsgUtilGetElapsedTime();
         
         switch (pixel_type)
         {
@@ -228,6 +339,14 @@ driver_write_bucket
                 spp = 3;
         }
         
+        const int format = aov_format(data, aov_name, pixel_type);
+        
+        if (bucket != NULL)
+        {
+            bucket->add_aov(aov_name, spp, ptr, format);
+            continue;
+        }
+        
         // Create our DataPixels object
         DataPixels dp(data->session,
                       data->xres,
@@ -240,19 +359,48 @@ driver_write_bucket
                       memory,
                       time,
                       aov_name,
-                      ptr);
-
+                      ptr,
+                      format);
+        
+        dp.set_stamp(stamp);
         data->client->send_pixels(dp);
     }
     
+    if (bucket != NULL)
+        data->queue->push(bucket);
     // Disconnect from server
-    if (reconnect_mode == reconnect::always)
+    else if (reconnect_mode == reconnect::always)
         data->client->disconnect();
 }
 
 driver_close 
 {
-
+    ShaderData* data = (ShaderData*)AiNodeGetLocalData(node);
+    
+    if (data->queue != NULL)
+    {
+        data->queue->flush();
+        
+        const SendStats stats = data->queue->stats();
+        AiMsgInfo("ATON | Sent %lld buckets, dropped %lld, coalesced %lld, "
+                  "blocked %lld times for %.1f ms",
+                  stats.sent, stats.dropped, stats.coalesced,
+                  stats.blocked, stats.blocked_ms);
+        
+        if (stats.errors > 0)
+            AiMsgWarning("ATON | Failed to send %lld buckets! %s",
+                         stats.errors, data->queue->last_error().c_str());
+    }
+    
+    // Bytes on the wire for this pass, smaller once passes go as deltas
+    if (data->client != NULL)
+    {
+        const WireStats& wire = data->client->wire_stats();
+        AiMsgInfo("ATON | Pass sent %.2f MB for %.2f MB of pixels, "
+                  "%lld of %lld buckets as deltas",
+                  wire.wire_bytes / 1048576.0, wire.raw_bytes / 1048576.0,
+                  wire.deltas, wire.buckets);
+    }
 }
 
 node_finish
@@ -260,8 +408,9 @@ node_finish
     // Release the driver
     ShaderData* data = (ShaderData*)AiNodeGetLocalData(node);
     
+    delete data->queue;
     delete data->client;
-    AiFree(data);
+    delete data;
 }
 
 node_loader
@@ -10,23 +10,45 @@ All rights reserved. See COPYING.txt for more details.
 #include "aton_node.h"
 
 // Our FrameBuffer updater thread
+// Sleeps until it's woken by wake_updater(), or until buckets which came
+// in too early for the refresh rate are due, and stops with m_legit.
 static void fb_updater(unsigned index, unsigned nthreads, void* data)
 {
     Aton* node = reinterpret_cast<Aton*>(data);
-    double frame, prev_frame = 0;
-    const int ms = 20;
+    std::unique_lock<std::mutex> lock(node->m_updater_mutex);
     
-    while (node->m_legit && node->m_multiframes)
+    while (node->m_legit)
     {
-        frame = node->uiContext().frame();
+        const unsigned int events = node->m_updater_events;
+        node->m_updater_events = Aton::event_none;
+        lock.unlock();
         
-        if (!node->m_framebuffers.empty() && frame != prev_frame)
-        {
+        // Show the RenderBuffer of the new frame
+        if ((events & Aton::event_frame) && node->m_multiframes && !node->m_framebuffers.empty())
             node->flag_update();
-            prev_frame = frame;
+        
+        // Refresh the late buckets, or see when they're due
+        bool pending = false;
+        std::chrono::steady_clock::time_point due;
+        {
+            Guard status(node->m_status_mutex);
+            
+            int area[4];
+            if (node->m_refresh.take(area, node->m_refresh_rate))
+                node->refresh_area(area);
+            
+            pending = node->m_refresh.pending();
+            due = node->m_refresh.due(node->m_refresh_rate);
+        }
+        
+        lock.lock();
+        while (node->m_legit && node->m_updater_events == Aton::event_none)
+        {
+            if (!pending)
+                node->m_updater_cond.wait(lock);
+            else if (node->m_updater_cond.wait_until(lock, due) == std::cv_status::timeout)
+                break;
         }
-        else
-            SleepMS(ms);
     }
 }
 
@@ -11,260 +11,401 @@ All rights reserved. See COPYING.txt for more details.
 
 #include "aton_node.h"
 
-// Our RenderBuffer writer thread
-static void fb_writer(unsigned index, unsigned nthreads, void* data)
+// Per connection state of the writer
+struct WriterSession
 {
-    bool killThread = false;
-    Aton* node = reinterpret_cast<Aton*> (data);
+    WriterSession(): fb(NULL), rb(NULL), fb_session(0), fb_generation(0) {}
+    
+    // Data pointers
+    FrameBuffer* fb;
+    RenderBuffer* rb;
+    
+    // Session and Framebuffers List generation fb was found for
+    long long fb_session;
+    unsigned long long fb_generation;
+    
+    // Active Aovs names holder
+    std::vector<std::string> active_aovs;
+    AOVIndex active_index;
+    
+    // Keep the index in sync with the names
+    void update_active()
+    {
+        active_index.clear();
+        for (size_t i = 0; i < active_aovs.size(); ++i)
+            active_index.insert(active_aovs[i], static_cast<int>(i));
+    }
+};
 
-    while (!killThread)
+// Our RenderBuffer writer, fed by the Server's threads
+class FBWriter: public ServerHandler
+{
+public:
+    FBWriter(Aton* node): m_node(node) {}
+    
+    void session_opened(Session& session)
     {
-        // Accept incoming connections!
-        node->m_server.accept();
+        session.set_data(new WriterSession());
+        
+        WriteGuard lock(m_node->m_mutex);
+        m_node->m_running = true;
+    }
+    
+    void session_closed(Session& session)
+    {
+        delete reinterpret_cast<WriterSession*>(session.data());
+        session.set_data(NULL);
+        
+        // The last buckets don't wait for the refresh interval
+        flush_refresh();
+        
+        WriteGuard lock(m_node->m_mutex);
+        m_node->m_running = m_node->m_server.sessions() > 0;
+    }
+    
+    // Open a new image
+    void header_received(Session& session, DataHeader& dh)
+    {
+        Aton* node = m_node;
+        WriterSession* ws = reinterpret_cast<WriterSession*>(session.data());
+        FrameBuffer*& fb = ws->fb;
+        RenderBuffer*& rb = ws->rb;
+        std::vector<std::string>& active_aovs = ws->active_aovs;
+        rb = NULL;
+
+        // Get Current Session Index
+        const int& _version = dh.version();
+        const float& _fov = dh.camera_fov();
+        const char* _name = dh.output_name();
+        const long long& _session = dh.session();
+        const std::vector<int> _samples = dh.samples();
+        const long long& _region_area = dh.region_area();
+        const double& _frame = static_cast<double>(dh.frame());
+        const std::vector<float>& _matrix = dh.camera_matrix();
 
-        // Data pointers
-        FrameBuffer* fb = NULL;
-        RenderBuffer* rb = NULL;
+        // Get FrameBuffer
+        std::vector<FrameBuffer>& fbs = node->m_framebuffers;
         
-        // Our incoming data object
-        int data_type = 0;
+        // Show the end of the previous pass
+        flush_refresh();
         
-        // Active Aovs names holder
-        std::vector<std::string> active_aovs;
+        WriteGuard lock(node->m_mutex);
+        node->m_running = true;
+        fb = node->get_framebuffer(_session);
+        bool& multiframe = node->m_multiframes;
         
-        // Loop over incoming data
-        while (data_type != 2 || data_type != 9)
+        if (multiframe)
         {
-            // Listen for some data
-            try
+            if (!fbs.empty())
             {
-                data_type = node->m_server.listen_type();
-                WriteGuard lock(node->m_mutex);
-                node->m_running = true;
+                if (fb == NULL)
+                    fb = &fbs.back();
+                
+                if (!fb->renderbuffer_exists(_frame))
+                {
+                    rb = fb->add_renderbuffer(&dh);
+                    node->m_output_changed = Aton::item_added;
+                }
+                else
+                {
+                    fb->update_renderbuffer(&dh);
+                    node->m_output_changed = Aton::item_added;
+                }
+            }
+        }
+        else
+        {
+            if (!fbs.empty())
+            {
+                if (fb == NULL)
+                {
+                    fb = node->add_framebuffer();
+                    rb = fb->add_renderbuffer(&dh);
+                }
+                else
+                    fb->update_renderbuffer(&dh);
+            }
+        }
+        
+        if (fbs.empty())
+        {
+            fb = node->add_framebuffer();
+            rb = fb->add_renderbuffer(&dh);
+        }
+        
+        // Set FrameBuffer frame
+        node->set_current_frame(_frame);
+        if (fb->frame_changed(_frame))
+            fb->set_frame(_frame);
+        
+        // Get current RenderBuffer
+        if (rb == NULL)
+            rb = fb->get_renderbuffer(_frame);
+        
+        // Nothing to write the image to
+        if (rb == NULL)
+            return;
+        
+        // Keep it in memory while it's rendering
+        rb->restore();
+        rb->set_last_used(++node->m_cache_tick);
+        
+        // Update Name
+        if (rb->name_changed(_name))
+            rb->set_name(_name);
+        
+        // Update Frame
+        if (rb->frame_changed(_frame))
+            rb->set_frame(_frame);
+        
+        // Update Camera
+        if (rb->camera_changed(_fov, _matrix))
+            rb->set_camera(_fov, _matrix);
+        
+        // Update Version
+        if (rb->get_version_int() != _version)
+            rb->set_version(_version);
+        
+        // Update Samples
+        if (rb->get_samples_int() != _samples)
+            rb->set_samples(_samples);
+        
+        // Update Region Area
+        rb->set_region_area(_region_area);
+        
+        // Update AOVs
+        if (!active_aovs.empty())
+        {
+            if(rb->aovs_changed(active_aovs))
+            {
+                rb->resize(1);
+                rb->set_ready(false);
+                node->reset_channels(node->m_channels);
             }
-            catch( ... )
+            active_aovs.clear();
+            ws->update_active();
+        }
+        
+        // Headers can move the session to another Framebuffer
+        node->index_framebuffers();
+        
+        // Make room for the new image
+        node->cache_renderbuffers(rb);
+    }
+    
+    // Write image data
+    void pixels_received(Session& session, DataPixels& dp)
+    {
+        Aton* node = m_node;
+        WriterSession* ws = reinterpret_cast<WriterSession*>(session.data());
+        std::vector<std::string>& active_aovs = ws->active_aovs;
+        
+        const char* _aov_name = dp.aov_name();
+        
+        // Time the bucket spent on its way and in the Server
+        const long long decoded = get_clock();
+        const long long& stamp = dp.stamp();
+        if (stamp != 0)
+            node->m_latency[Aton::latency_receive].record(dp.received() - stamp);
+        node->m_latency[Aton::latency_decode].record(decoded - dp.received());
+
+        // Get active aov names
+        if (ws->active_index.find(_aov_name) < 0)
+        {
+            if (node->m_enable_aovs || active_aovs.empty())
+            {
+                active_aovs.push_back(_aov_name);
+                ws->active_index.insert(active_aovs.back(),
+                                        static_cast<int>(active_aovs.size() - 1));
+            }
+            else if (active_aovs.size() > 1)
+            {
+                active_aovs.resize(1);
+                ws->update_active();
+            }
+        }
+        
+        // Skip non RGBA buckets if AOVs are disabled
+        if (!node->m_enable_aovs && active_aovs[0] != _aov_name)
+        {
+            node->m_dropped++;
+            return;
+        }
+        
+        // Pixels only share the node's lock, the rows they write get
+        // locked by the RenderBuffer. Changes to the aovs or resolution
+        // take the node's lock exclusively first.
+        int b = -1;
+        node->m_mutex.readLock();
+        node->m_lock_wait_ns += get_clock() - decoded;
+        while (!locate(ws, dp, false, b))
+        {
+            node->m_mutex.unlock();
             {
                 WriteGuard lock(node->m_mutex);
-                node->m_running = false;
-                break;
+                locate(ws, dp, true, b);
             }
+            node->m_mutex.readLock();
+        }
+        
+        if (b >= 0)
+        {
+            FrameBuffer* fb = ws->fb;
+            RenderBuffer* rb = ws->rb;
             
-            // Handle the data we received
-            switch (data_type)
-            {
-                case 0: // Open a new image
-                {
-                    // Get Data Header
-                    DataHeader dh = node->m_server.listenHeader();
+            // Get Data Pixels
+            const int& _spp = dp.spp();
+            const int& _time = dp.time();
+            const int& _x = dp.bucket_xo();
+            const int& _y = dp.bucket_yo();
+            const long long& _ram = dp.ram();
+            const int& _width = dp.bucket_size_x();
+            const int& _height = dp.bucket_size_y();
 
-                    // Get Current Session Index
-                    const int& _version = dh.version();
-                    const float& _fov = dh.camera_fov();
-                    const char* _name = dh.output_name();
-                    const long long& _session = dh.session();
-                    const std::vector<int> _samples = dh.samples();
-                    const long long& _region_area = dh.region_area();
-                    const double& _frame = static_cast<double>(dh.frame());
-                    const Matrix4& _matrix = Matrix4(&dh.camera_matrix()[0]);
+            // Get RenderBuffer height
+            const int& h = rb->get_height();
 
-                    // Get FrameBuffer
-                    std::vector<FrameBuffer>& fbs = node->m_framebuffers;
-                    
-                    WriteGuard lock(node->m_mutex);
-                    fb = node->get_framebuffer(_session);
-                    bool& multiframe = node->m_multiframes;
-                    
-                    if (multiframe)
-                    {
-                        if (!fbs.empty())
-                        {
-                            if (fb == NULL)
-                                fb = &fbs.back();
-                            
-                            if (!fb->renderbuffer_exists(_frame))
-                            {
-                                rb = fb->add_renderbuffer(&dh);
-                                node->m_output_changed = Aton::item_added;
-                            }
-                            else
-                            {
-                                fb->update_renderbuffer(&dh);
-                                node->m_output_changed = Aton::item_added;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        if (!fbs.empty())
-                        {
-                            if (fb == NULL)
-                            {
-                                fb = node->add_framebuffer();
-                                rb = fb->add_renderbuffer(&dh);
-                            }
-                            else
-                                fb->update_renderbuffer(&dh);
-                        }
-                    }
-                    
-                    if (fbs.empty())
-                    {
-                        fb = node->add_framebuffer();
-                        rb = fb->add_renderbuffer(&dh);
-                    }
-                    
-                    // Set FrameBuffer frame
-                    node->set_current_frame(_frame);
-                    if (fb->frame_changed(_frame))
-                        fb->set_frame(_frame);
-                    
-                    // Get current RenderBuffer
-                    if (rb == NULL)
-                        rb = fb->get_renderbuffer(_frame);
-                    
-                    // Update Name
-                    if (rb->name_changed(_name))
-                        rb->set_name(_name);
-                    
-                    // Update Frame
-                    if (rb->frame_changed(_frame))
-                        rb->set_frame(_frame);
-                    
-                    // Update Camera
-                    if (rb->camera_changed(_fov, _matrix))
-                        rb->set_camera(_fov, _matrix);
-                    
-                    // Update Version
-                    if (rb->get_version_int() != _version)
-                        rb->set_version(_version);
-                    
-                    // Update Samples
-                    if (rb->get_samples_int() != _samples)
-                        rb->set_samples(_samples);
-                    
-                    // Update Region Area
-                    rb->set_region_area(_region_area);
-                    
-                    // Update AOVs
-                    if (!active_aovs.empty())
-                    {
-                        if(rb->aovs_changed(active_aovs))
-                        {
-                            rb->resize(1);
-                            rb->set_ready(false);
-                            node->reset_channels(node->m_channels);
-                        }
-                        active_aovs.clear();
-                    }
-                    break;
-                }
-                case 1: // Write image data
+            // Writing to buffer
+            // Quantized steps only fit an aov of their format
+            const void* steps = rb->get_aov_format(b) == dp.format() ? dp.steps() : NULL;
+            rb->write_bucket(b, _x, _y, _width, _height, _spp, &dp.pixel(),
+                             steps, dp.offset(), dp.scale());
+            
+            const long long written = get_clock();
+            node->m_latency[Aton::latency_blit].record(written - decoded);
+
+            // Update only on first aov
+            if(rb->first_aov_name(_aov_name) && !node->m_capturing)
+            {
+                if (node->current_fb_index() == 0 ||
+                    node->current_framebuffer() == fb ||
+                    node->m_output_changed == Aton::item_added)
                 {
-                    // Get Data Pixels
-                    DataPixels dp = node->m_server.listenPixels();
+                    Guard lock(node->m_status_mutex);
                     
-                    const int& _xres = dp.xres();
-                    const int& _yres = dp.yres();
-                    const char* _aov_name = dp.aov_name();
-                    const long long& _session = dp.session();
+                    // Set status parameters
+                    rb->set_time(_time);
+                    rb->set_memory(_ram);
+                    rb->set_progress(_width * _height);
 
-                    // Get Render Buffer
-                    WriteGuard lock(node->m_mutex);
-                    fb = node->get_framebuffer(_session);
-                    
-                    if (fb == NULL)
-                        fb = &node->m_framebuffers.back();
+                    // Update the image, bucket boxes get merged
+                    // and refresh the viewer at most at its rate
+                    node->m_refresh.add(_x, h - _y - _height, _x + _width, h - _y);
+                    node->m_updates++;
                     
-                    rb = fb->get_renderbuffer(fb->get_frame());
-
-                    if(rb->resolution_changed(_xres, _yres))
-                        rb->set_resolution(_xres, _yres);
-
-                    // Get active aov names
-                    if(std::find(active_aovs.begin(),
-                                 active_aovs.end(),
-                                 _aov_name) == active_aovs.end())
+                    // Buckets of older drivers are timed from their arrival
+                    if (node->m_refresh_since == 0)
                     {
-                        if (node->m_enable_aovs || active_aovs.empty())
-                            active_aovs.push_back(_aov_name);
-                        else if (active_aovs.size() > 1)
-                            active_aovs.resize(1);
+                        node->m_refresh_since = written;
+                        node->m_refresh_stamp = stamp != 0 ? stamp : dp.received();
                     }
                     
-                    // Skip non RGBA buckets if AOVs are disabled
-                    if (node->m_enable_aovs || active_aovs[0] == _aov_name)
-                    {
-                        // Get Data Pixels
-                        const int& _spp = dp.spp();
-                        const int& _time = dp.time();
-                        const int& _x = dp.bucket_xo();
-                        const int& _y = dp.bucket_yo();
-                        const long long& _ram = dp.ram();
-                        const int& _width = dp.bucket_size_x();
-                        const int& _height = dp.bucket_size_y();
-
-                        // Adding buffer
-                        if(!rb->aov_exists(_aov_name) && (node->m_enable_aovs || rb->empty()))
-                            rb->add_aov(_aov_name, _spp);
-                        else
-                            rb->set_ready(true);
-
-                        // Get RenderBuffer height
-                        const int& h = rb->get_height();
-
-                        // Get buffer index
-                        const int b = rb->get_aov_index(_aov_name);
-
-                        // Writing to buffer
-                        int x, y, c, xpos, ypos, offset;
-                        for (x = 0; x < _width; ++x)
-                        {
-                            for (y = 0; y < _height; ++y)
-                            {
-                                offset = (_width * y * _spp) + (x * _spp);
-                                for (c = 0; c < _spp; ++c)
-                                {
-                                    xpos = x + _x;
-                                    ypos = h - (y + _y + 1);
-                                    const float& _pix = dp.pixel(offset + c);
-                                    rb->set_aov_pix(b, xpos, ypos, _spp, c, _pix);
-                                }
-                            }
-                        }
-
-                        // Update only on first aov
-                        if(rb->first_aov_name(_aov_name) && !node->m_capturing)
-                        {
-                            if (node->current_fb_index() == 0 ||
-                                node->current_framebuffer() == fb ||
-                                node->m_output_changed == Aton::item_added)
-                            {
-                                // Set status parameters
-                                rb->set_time(_time);
-                                rb->set_memory(_ram);
-                                rb->set_progress(_width * _height);
-
-                                // Update the image
-                                const Box box = Box(_x, h - _y - _width, _x + _height, h - _y);
-                                node->flag_update(box);
-                            }
-                        }
-                    }
-                    dp.free();
-                    break;
-                }
-                case 2: // Close image
-                {
-                    break;
-                }
-                case 9: // When the parent process want to kill the listening thread
-                {
-                    killThread = true;
-                    break;
+                    int area[4];
+                    if (node->m_refresh.take(area, node->m_refresh_rate))
+                        node->refresh_area(area);
+                    
+                    // The updater refreshes it if no bucket comes in time
+                    else if (node->m_refresh.merged() == 1)
+                        node->wake_updater(Aton::event_refresh);
                 }
             }
         }
+        
+        // No Framebuffer to write to
+        else
+            node->m_dropped++;
+        
+        node->m_mutex.unlock();
+    }
+
+private:
+    // Refresh the viewer with the buckets merged so far
+    void flush_refresh()
+    {
+        Guard lock(m_node->m_status_mutex);
+        
+        int area[4];
+        if (m_node->m_refresh.flush(area))
+            m_node->refresh_area(area);
+    }
+    
+    // Find the buffers of the bucket, the aov index is -1 if there are no
+    // framebuffers. Returns false if the node has to be changed first,
+    // which is only done when apply is true.
+    bool locate(WriterSession* ws, DataPixels& dp, const bool& apply, int& b)
+    {
+        Aton* node = m_node;
+        FrameBuffer*& fb = ws->fb;
+        RenderBuffer*& rb = ws->rb;
+        b = -1;
+        
+        if (node->m_framebuffers.empty())
+            return true;
+        
+        // Buckets of a session keep going to the same Framebuffer
+        // until the Framebuffers List changes
+        if (ws->fb == NULL ||
+            ws->fb_session != dp.session() ||
+            ws->fb_generation != node->m_fb_generation)
+        {
+            fb = node->get_framebuffer(dp.session());
+            
+            if (fb == NULL)
+                fb = &node->m_framebuffers.back();
+            
+            ws->fb_session = dp.session();
+            ws->fb_generation = node->m_fb_generation;
+        }
+        
+        rb = fb->get_renderbuffer(fb->get_frame());
+        
+        // A Framebuffer without RenderBuffers drops the bucket
+        if (rb == NULL)
+            return true;
+        
+        const int& _xres = dp.xres();
+        const int& _yres = dp.yres();
+        const char* _aov_name = dp.aov_name();
+        
+        // Get buffer index
+        b = rb->find_aov(_aov_name);
+        
+        const bool spilled = rb->spilled();
+        const bool resize = rb->resolution_changed(_xres, _yres);
+        const bool add = b < 0 && (node->m_enable_aovs || rb->empty());
+        const bool ready = !add && !rb->ready();
+        const bool reformat = b >= 0 && rb->get_aov_format(b) != dp.format();
+        
+        if (!apply && (spilled || resize || add || ready || reformat))
+            return false;
+        
+        if (spilled)
+            rb->restore();
+        
+        if (resize)
+            rb->set_resolution(_xres, _yres);
+        
+        // The driver switched the aov's format
+        if (reformat)
+            rb->set_aov_format(b, dp.format());
+        
+        // Adding buffer
+        if (add)
+        {
+            rb->add_aov(_aov_name, dp.spp(), dp.format());
+            b = static_cast<int>(rb->size() - 1);
+        }
+        else if (ready)
+            rb->set_ready(true);
+        
+        if (b < 0)
+            b = 0;
+        
+        return true;
     }
-}
+    
+private:
+    Aton* m_node;
+};
 
 #endif /* FBWriter_h */
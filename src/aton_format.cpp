@@ -0,0 +1,321 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_format.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ATON_X86
+#include <immintrin.h>
+#endif
+
+size_t format_bytes(const int& format)
+{
+    switch (format)
+    {
+        case format_float:
+            return sizeof(float);
+        case format_half:
+        case format_u16:
+            return sizeof(unsigned short);
+        case format_u8:
+            return sizeof(unsigned char);
+        default:
+            return 0;
+    }
+}
+
+unsigned short float_to_half(const float& f)
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+
+    const unsigned int sign = (x >> 16) & 0x8000;
+    const unsigned int abs = x & 0x7fffffff;
+
+    // Inf and NaN, keeping NaNs quiet
+    if (abs >= 0x7f800000)
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 | ((abs >> 13) & 0x3ff) : 0);
+
+    // Rounds past 65504
+    if (abs >= 0x477ff000)
+        return sign | 0x7c00;
+
+    // Denormals, half way to the smallest one rounds to zero
+    if (abs < 0x38800000)
+    {
+        if (abs <= 0x33000000)
+            return sign;
+
+        const unsigned int shift = 126 - (abs >> 23);
+        const unsigned int m = (abs & 0x7fffff) | 0x800000;
+        const unsigned int rest = m & ((1u << shift) - 1);
+        const unsigned int half = 1u << (shift - 1);
+
+        unsigned int h = m >> shift;
+        if (rest > half || (rest == half && (h & 1)))
+            ++h;
+        return sign | h;
+    }
+
+    // Rebias the exponent, a carry out of the mantissa bumps it
+    unsigned int h = (abs - 0x38000000) >> 13;
+    const unsigned int rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        ++h;
+    return sign | h;
+}
+
+float half_to_float(const unsigned short& h)
+{
+    const unsigned int sign = (h & 0x8000u) << 16;
+    unsigned int e = (h >> 10) & 0x1f;
+    unsigned int m = h & 0x3ff;
+    unsigned int x;
+
+    if (e == 0x1f)
+        x = sign | 0x7f800000 | (m << 13);
+    else if (e != 0)
+        x = sign | ((e + 112) << 23) | (m << 13);
+    else if (m == 0)
+        x = sign;
+    else
+    {
+        // Normalise the denormal
+        for (e = 113; !(m & 0x400); m <<= 1)
+            --e;
+        x = sign | (e << 23) | ((m & 0x3ff) << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Half kernels, the F16C ones return the number of samples they handled
+static size_t to_half_scalar(const float* src, const size_t& n, unsigned short* dst)
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = float_to_half(src[i]);
+    return n;
+}
+
+static size_t from_half_scalar(const unsigned short* src, const size_t& n, float* dst)
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = half_to_float(src[i]);
+    return n;
+}
+
+#ifdef ATON_X86
+__attribute__((target("avx,f16c")))
+static size_t to_half_f16c(const float* src, const size_t& n, unsigned short* dst)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+    }
+    return i + to_half_scalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx,f16c")))
+static size_t from_half_f16c(const unsigned short* src, const size_t& n, float* dst)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+    return i + from_half_scalar(src + i, n - i, dst + i);
+}
+#endif
+
+typedef size_t (*ToHalf)(const float*, const size_t&, unsigned short*);
+typedef size_t (*FromHalf)(const unsigned short*, const size_t&, float*);
+
+// Picked once at load time
+static bool has_f16c()
+{
+#ifdef ATON_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#else
+    return false;
+#endif
+}
+
+#ifdef ATON_X86
+static const ToHalf to_half = has_f16c() ? to_half_f16c : to_half_scalar;
+static const FromHalf from_half = has_f16c() ? from_half_f16c : from_half_scalar;
+#else
+static const ToHalf to_half = to_half_scalar;
+static const FromHalf from_half = from_half_scalar;
+#endif
+
+void sample_range(const float* src,
+                  const size_t& n,
+                  float& lo,
+                  float& hi)
+{
+    bool found = false;
+    lo = hi = 0.0f;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        const float v = src[i];
+        if (!std::isfinite(v))
+            continue;
+
+        if (!found)
+        {
+            lo = hi = v;
+            found = true;
+        }
+        else
+        {
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+        }
+    }
+}
+
+void step_range(const float& lo,
+                const float& hi,
+                const int& format,
+                float& offset,
+                float& scale)
+{
+    offset = scale = 0.0f;
+    if (lo == 0.0f && hi == 0.0f)
+        return;
+    
+    // Not finer than the samples themselves, which keeps the offset exact,
+    // nor than the smallest float
+    const double steps = format_steps(format);
+    int e = std::max(std::ilogb(std::max(std::fabs(lo), std::fabs(hi))) - 23, -149);
+    if (hi > lo)
+        e = std::max(e, std::ilogb((static_cast<double>(hi) - lo) / steps));
+    
+    for (;; ++e)
+    {
+        const double s = std::ldexp(1.0, e);
+        const double first = std::floor(lo / s);
+        if ((first + steps) * s >= hi)
+        {
+            offset = static_cast<float>(first * s);
+            scale = static_cast<float>(s);
+            return;
+        }
+    }
+}
+
+template <typename T>
+static void quantize(const float* src,
+                     const size_t& n,
+                     const float& steps,
+                     const float& offset,
+                     const float& scale,
+                     T* dst)
+{
+    if (scale <= 0.0f)
+    {
+        std::fill(dst, dst + n, T(0));
+        return;
+    }
+
+    const float inverse = 1.0f / scale;
+    for (size_t i = 0; i < n; ++i)
+    {
+        // Written so that NaNs end up at 0
+        const float step = (src[i] - offset) * inverse + 0.5f;
+        dst[i] = static_cast<T>(step > 0.0f ? std::min(step, steps) : 0.0f);
+    }
+}
+
+template <typename T>
+static void dequantize(const T* src,
+                       const size_t& n,
+                       const float& offset,
+                       const float& scale,
+                       float* dst)
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = offset + src[i] * scale;
+}
+
+void quantize_samples(const float* src,
+                      const size_t& n,
+                      const int& format,
+                      const float& offset,
+                      const float& scale,
+                      void* dst)
+{
+    switch (format)
+    {
+        case format_float:
+            memcpy(dst, src, n * sizeof(float));
+            break;
+        case format_half:
+            to_half(src, n, static_cast<unsigned short*>(dst));
+            break;
+        case format_u16:
+            quantize(src, n, format_steps(format), offset, scale, static_cast<unsigned short*>(dst));
+            break;
+        case format_u8:
+            quantize(src, n, format_steps(format), offset, scale, static_cast<unsigned char*>(dst));
+            break;
+    }
+}
+
+size_t pack_samples(const float* src,
+                    const size_t& n,
+                    const int& format,
+                    void* dst,
+                    float& offset,
+                    float& scale)
+{
+    offset = scale = 0.0f;
+
+    if (format_quantized(format))
+    {
+        float lo, hi;
+        sample_range(src, n, lo, hi);
+        step_range(lo, hi, format, offset, scale);
+    }
+
+    quantize_samples(src, n, format, offset, scale, dst);
+    return n * format_bytes(format);
+}
+
+void unpack_samples(const void* src,
+                    const size_t& n,
+                    const int& format,
+                    const float& offset,
+                    const float& scale,
+                    float* dst)
+{
+    switch (format)
+    {
+        case format_float:
+            memcpy(dst, src, n * sizeof(float));
+            break;
+        case format_half:
+            from_half(static_cast<const unsigned short*>(src), n, dst);
+            break;
+        case format_u16:
+            dequantize(static_cast<const unsigned short*>(src), n, offset, scale, dst);
+            break;
+        case format_u8:
+            dequantize(static_cast<const unsigned char*>(src), n, offset, scale, dst);
+            break;
+    }
+}
@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_FORMAT_H_
+#define ATON_FORMAT_H_
+
+#include <cstddef>
+
+// Sample formats of the pixels, on the wire and in the AOVBuffers
+enum pixel_format
+{
+    format_float = 0,   // 32 bit float
+    format_half = 1,    // IEEE 754 half
+    format_u16 = 2,     // 16 bit steps of a range
+    format_u8 = 3       // 8 bit steps of a range
+};
+
+// Bytes per sample, 0 for unknown formats
+size_t format_bytes(const int& format);
+
+// Whether the samples are steps, worth offset + step * scale
+inline bool format_quantized(const int& format)
+{
+    return format == format_u16 || format == format_u8;
+}
+
+// Highest step of a quantized format
+inline float format_steps(const int& format)
+{
+    return format == format_u8 ? 255.0f : 65535.0f;
+}
+
+// IEEE 754 half conversions, rounding to nearest even
+unsigned short float_to_half(const float& f);
+float half_to_float(const unsigned short& h);
+
+// Smallest and largest finite samples, 0 and 0 if there are none
+void sample_range(const float* src,
+                  const size_t& n,
+                  float& lo,
+                  float& hi);
+
+// Range of a quantized format covering lo to hi. Scales are powers of
+// two with the offset on their grid, so the steps of two ranges map onto
+// each other by shifts, and 0 is a step of any range reaching it.
+void step_range(const float& lo,
+                const float& hi,
+                const int& format,
+                float& offset,
+                float& scale);
+
+// Converts n floats to the format. Quantized formats use the given
+// range, clamping the samples outside of it, NaNs become offset.
+void quantize_samples(const float* src,
+                      const size_t& n,
+                      const int& format,
+                      const float& offset,
+                      const float& scale,
+                      void* dst);
+
+// Converts n floats to the format, quantized ones get the step_range of
+// the samples, returned in offset and scale. Returns the bytes written.
+size_t pack_samples(const float* src,
+                    const size_t& n,
+                    const int& format,
+                    void* dst,
+                    float& offset,
+                    float& scale);
+
+// Converts n samples of the format back to floats
+void unpack_samples(const void* src,
+                    const size_t& n,
+                    const int& format,
+                    const float& offset,
+                    const float& scale,
+                    float* dst);
+
+#endif // ATON_FORMAT_H_
@@ -7,6 +7,12 @@ All rights reserved. See COPYING.txt for more details.
 #include "aton_framebuffer.h"
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+
+#include <atomic>
+#include <ctime>
+#include <fstream>
+#include <iostream>
 
 using namespace std;
 using namespace boost;
@@ -25,6 +31,22 @@ const std::string chStr::RGBA = "RGBA",
                   chStr::_Y = ".Y",
                   chStr::_Z = ".Z";
 
+std::string get_date()
+{
+    // Returns date and time
+    time_t rawtime;
+    struct tm *timeinfo;
+    char time_buffer[20];
+    
+    time (&rawtime);
+    timeinfo = localtime(&rawtime);
+    
+    // Setting up the Date and Time format style
+    strftime(time_buffer, 20, "%m.%d_%H:%M:%S", timeinfo);
+    
+    return std::string(time_buffer);
+}
+
 // Unpack 1 int to 4
 const std::vector<int> unpack_4_int(const int& i)
 {
@@ -38,120 +60,307 @@ const std::vector<int> unpack_4_int(const int& i)
 }
 
 
-// Lightweight color pixel class
-RenderColor::RenderColor() { _val[0] = _val[1] = _val[2] = 0.0f; }
+// Unique key for every change of a RenderBuffer's aovs
+static std::atomic<unsigned long long> aovs_keys(0);
+
+
+// AOVIndex class
+size_t AOVIndex::hash(const char* name)
+{
+    // FNV-1a
+    size_t h = 14695981039346656037ULL;
+    for (; *name; ++name)
+        h = (h ^ static_cast<unsigned char>(*name)) * 1099511628211ULL;
+    return h;
+}
+
+void AOVIndex::insert(const std::string& name, const int& index)
+{
+    // Keep the load factor under a half
+    if ((_size + 1) * 2 > _slots.size())
+        grow();
+    
+    const size_t h = hash(name.c_str());
+    const size_t mask = _slots.size() - 1;
+    
+    for (size_t i = h & mask; ; i = (i + 1) & mask)
+    {
+        Slot& slot = _slots[i];
+        if (slot.index < 0)
+        {
+            slot.hash = h;
+            slot.index = index;
+            slot.name = name;
+            ++_size;
+            return;
+        }
+        if (slot.hash == h && slot.name == name)
+            return;
+    }
+}
+
+int AOVIndex::find(const char* name) const
+{
+    if (_size == 0)
+        return -1;
+    
+    const size_t h = hash(name);
+    const size_t mask = _slots.size() - 1;
+    
+    for (size_t i = h & mask; ; i = (i + 1) & mask)
+    {
+        const Slot& slot = _slots[i];
+        if (slot.index < 0)
+            return -1;
+        if (slot.hash == h && slot.name == name)
+            return slot.index;
+    }
+}
+
+void AOVIndex::clear()
+{
+    _slots.clear();
+    _size = 0;
+}
 
-float& RenderColor::operator[](int i) { return _val[i]; }
+void AOVIndex::grow()
+{
+    std::vector<Slot> slots(_slots.empty() ? 16 : _slots.size() * 2);
+    slots.swap(_slots);
+    _size = 0;
+    
+    std::vector<Slot>::iterator it;
+    for (it = slots.begin(); it != slots.end(); ++it)
+        if (it->index >= 0)
+            insert(it->name, it->index);
+}
 
-const float& RenderColor::operator[](int i) const { return _val[i]; }
 
-void RenderColor::reset() { _val[0] = _val[1] = _val[2] = 0.0f; }
+// RowLocks class
+static std::atomic<unsigned long long> row_lock_waits(0);
+static std::atomic<unsigned long long> row_lock_wait_ns(0);
 
+const int RowLocks::band;
 
-// AOVBuffer class
-AOVBuffer::AOVBuffer(const unsigned int& width,
-                     const unsigned int& height,
-                     const int& spp)
+void RowLocks::resize(const int& height)
 {
-    const int size = width * height;
+    const int bands = (std::max(height, 0) + band - 1) / band;
+    if (bands == _bands)
+        return;
     
-    switch (spp)
+    _mutexes.reset(bands > 0 ? new std::mutex[bands] : NULL);
+    _bands = bands;
+}
+
+void RowLocks::lock(const int& y)
+{
+    std::mutex& m = mutex(y);
+    if (!m.try_lock())
     {
-        case 1: // Float channels
-            _float_data.resize(size);
-            break;
-        case 3: // Color Channels
-            _color_data.resize(size);
-            break;
-        case 4: // Color + Alpha channels
-            _color_data.resize(size);
-            _float_data.resize(size);
-            break;
+        ++row_lock_waits;
+        const long long start = get_clock();
+        m.lock();
+        row_lock_wait_ns += get_clock() - start;
     }
 }
 
+unsigned long long RowLocks::contention()
+{
+    return row_lock_waits;
+}
+
+unsigned long long RowLocks::wait_ns()
+{
+    return row_lock_wait_ns;
+}
+
+
 // RenderBuffer class
 RenderBuffer::RenderBuffer(const double& currentFrame,
                            const int& w,
                            const int& h,
                            const float& p): _frame(currentFrame),
-                                            _width(w),
-                                            _height(h),
-                                            _pix_aspect(p),
                                             _progress(0),
                                             _time(0),
                                             _ram(0),
                                             _pram(0),
+                                            _width(w),
+                                            _height(h),
+                                            _pix_aspect(p),
                                             _ready(false),
                                             _fov(0.0f),
-                                            _matrix(Matrix4()),
+                                            _matrix(16, 0.0f),
                                             _version_int(0),
                                             _version_str(""),
-                                            _samples_str("") {}
+                                            _samples_str(""),
+                                            _aovs_key(++aovs_keys),
+                                            _row_locks(h),
+                                            _last_used(0) {}
 // Add new buffer
 void RenderBuffer::add_aov(const char* aov,
-                           const int& spp)
+                           const int& spp,
+                           const int& format)
 {
-    AOVBuffer buffer(_width, _height, spp);
+    AOVBuffer buffer(_width, _height, spp, format);
     
     _buffers.push_back(buffer);
     _aovs.push_back(aov);
+    _aov_index.insert(_aovs.back(), static_cast<int>(_aovs.size() - 1));
+    _aovs_key = ++aovs_keys;
+}
+
+// Store the buffer in another format
+void RenderBuffer::set_aov_format(const int& b, const int& format)
+{
+    const int spp = _buffers[b].spp();
+    _buffers[b] = AOVBuffer(_width, _height, spp, format);
 }
 
 // Get writable buffer object
 void RenderBuffer::set_aov_pix(const int& b,
                                const int& x,
                                const int& y,
-                               const int& spp,
                                const int& c,
                                const float& pix)
 {
+    _buffers[b].write_row(c, y, x, 1, &pix);
+}
+
+// Write a bucket of interleaved pixels
+void RenderBuffer::write_bucket(const int& b,
+                                const int& x,
+                                const int& y,
+                                const int& w,
+                                const int& h,
+                                const int& spp,
+                                const float* data,
+                                const void* steps,
+                                const float& offset,
+                                const float& scale)
+{
+    if (spilled())
+        return;
+    
     AOVBuffer& rb = _buffers[b];
-    const unsigned int index = (_width * y) + x;
-    if (c < 3 && spp != 1)
-        rb._color_data[index][c] = pix;
-    else
-        rb._float_data[index] = pix;
+    
+    // Clip to the buffer
+    const int x0 = std::max(x, 0);
+    const int n = std::min(x + w, _width) - x0;
+    if (n <= 0 || spp != rb._spp || spp > 4)
+        return;
+    
+    // Reduced formats get converted from planar float rows,
+    // unless their steps came along
+    const bool convert = rb.format() != format_float;
+    if (!format_quantized(rb.format()))
+        steps = NULL;
+    const char* bucket_steps = static_cast<const char*>(steps);
+    static thread_local std::vector<float> planes;
+    if (convert)
+        planes.resize(spp * n);
+    
+    float* rows[4];
+    std::mutex* locked = NULL;
+    for (int j = 0; j < h; ++j)
+    {
+        // Buckets come top down, rows are stored bottom up
+        const int ypos = _height - (y + j + 1);
+        if (ypos < 0 || ypos >= _height)
+            continue;
+        
+        // Hold each band's lock while writing its rows
+        std::mutex* band = &_row_locks.mutex(ypos);
+        if (band != locked)
+        {
+            if (locked != NULL)
+                locked->unlock();
+            _row_locks.lock(ypos);
+            locked = band;
+        }
+        
+        for (int c = 0; c < spp; ++c)
+            rows[c] = convert ? &planes[c * n] : rb.row(c, ypos) + x0;
+        
+        deinterleave(data + (w * j + x0 - x) * spp, n, spp, rows);
+        
+        if (convert)
+            for (int c = 0; c < spp; ++c)
+                if (bucket_steps == NULL ||
+                    !rb.write_steps(c, ypos, x0, n,
+                                    bucket_steps + ((w * j + x0 - x) * spp + c) * rb._bytes,
+                                    spp, offset, scale))
+                    rb.write_row(c, ypos, x0, n, rows[c]);
+    }
+    
+    if (locked != NULL)
+        locked->unlock();
 }
 
 // Get read only buffer object
-const float& RenderBuffer::get_aov_pix(const int& b,
-                                       const int& x,
-                                       const int& y,
-                                       const int& c) const
+float RenderBuffer::get_aov_pix(const int& b,
+                                const int& x,
+                                const int& y,
+                                const int& c) const
+{
+    float pix = 0.0f;
+    read_aov_row(b, c, y, x, 1, &pix);
+    return pix;
+}
+
+// Get read only buffer's row
+const float* RenderBuffer::get_aov_row(const int& b,
+                                       const int& c,
+                                       const int& y) const
 {
+    if (b < 0 || static_cast<size_t>(b) >= _buffers.size() || y < 0 || y >= _height || spilled())
+        return NULL;
+    
     const AOVBuffer& rb = _buffers[b];
-    const unsigned int index = (_width * y) + x;
-    if (c < 3 && !rb._color_data.empty())
-        return rb._color_data[index][c];
-    else
-        return rb._float_data[index];
+    
+    // Single channel AOVs answer for every channel
+    const int plane = rb._spp == 1 ? 0 : c;
+    if (plane >= rb._spp || rb.format() != format_float)
+        return NULL;
+    
+    return rb.row(plane, y);
 }
 
-// Get the current buffer index
-int RenderBuffer::get_aov_index(const Channel& z)
+// Copy a span of the buffer's row as floats
+bool RenderBuffer::read_aov_row(const int& b,
+                                const int& c,
+                                const int& y,
+                                const int& x,
+                                const int& n,
+                                float* dst) const
+{
+    if (b < 0 || static_cast<size_t>(b) >= _buffers.size() || y < 0 || y >= _height || spilled() ||
+        x < 0 || n < 0 || x + n > _width)
+        return false;
+    
+    const AOVBuffer& rb = _buffers[b];
+    
+    // Single channel AOVs answer for every channel
+    const int plane = rb._spp == 1 ? 0 : c;
+    if (plane >= rb._spp)
+        return false;
+    
+    rb.read_row(plane, y, x, n, dst);
+    return true;
+}
+
+// Get the buffer index of a Nuke layer
+int RenderBuffer::get_layer_index(const std::string& layer)
 {
     int aov_index = 0;
     if (_aovs.size() > 1)
     {
         using namespace chStr;
-        const std::string& layer = getLayerName(z);
-
-        std::vector<std::string>::iterator it;
-        for(it = _aovs.begin(); it != _aovs.end(); ++it)
-        {
-            if (*it == layer)
-            {
-                aov_index = static_cast<int>(it - _aovs.begin());
-                break;
-            }
-            else if (*it == Z && layer == depth)
-            {
-                aov_index = static_cast<int>(it - _aovs.begin());
-                break;
-            }
-        }
-
+        
+        aov_index = _aov_index.find(layer.c_str());
+        if (aov_index < 0 && layer == depth)
+            aov_index = _aov_index.find(Z.c_str());
+        if (aov_index < 0)
+            aov_index = 0;
     }
     return aov_index;
 }
@@ -159,20 +368,8 @@ int RenderBuffer::get_aov_index(const Channel& z)
 // Get the current buffer index
 int RenderBuffer::get_aov_index(const char* aov_name)
 {
-    int aov_index = 0;
-    if (_aovs.size() > 1)
-    {
-        std::vector<std::string>::iterator it;
-        for(it = _aovs.begin(); it != _aovs.end(); ++it)
-        {
-            if (*it == aov_name)
-            {
-                aov_index = static_cast<int>(it - _aovs.begin());
-                break;
-            }
-        }
-    }
-    return aov_index;
+    const int aov_index = _aov_index.find(aov_name);
+    return aov_index < 0 ? 0 : aov_index;
 }
 
 // Get N buffer/aov name name
@@ -215,11 +412,11 @@ bool RenderBuffer::aovs_changed(const std::vector<std::string>& aovs)
 bool RenderBuffer::resolution_changed(const unsigned int& w,
                                       const unsigned int& h)
 {
-    return (w != _width || h != _height);
+    return (w != static_cast<unsigned int>(_width) || h != static_cast<unsigned int>(_height));
 }
 
 bool RenderBuffer::camera_changed(const float& fov,
-                                  const Matrix4& matrix)
+                                  const std::vector<float>& matrix)
 {
     return (_fov != fov || _matrix != matrix);
 }
@@ -231,23 +428,14 @@ void RenderBuffer::set_resolution(const unsigned int& w,
     _width = w;
     _height = h;
     
-    const int size = _width * _height;
+    // Resizing clears the pixels, spilled ones included
+    _spill.reset();
     
     std::vector<AOVBuffer>::iterator it;
     for(it = _buffers.begin(); it != _buffers.end(); ++it)
-    {
-        if (!it->_color_data.empty())
-        {
-            RenderColor color;
-            std::fill(it->_color_data.begin(), it->_color_data.end(), color);
-            it->_color_data.resize(size);
-        }
-        if (!it->_float_data.empty())
-        {
-            std::fill(it->_float_data.begin(), it->_float_data.end(), 0.0f);
-            it->_float_data.resize(size);
-        }
-    }
+        it->resize(_width, _height);
+    
+    _row_locks.resize(_height);
 }
 
 // Clear buffers and aovs
@@ -255,12 +443,15 @@ void RenderBuffer::clear_all()
 {
     _buffers = std::vector<AOVBuffer>();
     _aovs = std::vector<std::string>();
+    _aov_index.clear();
+    _spill.reset();
+    _aovs_key = ++aovs_keys;
 }
 
 // Check if the given buffer/aov name name is exist
 bool RenderBuffer::aov_exists(const char* aovName)
 {
-    return std::find(_aovs.begin(), _aovs.end(), aovName) != _aovs.end();
+    return _aov_index.find(aovName) >= 0;
 }
 
 // Resize the buffers
@@ -268,6 +459,102 @@ void RenderBuffer::resize(const size_t& s)
 {
     _aovs.resize(s);
     _buffers.resize(s);
+    
+    _aov_index.clear();
+    for (size_t i = 0; i < _aovs.size(); ++i)
+        _aov_index.insert(_aovs[i], static_cast<int>(i));
+    _aovs_key = ++aovs_keys;
+}
+
+// Spill file, removed with the last RenderBuffer sharing it
+struct SpillFile
+{
+    SpillFile(const std::string& p): path(p), size(0) {}
+    ~SpillFile() { boost::system::error_code ec; boost::filesystem::remove(path, ec); }
+    
+    std::string path;
+    long long size;
+};
+
+// Spill the pixels to disk
+bool RenderBuffer::spill(const std::string& dir)
+{
+    if (spilled())
+        return true;
+    
+    using namespace boost::filesystem;
+    boost::system::error_code ec;
+    create_directories(dir, ec);
+    
+    const path file = path(dir) / unique_path("aton_%%%%-%%%%-%%%%-%%%%.cache");
+    std::shared_ptr<SpillFile> spill = std::make_shared<SpillFile>(file.string());
+    
+    std::ofstream os(spill->path.c_str(), std::ios::binary);
+    std::vector<AOVBuffer>::const_iterator it;
+    for (it = _buffers.begin(); it != _buffers.end(); ++it)
+        it->write(os);
+    
+    os.close();
+    if (!os)
+        return false;
+    
+    spill->size = static_cast<long long>(file_size(file, ec));
+    
+    std::vector<AOVBuffer>::iterator bt;
+    for (bt = _buffers.begin(); bt != _buffers.end(); ++bt)
+        bt->release();
+    
+    _spill = spill;
+    return true;
+}
+
+// Fault the pixels back in
+bool RenderBuffer::restore()
+{
+    if (!spilled())
+        return true;
+    
+    std::ifstream is(_spill->path.c_str(), std::ios::binary);
+    
+    bool ok = is.good();
+    std::vector<AOVBuffer>::iterator it;
+    for (it = _buffers.begin(); it != _buffers.end(); ++it)
+        if (!ok || !it->read(is))
+        {
+            it->resize(_width, _height);
+            ok = false;
+        }
+    
+    _spill.reset();
+    return ok;
+}
+
+long long RenderBuffer::resident_bytes() const
+{
+    long long bytes = 0;
+    for (int y = 0; y < _height; y += RowLocks::band)
+    {
+        std::lock_guard<std::mutex> lock(_row_locks.mutex(y));
+        
+        std::vector<AOVBuffer>::const_iterator it;
+        for (it = _buffers.begin(); it != _buffers.end(); ++it)
+            bytes += it->band_bytes(y / RowLocks::band);
+    }
+    return bytes;
+}
+
+long long RenderBuffer::unique_bytes() const
+{
+    long long bytes = 0;
+    std::vector<AOVBuffer>::const_iterator it;
+    for (it = _buffers.begin(); it != _buffers.end(); ++it)
+        bytes += it->unique_bytes();
+    return bytes;
+}
+
+long long RenderBuffer::spilled_bytes() const
+{
+    return spilled() ? _spill->size : 0;
 }
 
 // Set status parameters
@@ -319,61 +606,64 @@ void RenderBuffer::set_samples(std::vector<int> sp)
 }
 
 
-void RenderBuffer::set_camera(const float& fov, const Matrix4& matrix)
+void RenderBuffer::set_camera(const float& fov, const std::vector<float>& matrix)
 {
     _fov = fov;
     _matrix = matrix;
 }
 
 
+FrameBuffer::FrameBuffer(const FrameBuffer& other): _frame(other._frame),
+                                                    _session(other._session),
+                                                    _output_name(other._output_name),
+                                                    _frames(other._frames),
+                                                    _frame_index(other._frame_index)
+{
+    _renderbuffers.reserve(other._renderbuffers.size());
+    
+    RenderBuffers::const_iterator it;
+    for (it = other._renderbuffers.begin(); it != other._renderbuffers.end(); ++it)
+        _renderbuffers.push_back(std::unique_ptr<RenderBuffer>(new RenderBuffer(**it)));
+}
+
+FrameBuffer& FrameBuffer::operator=(const FrameBuffer& other)
+{
+    if (this != &other)
+        *this = FrameBuffer(other);
+    return *this;
+}
+
 RenderBuffer* FrameBuffer::get_renderbuffer(double frame)
 {
-    int index = 0;
-    if (_frames.size() > 1)
-    {
-        int nearFIndex = INT_MIN;
-        int minFIndex = INT_MAX;
-        
-        std::vector<double>::iterator it;
-        for(it = _frames.begin(); it != _frames.end(); ++it)
-        {
-            if (frame == *it)
-            {
-                index = static_cast<int>(it - _frames.begin());
-                break;
-            }
-            else if (frame > *it && nearFIndex < *it)
-            {
-                nearFIndex = static_cast<int>(*it);
-                index = static_cast<int>(it - _frames.begin());
-                continue;
-            }
-            else if (*it < minFIndex && nearFIndex == INT_MIN)
-            {
-                minFIndex = static_cast<int>(*it);
-                index = static_cast<int>(it - _frames.begin());
-            }
-        }
-    }
+    if (_renderbuffers.empty())
+        return NULL;
     
-    return &_renderbuffers[index];
+    // First frame after it, then step back to the frame or the one before
+    std::map<double, size_t>::const_iterator it = _frame_index.upper_bound(frame);
+    if (it != _frame_index.begin())
+        --it;
+    
+    return _renderbuffers[it->second].get();
 }
 
 RenderBuffer* FrameBuffer::add_renderbuffer(DataHeader* dh)
 {
-        RenderBuffer rb(dh->frame(), dh->xres(), dh->yres(), dh->pixel_aspect());
+    // New frames start from the last RenderBuffer added
+    RenderBuffer* rb;
+    if (_renderbuffers.empty())
+        rb = new RenderBuffer(dh->frame(), dh->xres(), dh->yres(), dh->pixel_aspect());
+    else
+        rb = new RenderBuffer(*_renderbuffers.back());
     
-        _output_name = (boost::format("%s_%d_%s")%dh->output_name()
-                                                 %dh->frame()%get_date()).str();
+    _output_name = (boost::format("%s_%d_%s")%dh->output_name()
+                                             %dh->frame()%get_date()).str();
     
-        if (!_frames.empty())
-            rb = _renderbuffers.back();
-
-        _frame  = dh->frame();
-        _session = dh->session();
-        _frames.push_back(dh->frame());
-        _renderbuffers.push_back(rb);
-        return &_renderbuffers.back();
+    _frame  = dh->frame();
+    _session = dh->session();
+    _frames.push_back(dh->frame());
+    _frame_index.insert(std::make_pair(_frame, _renderbuffers.size()));
+    _renderbuffers.push_back(std::unique_ptr<RenderBuffer>(rb));
+    return rb;
 }
 
 // Udpate RenderBuffer
@@ -389,14 +679,6 @@ void FrameBuffer::update_renderbuffer(DataHeader* dh)
 void FrameBuffer::clear_all()
 {
     _frames = std::vector<double>();
-    _renderbuffers = std::vector<RenderBuffer>();
-}
-
-// Check if RenderBuffer already exists
-bool FrameBuffer::renderbuffer_exists(double frame)
-{
-    if (!_frames.empty())
-        return (std::find(_frames.begin(), _frames.end(), frame) != _frames.end());
-    else
-        return 0;
+    _frame_index.clear();
+    _renderbuffers = RenderBuffers();
 }
@@ -7,11 +7,14 @@ All rights reserved. See COPYING.txt for more details.
 #ifndef FenderBuffer_h
 #define FenderBuffer_h
 
-#include <DDImage/Iop.h>
-#include "aton_client.h"
+#include <map>
+#include <mutex>
+#include <memory>
 
-using namespace DD::Image;
+#include "aton_client.h"
+#include "aton_aovbuffer.h"
 
+// Current date and time
 std::string get_date();
 
 namespace chStr
@@ -23,37 +26,76 @@ namespace chStr
 // Unpack 1 int to 4
 const std::vector<int> unpack_4_int(const int& i);
 
-// Lightweight colour pixel class
-class RenderColor
+// Open addressing hash map from an AOV name to its index
+class AOVIndex
 {
 public:
-    RenderColor();
+    AOVIndex(): _size(0) {}
+    
+    // Add a name, keeps the first index of duplicates
+    void insert(const std::string& name, const int& index);
     
-    float& operator[](int i);
-    const float& operator[](int i) const;
+    // Index of the name, -1 if not found
+    int find(const char* name) const;
     
-    void reset();
+    // Remove all names
+    void clear();
     
-    // Data
-    float _val[3];
+    size_t size() const { return _size; }
+    
+private:
+    struct Slot
+    {
+        Slot(): hash(0), index(-1) {}
+        
+        size_t hash;
+        int index;
+        std::string name;
+    };
+    
+    static size_t hash(const char* name);
+    void grow();
+    
+    size_t _size;
+    std::vector<Slot> _slots;
 };
 
-// AOV Buffer class
-class AOVBuffer
+// Mutexes guarding bands of rows, so pixel writers and
+// readers of different bands never wait for each other
+class RowLocks
 {
-    friend class RenderBuffer;
-    
 public:
-    AOVBuffer(const unsigned int& width = 0,
-              const unsigned int& height = 0,
-              const int& spp = 0);
+    static const int band = AOVBuffer::band;
+    
+    RowLocks(const int& height = 0): _bands(0) { resize(height); }
+    
+    // Copies get their own mutexes
+    RowLocks(const RowLocks& other): _bands(0) { resize(other._bands * band); }
+    RowLocks& operator=(const RowLocks& other) { resize(other._bands * band); return *this; }
+    
+    // Must not be called while any band is locked
+    void resize(const int& height);
+    
+    // Mutex of the band holding the row
+    std::mutex& mutex(const int& y) { return _mutexes[y / band]; }
+    
+    // Lock the band holding the row, counting the waits
+    void lock(const int& y);
+    void unlock(const int& y) { mutex(y).unlock(); }
+    
+    // Times a lock had to wait for another thread, process wide
+    static unsigned long long contention();
+    
+    // Nanoseconds spent in those waits
+    static unsigned long long wait_ns();
     
 private:
-    // Data
-    std::vector<RenderColor> _color_data;
-    std::vector<float> _float_data;
+    int _bands;
+    std::unique_ptr<std::mutex[]> _mutexes;
 };
 
+// File holding a spilled RenderBuffer's pixels
+struct SpillFile;
 
 // RenderBuffer main class
 class RenderBuffer
@@ -66,33 +108,78 @@ public:
                  const int& h = 0,
                  const float& _pix_aspect = 1.0f);
     
-    // Add new buffer
+    // Add new buffer, storing its samples in the pixel_format
     void add_aov(const char* aov = NULL,
-                 const int& spp = 0);
+                 const int& spp = 0,
+                 const int& format = format_float);
+    
+    // Get the buffer's pixel_format
+    const int& get_aov_format(const int& b) const { return _buffers[b].format(); }
+    
+    // Store the buffer in another pixel_format, clearing its pixels
+    void set_aov_format(const int& b, const int& format);
     
     // Set writable buffer's pixel
     void set_aov_pix(const int& b,
                      const int& x,
                      const int& y,
-                     const int& spp,
                      const int& c,
                      const float& pix);
     
+    // Write a bucket of interleaved pixels, flipped vertically. Buckets
+    // received in the buffer's quantized format may pass their steps and
+    // range too, which are stored without converting them again.
+    void write_bucket(const int& b,
+                      const int& x,
+                      const int& y,
+                      const int& w,
+                      const int& h,
+                      const int& spp,
+                      const float* data,
+                      const void* steps = NULL,
+                      const float& offset = 0.0f,
+                      const float& scale = 0.0f);
+    
     // Get read only buffer's pixel
-    const float& get_aov_pix(const int& b,
-                             const int& x,
-                             const int& y,
-                             const int& c) const;
+    float get_aov_pix(const int& b,
+                      const int& x,
+                      const int& y,
+                      const int& c) const;
+    
+    // Get read only buffer's row, contiguous from x = 0 to the width
+    // Returns NULL if the buffer has no such channel or isn't format_float
+    const float* get_aov_row(const int& b,
+                             const int& c,
+                             const int& y) const;
+    
+    // Copy n pixels of the buffer's row from x on as floats, whatever
+    // its format. Returns false if the buffer has no such channel.
+    bool read_aov_row(const int& b,
+                      const int& c,
+                      const int& y,
+                      const int& x,
+                      const int& n,
+                      float* dst) const;
+    
+    // Lock the row while reading it, writes lock their own rows
+    void lock_row(const int& y) { _row_locks.lock(y); }
+    void unlock_row(const int& y) { _row_locks.unlock(y); }
     
     // Get AOVs
     std::vector<std::string>& get_aovs() { return _aovs; }
     
-    // Get the current buffer index
-    int get_aov_index(const Channel& z);
+    // Get the buffer index of a Nuke layer, depth falls back to Z
+    int get_layer_index(const std::string& layer);
     
     // Get the current buffer index
     int get_aov_index(const char* aovName);
     
+    // Get the buffer index, -1 if there is no such aov
+    int find_aov(const char* aovName) const { return _aov_index.find(aovName); }
+    
+    // Changes whenever the aovs are added, removed or reordered
+    const unsigned long long& aovs_key() const { return _aovs_key; }
+    
     // Get N buffer/aov name name
     std::string get_aov_name(const int& index);
     
@@ -112,7 +199,7 @@ public:
                             const unsigned int& h);
     
     // Check if Camera fov has been changed
-    bool camera_changed(const float& fov, const Matrix4& matrix);
+    bool camera_changed(const float& fov, const std::vector<float>& matrix);
     
     // Resize the containers to match the resolution
     void set_resolution(const unsigned int& w,
@@ -179,13 +266,35 @@ public:
     
     // Camera
     const float& get_camera_fov() { return _fov; }
-    const Matrix4& get_camera_matrix() { return _matrix; }
-    void set_camera(const float& fov, const Matrix4& matrix);
+    // The camera matrix holds 16 floats, as the DataHeader sends them
+    const std::vector<float>& get_camera_matrix() { return _matrix; }
+    void set_camera(const float& fov, const std::vector<float>& matrix);
     
     // Name
     const char* get_name() { return _name.c_str(); }
     void set_name(std::string name) { _name = name; }
     
+    // Write the pixels to a file in the directory and free them
+    // Returns false if the file couldn't be written
+    bool spill(const std::string& dir);
+    
+    // Read the spilled pixels back, the buffer is resident afterwards
+    // even if this fails, but then its pixels are blank
+    bool restore();
+    
+    bool spilled() const { return _spill != NULL; }
+    
+    // Bytes of pixels in memory, of those only held by this buffer,
+    // and of the spill file. Pixels in memory are counted band by band
+    // under the row locks, so buckets can be written meanwhile.
+    long long resident_bytes() const;
+    long long unique_bytes() const;
+    long long spilled_bytes() const;
+    
+    // Last time this buffer was viewed, for the least recently used
+    const unsigned long long& last_used() const { return _last_used; }
+    void set_last_used(const unsigned long long& tick) { _last_used = tick; }
+    
 private:
     double _frame;
     int _progress;
@@ -199,7 +308,7 @@ private:
     float _pix_aspect;
     bool _ready;
     float _fov;
-    Matrix4 _matrix;
+    std::vector<float> _matrix;
     int _version_int;
     std::string _name;
     std::vector<int> _samples;
@@ -208,26 +317,66 @@ private:
     std::string _samples_str;
     std::vector<AOVBuffer> _buffers;
     std::vector<std::string> _aovs;
+    AOVIndex _aov_index;
+    unsigned long long _aovs_key;
+    mutable RowLocks _row_locks;
+    unsigned long long _last_used;
+    std::shared_ptr<SpillFile> _spill;
+};
+
+// Scoped row lock, does nothing if the row is out of the buffer
+class RowGuard
+{
+public:
+    RowGuard(RenderBuffer* rb, const int& y): _rb(rb), _y(y)
+    {
+        if (_rb != NULL && _y >= 0 && _y < _rb->get_height())
+            _rb->lock_row(_y);
+        else
+            _rb = NULL;
+    }
+    
+    ~RowGuard() { if (_rb != NULL) _rb->unlock_row(_y); }
+    
+private:
+    RenderBuffer* _rb;
+    int _y;
 };
 
 // FrameBuffer Class
+// RenderBuffers of one output, one per frame
+// RenderBuffers are allocated one by one, so pointers to them stay valid
+// while frames get added and the FrameBuffer itself gets moved around.
 class FrameBuffer
 {
 public:
-    FrameBuffer() {};
+    typedef std::vector<std::unique_ptr<RenderBuffer> > RenderBuffers;
     
+    FrameBuffer(): _frame(0), _session(0) {}
+    
+    // Copies every RenderBuffer, for snapshots
+    FrameBuffer(const FrameBuffer& other);
+    FrameBuffer& operator=(const FrameBuffer& other);
+    
+    FrameBuffer(FrameBuffer&& other) = default;
+    FrameBuffer& operator=(FrameBuffer&& other) = default;
+    
+    // RenderBuffer of the frame, else of the nearest frame before it,
+    // else of the first frame. NULL if there are none.
     RenderBuffer* get_renderbuffer(double frame);
     
     RenderBuffer* current_renderbuffer() { return get_renderbuffer(_frame); }
     
-    std::vector<RenderBuffer>& get_renderbuffers() { return _renderbuffers; }
+    const RenderBuffers& get_renderbuffers() { return _renderbuffers; }
     
+    // Frames in the order they were added
     const std::vector<double>& frames() { return _frames; }
     
     size_t size() { return _frames.size(); }
     
-    const double& get_first_frame() { return *std::min_element(_frames.begin(), _frames.end()); }
-    const double& get_last_frame() { return *std::max_element(_frames.begin(), _frames.end()); }
+    // First and last frames, the current frame if there are none
+    double get_first_frame() const { return _frame_index.empty() ? _frame : _frame_index.begin()->first; }
+    double get_last_frame() const { return _frame_index.empty() ? _frame : _frame_index.rbegin()->first; }
 
     // Add New RenderBuffer
     RenderBuffer* add_renderbuffer(DataHeader* dh);
@@ -236,7 +385,7 @@ public:
     void update_renderbuffer(DataHeader* dh);
     
     // Check if RenderBuffer already exists
-    bool renderbuffer_exists(double frame);
+    bool renderbuffer_exists(double frame) { return _frame_index.count(frame) > 0; }
     
     double& get_frame() { return _frame; }
     void set_frame(double frame) { _frame = frame; }
@@ -259,7 +408,10 @@ private:
     long long _session;
     std::string _output_name;
     std::vector<double> _frames;
-    std::vector<RenderBuffer> _renderbuffers;
+    
+    // Sorted frames to their RenderBuffer's index, the first one added wins
+    std::map<double, size_t> _frame_index;
+    RenderBuffers _renderbuffers;
 };
 
 #endif /* FenderBuffer_h */
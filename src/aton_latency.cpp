@@ -0,0 +1,80 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_latency.h"
+
+#include <cmath>
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+// Values below 2 * sub_bins get a bin each, the others one of the
+// sub_bins steps of their power of two
+int LatencyHistogram::bin(const unsigned long long& ns)
+{
+    if (ns < 2 * sub_bins)
+        return static_cast<int>(ns);
+    
+    const int shift = 63 - __builtin_clzll(ns) - sub_bits;
+    return (shift + 1) * sub_bins + static_cast<int>((ns >> shift) - sub_bins);
+}
+
+long long LatencyHistogram::bin_top(const int& index)
+{
+    if (index < 2 * sub_bins)
+        return index;
+    
+    const int shift = index / sub_bins - 1;
+    const long long step = index % sub_bins + sub_bins;
+    return ((step + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(long long ns)
+{
+    if (ns < 0)
+        ns = 0;
+    
+    _counts[bin(ns)].fetch_add(1, std::memory_order_relaxed);
+    
+    long long max = _max.load(std::memory_order_relaxed);
+    while (ns > max && !_max.compare_exchange_weak(max, ns, std::memory_order_relaxed));
+}
+
+long long LatencyHistogram::count() const
+{
+    long long total = 0;
+    for (int i = 0; i < bins; ++i)
+        total += _counts[i].load(std::memory_order_relaxed);
+    return total;
+}
+
+long long LatencyHistogram::percentile(const double& fraction) const
+{
+    const long long total = count();
+    if (total == 0)
+        return 0;
+    
+    const long long rank = std::max(1LL, static_cast<long long>(std::ceil(fraction * total)));
+    
+    long long seen = 0;
+    for (int i = 0; i < bins; ++i)
+    {
+        seen += _counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(bin_top(i), max());
+    }
+    return max();
+}
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < bins; ++i)
+        _counts[i].store(0, std::memory_order_relaxed);
+    _max.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,49 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_LATENCY_H_
+#define ATON_LATENCY_H_
+
+#include <atomic>
+#include <cstddef>
+
+// Histogram of latencies in nanoseconds, HdrHistogram style
+// Every power of two is split into 32 bins, so the percentiles are
+// within 3% from nanoseconds to hours in a fixed amount of memory.
+// Recording is lock free and may happen from any thread.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+    
+    // Counts a latency, negative ones count as 0
+    void record(long long ns);
+    
+    // Number of latencies counted
+    long long count() const;
+    
+    // Latency the given fraction of the counted ones doesn't exceed,
+    // the upper end of its bin. 0 if none were counted.
+    long long percentile(const double& fraction) const;
+    
+    // Highest latency counted
+    long long max() const { return _max.load(std::memory_order_relaxed); }
+    
+    void reset();
+    
+private:
+    static const int sub_bits = 5;
+    static const int sub_bins = 1 << sub_bits;
+    static const int bins = (64 - sub_bits) * sub_bins;
+    
+    static int bin(const unsigned long long& ns);
+    static long long bin_top(const int& index);
+    
+    std::atomic<long long> _counts[bins];
+    std::atomic<long long> _max;
+};
+
+#endif // ATON_LATENCY_H_
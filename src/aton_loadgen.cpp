@@ -0,0 +1,538 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Load generator, sends synthetic progressive renders to the Nuke node
+// or to aton_recv the way the Arnold driver does, and reports the
+// throughput and the latency until the server has handled the buckets.
+// Usage: aton_loadgen [options], run with --help for the list
+
+#include "aton_client.h"
+#include "aton_send_queue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options
+{
+    Options(): host(get_host()), port(get_port()),
+               xres(1920), yres(1080), bucket(64), order("top"),
+               passes(1), sessions(1), rate(0.0), queue(64),
+               reduced(format_float), protocol(protocol_current),
+               sample_ms(100)
+    {
+        aovs.push_back(4);
+    }
+
+    std::string host;
+    int port;
+    int xres, yres;
+    int bucket;
+    std::string order;
+    std::vector<int> aovs;
+    int passes;
+    int sessions;
+    double rate;
+    int queue;
+    int reduced;
+    int protocol;
+    int sample_ms;
+};
+
+// A bucket of the image, origin from the top left like Arnold's
+struct Tile
+{
+    int x, y, w, h;
+};
+
+// What a session sent, added up over every session at the end
+struct Report
+{
+    Report(): buckets(0), messages(0), raw_bytes(0), wire_bytes(0),
+              deltas(0), errors(0), protocol(0), codec(0), shared(false),
+              queue() {}
+
+    long long buckets, messages;
+    long long raw_bytes, wire_bytes, deltas;
+    long long errors;
+    int protocol, codec;
+    bool shared;
+    std::string error;
+    std::vector<double> latencies;
+    SendStats queue;
+};
+
+static void usage()
+{
+    printf("Usage: aton_loadgen [options]\n"
+           "  --host HOST       Host or unix:/path of the server (ATON_HOST)\n"
+           "  --port PORT       Port of the server (ATON_PORT)\n"
+           "  --res WxH         Resolution, 1920x1080\n"
+           "  --bucket N        Bucket size, 64\n"
+           "  --order ORDER     Bucket scanning, top, bottom, left, right, spiral or random\n"
+           "  --aovs LIST       Samples per pixel of each aov, 1, 3 or 4, the first is RGBA, 4\n"
+           "  --passes N        Progressive passes, each sent as its own image, 1\n"
+           "  --sessions N      Concurrent render sessions, 1\n"
+           "  --rate N          Target buckets per second over all sessions, 0 for no limit\n"
+           "  --queue N         Send queue size like the driver's, 0 sends from the render thread, 64\n"
+           "  --reduced FORMAT  Send the aovs but RGBA as half, u16 or u8\n"
+           "  --protocol N      Highest protocol version to use, %d\n"
+           "  --sample MS       Latency sampling interval, 0 disables it, 100\n",
+           protocol_current);
+}
+
+static bool parse(int argc, char* argv[], Options& opt)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help" || i + 1 >= argc)
+            return false;
+
+        const std::string value = argv[++i];
+        if (arg == "--host")
+            opt.host = value;
+        else if (arg == "--port")
+            opt.port = atoi(value.c_str());
+        else if (arg == "--res")
+        {
+            if (sscanf(value.c_str(), "%dx%d", &opt.xres, &opt.yres) != 2)
+                return false;
+        }
+        else if (arg == "--bucket")
+            opt.bucket = atoi(value.c_str());
+        else if (arg == "--order")
+            opt.order = value;
+        else if (arg == "--aovs")
+        {
+            std::string list = value;
+            std::replace(list.begin(), list.end(), ',', ' ');
+            std::istringstream stream(list);
+
+            opt.aovs.clear();
+            int spp;
+            while (stream >> spp)
+            {
+                if (spp != 1 && spp != 3 && spp != 4)
+                    return false;
+                opt.aovs.push_back(spp);
+            }
+        }
+        else if (arg == "--passes")
+            opt.passes = atoi(value.c_str());
+        else if (arg == "--sessions")
+            opt.sessions = atoi(value.c_str());
+        else if (arg == "--rate")
+            opt.rate = atof(value.c_str());
+        else if (arg == "--queue")
+            opt.queue = atoi(value.c_str());
+        else if (arg == "--reduced")
+        {
+            if (value == "half")
+                opt.reduced = format_half;
+            else if (value == "u16")
+                opt.reduced = format_u16;
+            else if (value == "u8")
+                opt.reduced = format_u8;
+            else
+                return false;
+        }
+        else if (arg == "--protocol")
+            opt.protocol = atoi(value.c_str());
+        else if (arg == "--sample")
+            opt.sample_ms = atoi(value.c_str());
+        else
+            return false;
+    }
+
+    const std::string orders[6] = {"top", "bottom", "left", "right", "spiral", "random"};
+    return opt.xres > 0 && opt.yres > 0 && opt.bucket > 0 &&
+           opt.passes > 0 && opt.sessions > 0 && !opt.aovs.empty() &&
+           std::find(orders, orders + 6, opt.order) != orders + 6;
+}
+
+// Buckets of the image in the order the renderer scans them
+static std::vector<Tile> scan(const Options& opt)
+{
+    std::vector<Tile> tiles;
+    for (int y = 0; y < opt.yres; y += opt.bucket)
+        for (int x = 0; x < opt.xres; x += opt.bucket)
+        {
+            Tile tile = {x, y, std::min(opt.bucket, opt.xres - x), std::min(opt.bucket, opt.yres - y)};
+            tiles.push_back(tile);
+        }
+
+    const std::string& order = opt.order;
+    if (order == "bottom")
+        std::reverse(tiles.begin(), tiles.end());
+    else if (order == "left" || order == "right")
+    {
+        const bool left = order == "left";
+        std::stable_sort(tiles.begin(), tiles.end(), [left](const Tile& a, const Tile& b)
+                         {
+                             return left ? a.x < b.x : a.x > b.x;
+                         });
+    }
+    else if (order == "spiral")
+    {
+        // Rings around the center, each one walked around
+        const float cx = opt.xres * 0.5f, cy = opt.yres * 0.5f;
+        const float size = static_cast<float>(opt.bucket);
+        std::stable_sort(tiles.begin(), tiles.end(), [=](const Tile& a, const Tile& b)
+                         {
+                             const float ax = a.x + a.w * 0.5f - cx, ay = a.y + a.h * 0.5f - cy;
+                             const float bx = b.x + b.w * 0.5f - cx, by = b.y + b.h * 0.5f - cy;
+                             const int ar = static_cast<int>(std::max(std::fabs(ax), std::fabs(ay)) / size);
+                             const int br = static_cast<int>(std::max(std::fabs(bx), std::fabs(by)) / size);
+                             if (ar != br)
+                                 return ar < br;
+                             return std::atan2(ay, ax) < std::atan2(by, bx);
+                         });
+    }
+    else if (order == "random")
+    {
+        std::mt19937 random(1);
+        std::shuffle(tiles.begin(), tiles.end(), random);
+    }
+    return tiles;
+}
+
+// Pixels of a pass, a few variants per aov the buckets take turns with.
+// Each pass adds less noise to the same image, like a converging render.
+class Pixels
+{
+public:
+    Pixels(const Options& opt, const int& seed): mOpt(opt), mRandom(seed)
+    {
+        mData.resize(opt.aovs.size() * variants);
+    }
+
+    void make_pass(const int& pass)
+    {
+        std::uniform_real_distribution<float> noise(-0.5f, 0.5f);
+        const float amount = 1.0f / (pass + 1);
+        const int size = mOpt.bucket;
+
+        for (size_t a = 0; a < mOpt.aovs.size(); ++a)
+        {
+            const int spp = mOpt.aovs[a];
+            for (int v = 0; v < variants; ++v)
+            {
+                std::vector<float>& data = mData[a * variants + v];
+                data.resize(size * size * spp);
+
+                for (int y = 0; y < size; ++y)
+                    for (int x = 0; x < size; ++x)
+                        for (int c = 0; c < spp; ++c)
+                        {
+                            const float base = 0.5f + 0.4f * std::sin((x + v * 7) * 0.05f + c) *
+                                                             std::cos((y + a * 5) * 0.04f);
+                            data[(y * size + x) * spp + c] = c == 3 ? 1.0f : base + noise(mRandom) * amount;
+                        }
+            }
+        }
+    }
+
+    // Pixels of an aov for the n-th bucket, rows of the full bucket size
+    const float* get(const size_t& aov, const size_t& n) const
+    {
+        return &mData[aov * variants + n % variants][0];
+    }
+
+private:
+    static const int variants = 16;
+
+    const Options& mOpt;
+    std::mt19937 mRandom;
+    std::vector<std::vector<float> > mData;
+};
+
+// One render, sending every pass of the image from its own thread
+static void render(const Options& opt,
+                   const std::vector<Tile>& tiles,
+                   const long long& session,
+                   const Clock::time_point& start,
+                   Report& report)
+{
+    const size_t aovs = opt.aovs.size();
+    std::vector<std::string> names(aovs);
+    for (size_t a = 0; a < aovs; ++a)
+        names[a] = a == 0 ? "RGBA" : "aov_" + std::to_string(a);
+
+    Pixels pixels(opt, static_cast<int>(session % 100000));
+    std::vector<std::vector<float> > packed(aovs);
+    std::vector<const float*> data(aovs);
+
+    Client client(opt.host, opt.port);
+    client.set_protocol(opt.protocol);
+
+    std::unique_ptr<SendQueue> queue;
+    if (opt.queue > 0)
+        queue.reset(new SendQueue(&client, opt.queue));
+
+    // Each session gets its share of the rate
+    const double rate = opt.rate / opt.sessions;
+    const float cam_matrix[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    const int samples[6] = {3, 2, 2, 2, 2, 2};
+
+    long long count = 0;
+    Clock::time_point next_sample = start;
+
+    try
+    {
+        for (int pass = 0; pass < opt.passes; ++pass)
+        {
+            pixels.make_pass(pass);
+
+            // Previous pass has to go out before the new header
+            if (queue)
+                queue->flush();
+
+            const WireStats& wire = client.wire_stats();
+            report.raw_bytes += wire.raw_bytes;
+            report.wire_bytes += wire.wire_bytes;
+            report.deltas += wire.deltas;
+
+            DataHeader dh(session, opt.xres, opt.yres, 1.0f,
+                          static_cast<long long>(opt.xres) * opt.yres,
+                          pack_4_int(5, 2, 0, 0), 1.0f, 54.43f,
+                          cam_matrix, samples, "aton_loadgen");
+            client.send_header(dh);
+
+            for (size_t t = 0; t < tiles.size(); ++t, ++count)
+            {
+                if (rate > 0.0)
+                    std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(
+                                                  std::chrono::duration<double>(count / rate)));
+
+                const Tile& tile = tiles[t];
+                const long long stamp = get_clock();
+                const unsigned int time = static_cast<unsigned int>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count());
+
+                // Renderers hand over packed buckets, the narrow edge ones too
+                for (size_t a = 0; a < aovs; ++a)
+                {
+                    const int spp = opt.aovs[a];
+                    data[a] = pixels.get(a, t);
+                    if (tile.w == opt.bucket)
+                        continue;
+
+                    std::vector<float>& dst = packed[a];
+                    dst.resize(tile.w * tile.h * spp);
+                    for (int y = 0; y < tile.h; ++y)
+                        memcpy(&dst[y * tile.w * spp], data[a] + y * opt.bucket * spp,
+                               sizeof(float) * tile.w * spp);
+                    data[a] = &dst[0];
+                }
+
+                // Queued bucket, copied here and sent from the queue's thread
+                SendBucket* bucket = NULL;
+                if (queue)
+                {
+                    bucket = queue->acquire();
+                    bucket->session = session;
+                    bucket->xres = opt.xres;
+                    bucket->yres = opt.yres;
+                    bucket->bucket_xo = tile.x;
+                    bucket->bucket_yo = tile.y;
+                    bucket->bucket_size_x = tile.w;
+                    bucket->bucket_size_y = tile.h;
+                    bucket->ram = 0;
+                    bucket->time = time;
+                    bucket->stamp = stamp;
+                    bucket->preview = pass + 1 < opt.passes;
+                }
+
+                for (size_t a = 0; a < aovs; ++a)
+                {
+                    const int format = a == 0 ? format_float : opt.reduced;
+
+                    if (bucket != NULL)
+                    {
+                        bucket->add_aov(names[a].c_str(), opt.aovs[a], data[a], format);
+                        continue;
+                    }
+
+                    DataPixels dp(session, opt.xres, opt.yres,
+                                  tile.x, tile.y, tile.w, tile.h,
+                                  opt.aovs[a], 0, time,
+                                  names[a].c_str(), data[a], format);
+                    dp.set_stamp(stamp);
+                    client.send_pixels(dp);
+                }
+
+                if (bucket != NULL)
+                    queue->push(bucket);
+
+                report.buckets++;
+                report.messages += aovs;
+
+                // Now and then, wait for the server to have handled this bucket
+                const Clock::time_point sent = Clock::now();
+                if (opt.sample_ms > 0 && sent >= next_sample)
+                {
+                    if (queue)
+                        queue->flush();
+
+                    if (client.sync())
+                        report.latencies.push_back(
+                            std::chrono::duration<double, std::milli>(Clock::now() - sent).count());
+
+                    next_sample = sent + std::chrono::milliseconds(opt.sample_ms);
+                }
+            }
+        }
+
+        if (queue)
+            queue->flush();
+
+        const WireStats& wire = client.wire_stats();
+        report.raw_bytes += wire.raw_bytes;
+        report.wire_bytes += wire.wire_bytes;
+        report.deltas += wire.deltas;
+
+        report.protocol = client.protocol();
+        report.codec = client.codec();
+        report.shared = client.shared();
+
+        client.close_image();
+    }
+    catch (const std::exception& e)
+    {
+        report.errors++;
+        report.error = e.what();
+    }
+
+    if (queue)
+    {
+        report.queue = queue->stats();
+        report.errors += report.queue.errors;
+        if (report.error.empty())
+            report.error = queue->last_error();
+    }
+}
+
+// Value below which the given fraction of the sorted samples falls
+static double percentile(const std::vector<double>& sorted, const double& fraction)
+{
+    if (sorted.empty())
+        return 0.0;
+
+    const size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+int main(int argc, char* argv[])
+{
+    Options opt;
+    if (!parse(argc, argv, opt))
+    {
+        usage();
+        return 1;
+    }
+
+    const std::vector<Tile> tiles = scan(opt);
+
+    std::string spps;
+    for (size_t a = 0; a < opt.aovs.size(); ++a)
+        spps += (a ? "," : "") + std::to_string(opt.aovs[a]);
+
+    printf("%s:%d, %dx%d, %zu buckets of %dpx in %s order, %zu aovs (%s), "
+           "%d passes, %d sessions, %s\n",
+           opt.host.c_str(), opt.port, opt.xres, opt.yres, tiles.size(), opt.bucket,
+           opt.order.c_str(), opt.aovs.size(), spps.c_str(), opt.passes, opt.sessions,
+           opt.rate > 0.0 ? (std::to_string(static_cast<long long>(opt.rate)) + " buckets/s").c_str()
+                          : "unlimited rate");
+    fflush(stdout);
+
+    // Sessions ids are milliseconds, so they'd collide if taken at once
+    const long long session = get_unique_id();
+    std::vector<Report> reports(opt.sessions);
+    std::vector<std::thread> threads;
+
+    const Clock::time_point start = Clock::now();
+    for (int s = 0; s < opt.sessions; ++s)
+        threads.push_back(std::thread(render, std::cref(opt), std::cref(tiles),
+                                      session + s, start, std::ref(reports[s])));
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    const double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    Report total;
+    for (size_t i = 0; i < reports.size(); ++i)
+    {
+        const Report& r = reports[i];
+        total.buckets += r.buckets;
+        total.messages += r.messages;
+        total.raw_bytes += r.raw_bytes;
+        total.wire_bytes += r.wire_bytes;
+        total.deltas += r.deltas;
+        total.errors += r.errors;
+        total.latencies.insert(total.latencies.end(), r.latencies.begin(), r.latencies.end());
+
+        total.queue.dropped += r.queue.dropped;
+        total.queue.coalesced += r.queue.coalesced;
+        total.queue.blocked += r.queue.blocked;
+        total.queue.blocked_ms += r.queue.blocked_ms;
+
+        if (total.error.empty())
+            total.error = r.error;
+        if (r.protocol > 0)
+        {
+            total.protocol = r.protocol;
+            total.codec = r.codec;
+            total.shared = r.shared;
+        }
+    }
+
+    printf("Protocol %d%s%s\n", total.protocol,
+           total.shared ? ", shared memory" : "",
+           total.codec != codec_none ? ", compressed" : "");
+
+    printf("Sent %lld buckets, %lld messages, %.1f MB of pixels as %.1f MB, "
+           "%lld as deltas, in %.2f s\n",
+           total.buckets, total.messages, total.raw_bytes / 1048576.0,
+           total.wire_bytes / 1048576.0, total.deltas, secs);
+
+    printf("Throughput %.0f buckets/s, %.1f MB/s of pixels, %.1f MB/s on the wire\n",
+           total.buckets / secs, total.raw_bytes / 1048576.0 / secs,
+           total.wire_bytes / 1048576.0 / secs);
+
+    if (opt.queue > 0)
+        printf("Queue dropped %lld, coalesced %lld, blocked %lld times for %.1f ms\n",
+               total.queue.dropped, total.queue.coalesced,
+               total.queue.blocked, total.queue.blocked_ms);
+
+    // Time from handing a bucket over to the server having handled it
+    std::vector<double>& latencies = total.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    if (!latencies.empty())
+        printf("Latency over %zu buckets, min %.2f ms, median %.2f ms, "
+               "p99 %.2f ms, max %.2f ms\n",
+               latencies.size(), latencies.front(), percentile(latencies, 0.5),
+               percentile(latencies, 0.99), latencies.back());
+    else if (opt.sample_ms > 0 && total.protocol == protocol_legacy)
+        printf("Latency not available with the legacy protocol\n");
+
+    if (total.errors > 0)
+    {
+        fprintf(stderr, "aton_loadgen: %lld errors, %s\n", total.errors, total.error.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -28,6 +28,7 @@ void Aton::attach()
     knob("formats_knob")->hide();
     knob("capturing_knob")->hide();
     knob("cam_fov_knob")->hide();
+    knob("stats_knob")->hide();
     
     // Reset Snapshots
     m_node->m_outputKnob->tableKnob()->deleteAllItems();
@@ -68,10 +69,19 @@ void Aton::detach()
     disconnect();
     WriteGuard lock(m_node->m_mutex);
     m_node->m_framebuffers = std::vector<FrameBuffer>();
+    index_framebuffers();
 }
 
 void Aton::append(Hash& hash)
 {
+    // Nuke asks for a new hash when the viewer changes frames
+    const double frame = uiContext().frame();
+    if (m_node->m_multiframes && frame != m_node->m_ui_frame)
+    {
+        m_node->m_ui_frame = frame;
+        wake_updater(event_frame);
+    }
+    
     hash.append(m_node->m_hash_count);
     hash.append(uiContext().frame());
     hash.append(outputContext().frame());
@@ -89,6 +99,12 @@ void Aton::_validate(bool for_real)
     // Update Outputs
     set_outputs();
     
+    // Bring back the current RenderBuffer if it was spilled
+    touch_renderbuffer();
+    
+    // Update Stats
+    set_stats();
+    
     ReadGuard lock(m_node->m_mutex);
     RenderBuffer* rb = current_renderbuffer();
 
@@ -102,6 +118,7 @@ void Aton::_validate(bool for_real)
         // Update Channels
         set_channels(rb->get_aovs(),
                      rb->ready());
+        map_channels(rb);
         
         // Udpate Status Bar
         set_status(rb->get_progress(),
@@ -115,7 +132,7 @@ void Aton::_validate(bool for_real)
         
         // Update Camera
         set_camera(rb->get_camera_fov(),
-                   rb->get_camera_matrix());
+                   Matrix4(&rb->get_camera_matrix()[0]));
 
         FrameBuffer* fb = current_framebuffer();
         info_.setFirstFrame(fb->get_first_frame());
@@ -143,6 +160,7 @@ const MetaData::Bundle& Aton::_fetchMetaData(const char* keyname)
         m_node->m_metadata.setData(std::string("exr/aton/memory"), int(rb->get_peak_memory()));
         m_node->m_metadata.setData(std::string("exr/aton/sampling"), rb->get_samples());
         m_node->m_metadata.setData(std::string("exr/aton/version"), rb->get_version_str());
+        m_node->m_metadata.setData(std::string("exr/aton/lock_waits"), double(RowLocks::contention()));
     }
     
     return m_node->m_metadata;
@@ -150,36 +168,61 @@ const MetaData::Bundle& Aton::_fetchMetaData(const char* keyname)
 
 void Aton::engine(int y, int x, int r, ChannelMask channels, Row& out)
 {
+    // First row drawn since the viewer was flagged
+    if (m_node->m_display_flagged.load(std::memory_order_relaxed) != 0)
+        record_display();
+    
     ReadGuard lock(m_node->m_mutex);
     RenderBuffer* rb = current_renderbuffer();
     
-    int w = 0, h = 0;
-    if (rb != NULL)
+    // Span of the row covered by the buffer
+    int x0 = x, x1 = x;
+    if (rb != NULL && rb->ready() && y >= 0 && y < rb->get_height())
     {
-        w = rb->get_width();
-        h = rb->get_height();
+        x0 = std::min(std::max(x, 0), r);
+        x1 = std::max(std::min(r, rb->get_width()), x0);
     }
     
+    // Keep the writers off this row while copying it
+    RowGuard row_lock(x1 > x0 ? rb : NULL, y);
+    
+    // Map of the last _validate, kept alive while the row is drawn
+    std::shared_ptr<const ChannelMap> map;
+    if (x1 > x0 && m_enable_aovs)
+        map = channel_map();
+    
     foreach(z, channels)
     {
-        int b = 0;
-        int xx = x;
-        const int c = colourIndex(z);
-        float* cOut = out.writable(z) + x;
-        const float* END = cOut + (r - x);
+        float* cOut = out.writable(z);
+        bool copied = false;
         
-        if (m_enable_aovs && rb != NULL && rb->ready())
-            b = rb->get_aov_index(z);
+        if (x1 > x0)
+        {
+            int b = 0, c = colourIndex(z);
+            if (m_enable_aovs)
+            {
+                // Use the map built by _validate, unless the aovs changed since
+                if (map && rb->aovs_key() == map->aovs && z < map->map.size())
+                {
+                    b = map->map[z].first;
+                    c = map->map[z].second;
+                }
+                else
+                    b = rb->get_layer_index(getLayerName(z));
+            }
+            // Converted straight into the output row
+            copied = rb->read_aov_row(b, c, y, x0, x1 - x0, cOut + x0);
+        }
         
-        while (cOut < END)
+        if (!copied)
         {
-            if (rb == NULL || !rb->ready() || x >= w || y >= h || r > w)
-                *cOut = 0.0f;
-            else
-                *cOut = rb->get_aov_pix(b, xx, y, c);
-            ++cOut;
-            ++xx;
+            std::fill(cOut + x, cOut + r, 0.0f);
+            continue;
         }
+        
+        // Zero the tails around the copy
+        std::fill(cOut + x, cOut + x0, 0.0f);
+        std::fill(cOut + x1, cOut + r, 0.0f);
     }
 }
 
@@ -189,6 +232,8 @@ void Aton::knobs(Knob_Callback f)
     Divider(f, "Listen");
     Int_knob(f, &m_port, "port_knob", "Port");
     Knob* reset_knob = Button(f, "reset_port_knob", "Reset");
+    Newline(f);
+    Knob* refresh_knob = Int_knob(f, &m_refresh_rate, "refresh_rate_knob", "Refresh Rate (Hz)");
     
     // Camera knobs
     Divider(f, "Camera");
@@ -198,6 +243,7 @@ void Aton::knobs(Knob_Callback f)
     Divider(f, "Snapshots");
     Bool_knob(f, &m_enable_aovs, "enable_aovs_knob", "Enable AOVs");
     Bool_knob(f, &m_multiframes, "multi_frame_knob", "Multiple Frames Mode");
+    Knob* budget_knob = Int_knob(f, &m_memory_budget, "memory_budget_knob", "Memory Budget (MB)");
     m_outputKnob = Table_knob(f, "output_knob", "Output");
     if (f.makeKnobs())
     {
@@ -227,6 +273,19 @@ void Aton::knobs(Knob_Callback f)
     Button(f, "import_latest_knob", "Read Latest");
     Button(f, "import_all_knob", "Read All");
     
+    // Stats, updated a couple of times a second while rendering
+    BeginClosedGroup(f, "stats_group", "Stats");
+    Knob* ingest_knob = String_knob(f, &m_stats_ingest, "stats_ingest_knob", "Ingest");
+    Knob* wait_knob = String_knob(f, &m_stats_wait, "stats_wait_knob", "Lock Waits");
+    Knob* memory_knob = String_knob(f, &m_stats_memory, "stats_memory_knob", "Memory");
+    Knob* updates_knob = String_knob(f, &m_stats_updates, "stats_updates_knob", "Updates");
+    Knob* latency_knob = String_knob(f, &m_latency_status, "latency_knob", "Latency");
+    Knob* dump_latency = Button(f, "dump_latency_knob", "Dump");
+    Knob* reset_latency = Button(f, "reset_latency_knob", "Reset");
+    Newline(f);
+    Knob* update_stats = Button(f, "update_stats_knob", "Update");
+    EndGroup(f);
+    
     // Status Bar
     BeginToolbar(f, "status_bar");
     Knob* statusKnob = String_knob(f, &m_status, "status_knob", "");
@@ -236,6 +295,7 @@ void Aton::knobs(Knob_Callback f)
     Format_knob(f, &m_fmtp, "formats_knob", "format");
     Bool_knob(f, &m_capturing, "capturing_knob");
     Float_knob(f, &m_cam_fov, "cam_fov_knob", " cFov");
+    Knob* json_knob = String_knob(f, &m_stats_json, "stats_knob");
     
     for (int i=0; i<16; ++i)
     {
@@ -245,6 +305,20 @@ void Aton::knobs(Knob_Callback f)
     
     // Setting Flags
     reset_knob->set_flag(Knob::NO_RERENDER, true);
+    budget_knob->set_flag(Knob::NO_RERENDER, true);
+    refresh_knob->set_flag(Knob::NO_RERENDER, true);
+    dump_latency->set_flag(Knob::NO_RERENDER, true);
+    reset_latency->set_flag(Knob::NO_RERENDER, true);
+    update_stats->set_flag(Knob::NO_RERENDER, true);
+    
+    Knob* stats_knobs[6] = {ingest_knob, wait_knob, memory_knob,
+                            updates_knob, latency_knob, json_knob};
+    for (int i = 0; i < 6; ++i)
+    {
+        stats_knobs[i]->set_flag(Knob::NO_RERENDER, true);
+        stats_knobs[i]->set_flag(Knob::READ_ONLY, true);
+        stats_knobs[i]->set_flag(Knob::OUTPUT_ONLY, true);
+    }
     path_knob->set_flag(Knob::NO_RERENDER, true);
     live_cam_knob->set_flag(Knob::NO_RERENDER, true);
     move_up->set_flag(Knob::NO_RERENDER, true);
@@ -272,6 +346,12 @@ int Aton::knob_changed(Knob* _knob)
         change_port(m_port);
         return 1;
     }
+    if (_knob->is("memory_budget_knob"))
+    {
+        WriteGuard lock(m_node->m_mutex);
+        cache_renderbuffers();
+        return 1;
+    }
     if (_knob->is("output_knob"))
     {
         select_output_cmd();
@@ -307,6 +387,21 @@ int Aton::knob_changed(Knob* _knob)
         live_camera_toogle();
         return 1;
     }
+    if (_knob->is("dump_latency_knob"))
+    {
+        dump_latency_cmd();
+        return 1;
+    }
+    if (_knob->is("reset_latency_knob"))
+    {
+        reset_latency_cmd();
+        return 1;
+    }
+    if (_knob->is("update_stats_knob"))
+    {
+        set_stats(true);
+        return 1;
+    }
     if (_knob->is("reset_region_knob"))
     {
         reset_region_cmd();
@@ -349,15 +444,25 @@ void Aton::change_port(int port)
     // Try to reconnect
     disconnect();
 
+    // Listen on the Unix domain socket if the host is one
+    const std::string host = get_host();
+    const bool local = !get_unix_path(host).empty();
+    
     try
     {
-        m_server.connect(port, true);
+        if (local)
+            m_server.connect(host);
+        else
+            m_server.connect(port, true);
         m_legit = true;
     }
     catch ( ... )
     {
         std::stringstream stream;
-        stream << "Could not connect to port: " << port;
+        if (local)
+            stream << "Could not listen on: " << host;
+        else
+            stream << "Could not connect to port: " << port;
         m_connection_error = stream.str();
         m_inError = true;
         print_name( std::cerr );
@@ -368,10 +473,18 @@ void Aton::change_port(int port)
     // Success
     if (m_server.connected())
     {
-        Thread::spawn(::fb_writer, 1, m_node);
+        // Decode up to 4 renders at once
+        if (m_writer == NULL)
+            m_writer = new FBWriter(m_node);
+        m_server.start(m_writer, 4);
+        
+        // Sleeps until frame changes or late buckets need the viewer,
+        // the first node's m_legit stops it
+        if (m_node == this)
+            Thread::spawn(::fb_updater, 1, m_node);
 
         // Update port in the UI
-        if (m_port != m_server.get_port())
+        if (!local && m_port != m_server.get_port())
         {
             std::stringstream stream;
             stream << (m_server.get_port());
@@ -416,7 +529,19 @@ void Aton::disconnect()
     if (m_server.connected())
     {
         m_server.quit();
-        Thread::wait(m_node);
+        
+        // Only the first node runs the updater, which stops once it's
+        // woken without m_legit. Cleared under the updater's mutex, so
+        // it can't be missed between the check and the wait.
+        if (m_node == this)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_updater_mutex);
+                m_legit = false;
+            }
+            wake_updater();
+            Thread::wait(this);
+        }
     }
 }
 
@@ -431,23 +556,81 @@ void Aton::flag_update(const Box& box)
     asapUpdate(box);
 }
 
-FrameBuffer* Aton::get_framebuffer(const long long& session)
+// Refresh the viewer with the merged buckets, timing the oldest of them
+// Expects m_status_mutex to be held.
+void Aton::refresh_area(const int area[4])
+{
+    Aton* node = m_node;
+    if (node->m_refresh_since != 0)
+    {
+        const long long now = get_clock();
+        node->m_latency[latency_refresh].record(now - node->m_refresh_since);
+        
+        // Unless the engine is still behind on the previous refresh
+        long long none = 0;
+        node->m_display_stamp.compare_exchange_strong(none, node->m_refresh_stamp);
+        none = 0;
+        node->m_display_flagged.compare_exchange_strong(none, now);
+        
+        node->m_refresh_since = node->m_refresh_stamp = 0;
+    }
+    
+    node->m_refreshes++;
+    flag_update(Box(area[0], area[1], area[2], area[3]));
+}
+
+void Aton::record_display()
+{
+    const long long flagged = m_node->m_display_flagged.exchange(0);
+    if (flagged == 0)
+        return;
+    
+    const long long now = get_clock();
+    const long long stamp = m_node->m_display_stamp.exchange(0);
+    
+    m_node->m_latency[latency_display].record(now - flagged);
+    if (stamp != 0)
+        m_node->m_latency[latency_total].record(now - stamp);
+}
+
+void Aton::wake_updater(const unsigned int& events)
 {
-    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
-    if (!fbs.empty())
     {
-        std::vector<FrameBuffer>::iterator it;
-        for(it = fbs.begin(); it != fbs.end(); ++it)
-            if (it->get_session() == session)
-                return &(*it);
+        std::lock_guard<std::mutex> lock(m_node->m_updater_mutex);
+        m_node->m_updater_events |= events;
     }
+    m_node->m_updater_cond.notify_one();
+}
+
+FrameBuffer* Aton::get_framebuffer(const long long& session)
+{
+    std::unordered_map<long long, size_t>::const_iterator it;
+    it = m_node->m_fb_index.find(session);
+    if (it != m_node->m_fb_index.end())
+        return &m_node->m_framebuffers[it->second];
     return NULL;
 }
 
+// Rebuild the session index after the Framebuffers or their sessions
+// changed, the node's lock must be held exclusively
+void Aton::index_framebuffers()
+{
+    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+    std::unordered_map<long long, size_t>& index = m_node->m_fb_index;
+    
+    // The first Framebuffer of a session wins, as it did for the scan
+    index.clear();
+    for (size_t i = 0; i < fbs.size(); ++i)
+        index.insert(std::make_pair(fbs[i].get_session(), i));
+    
+    ++m_node->m_fb_generation;
+}
+
 FrameBuffer* Aton::add_framebuffer()
 {
     std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
     fbs.push_back(FrameBuffer());
+    index_framebuffers();
     m_node->m_output_changed = Aton::item_added;
     return &fbs.back();
 }
@@ -484,6 +667,80 @@ RenderBuffer* Aton::current_renderbuffer()
         return NULL;
 }
 
+void Aton::touch_renderbuffer()
+{
+    // Most of the time the current one is resident and the latest used
+    {
+        ReadGuard lock(m_node->m_mutex);
+        RenderBuffer* rb = current_renderbuffer();
+        if (rb == NULL || (!rb->spilled() && rb->last_used() == m_node->m_cache_tick))
+            return;
+    }
+    
+    WriteGuard lock(m_node->m_mutex);
+    RenderBuffer* rb = current_renderbuffer();
+    
+    if (rb != NULL)
+    {
+        rb->set_last_used(++m_node->m_cache_tick);
+        rb->restore();
+        cache_renderbuffers(rb);
+    }
+}
+
+// Spill the least recently used RenderBuffers over the memory budget
+// to disk. Tiles shared between RenderBuffers count for each of them,
+// and so do the samples the connections keep for the Clients' deltas.
+// The node's lock must be held exclusively.
+void Aton::cache_renderbuffers(RenderBuffer* keep)
+{
+    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+    RenderBuffer* current = current_renderbuffer();
+    
+    std::vector<std::pair<unsigned long long, RenderBuffer*> > resident;
+    long long resident_bytes = m_node->m_server.ingest().references;
+    long long spilled_bytes = 0;
+    
+    std::vector<FrameBuffer>::iterator fb;
+    for (fb = fbs.begin(); fb != fbs.end(); ++fb)
+    {
+        const FrameBuffer::RenderBuffers& rbs = fb->get_renderbuffers();
+        FrameBuffer::RenderBuffers::const_iterator it;
+        for (it = rbs.begin(); it != rbs.end(); ++it)
+        {
+            RenderBuffer* rb = it->get();
+            if (rb->spilled())
+                spilled_bytes += rb->spilled_bytes();
+            else
+            {
+                resident_bytes += rb->resident_bytes();
+                if (rb != keep && rb != current)
+                    resident.push_back(std::make_pair(rb->last_used(), rb));
+            }
+        }
+    }
+    
+    // Oldest first
+    std::sort(resident.begin(), resident.end());
+    
+    const long long budget = static_cast<long long>(m_node->m_memory_budget) << 20;
+    std::vector<std::pair<unsigned long long, RenderBuffer*> >::iterator it;
+    for (it = resident.begin(); budget > 0 && resident_bytes > budget && it != resident.end(); ++it)
+    {
+        RenderBuffer* rb = it->second;
+        const long long bytes = rb->resident_bytes();
+        
+        if (bytes > 0 && rb->spill(get_path() + "/aton_cache"))
+        {
+            resident_bytes -= bytes;
+            spilled_bytes += rb->spilled_bytes();
+        }
+    }
+    
+    m_node->m_resident_bytes = resident_bytes;
+    m_node->m_spilled_bytes = spilled_bytes;
+}
+
 int Aton::current_fb_index(bool direction)
 {
     Table_KnobI* outputKnob = m_node->m_outputKnob->tableKnob();
@@ -662,6 +919,39 @@ void Aton::reset_channels(ChannelSet& channels)
     }
 }
 
+void Aton::map_channels(RenderBuffer* rb)
+{
+    const ChannelSet& channels = m_node->m_channels;
+    
+    // Rebuild only when the channels or the aovs have changed
+    std::shared_ptr<const ChannelMap> current = channel_map();
+    if (current && rb->aovs_key() == current->aovs && channels == current->channels)
+        return;
+    
+    // Built aside, the engine threads keep reading the current one
+    std::shared_ptr<ChannelMap> map = std::make_shared<ChannelMap>();
+    
+    int size = 0;
+    foreach(z, channels)
+        size = std::max(size, static_cast<int>(z) + 1);
+    
+    map->map.assign(size, std::make_pair(0, 0));
+    foreach(z, channels)
+        map->map[z] = std::make_pair(rb->get_layer_index(getLayerName(z)), colourIndex(z));
+    
+    map->channels = channels;
+    map->aovs = rb->aovs_key();
+    
+    std::lock_guard<std::mutex> lock(m_channel_map_mutex);
+    m_channel_map = map;
+}
+
+std::shared_ptr<const ChannelMap> Aton::channel_map()
+{
+    std::lock_guard<std::mutex> lock(m_channel_map_mutex);
+    return m_channel_map;
+}
+
 void Aton::set_camera(const float& fov,
                       const Matrix4& matrix)
 {
@@ -685,6 +975,7 @@ void Aton::set_current_frame(const double& frame)
     {
         ctxt.setFrame(frame);
         gotoContext(ctxt, true);
+        wake_updater(event_frame);
     }
 }
 
@@ -702,11 +993,14 @@ void Aton::set_status(const long long& progress,
     size_t fb_size = fb == NULL ? 0 : fb->size();
     std::string status_str = (boost::format("Arnold %s | "
                                             "Memory: %sMB / %sMB | "
+                                            "Cache: %sMB / %sMB spilled | "
                                             "Time: %s | "
                                             "Name: %s | "
                                             "Frame: %s(%s) | "
                                             "Sampling: %s | "
-                                            "Progress: %s%%")%version%ram%p_ram%time%name
+                                            "Progress: %s%%")%version%ram%p_ram
+                                                             %(m_node->m_resident_bytes >> 20)
+                                                             %(m_node->m_spilled_bytes >> 20)%time%name
                                                              %frame%fb_size%samples%progress).str();
     
     Knob* statusKnob = m_node->knob("status_knob");
@@ -714,6 +1008,208 @@ void Aton::set_status(const long long& progress,
     statusKnob->set_text(status_str.c_str());
 }
 
+// Names of the LatencyStages
+static const char* const latency_names[Aton::latency_stages] =
+{
+    "receive", "decode", "blit", "refresh", "display", "total"
+};
+
+void Aton::set_latency_status(const bool& force)
+{
+    // It goes through every bin, so only a few times a second
+    const long long now = get_clock();
+    if (!force && now - m_node->m_latency_shown < 250000000LL)
+        return;
+    m_node->m_latency_shown = now;
+    
+    std::string latency_str;
+    for (int i = 0; i < latency_stages; ++i)
+    {
+        const LatencyHistogram& latency = m_node->m_latency[i];
+        if (latency.count() == 0)
+            continue;
+        
+        latency_str += (boost::format("%s%s %.1f/%.1f")%(latency_str.empty() ? "" : " | ")
+                                                      %latency_names[i]
+                                                      %(latency.percentile(0.5) / 1e6)
+                                                      %(latency.percentile(0.99) / 1e6)).str();
+    }
+    latency_str += latency_str.empty() ? "No buckets yet" : " ms (p50/p99)";
+    
+    if (latency_str != m_node->m_latency_status)
+        m_node->knob("latency_knob")->set_text(latency_str.c_str());
+}
+
+// Sets the stats knobs from the counters of the Server and the writer.
+// Goes through the Framebuffers sharing the node's lock with the writer,
+// spilling and restoring RenderBuffers take it exclusively.
+void Aton::set_stats(const bool& force)
+{
+    Aton* node = m_node;
+    
+    // Rates over at least half a second
+    const long long now = get_clock();
+    const long long elapsed = now - node->m_stats_shown;
+    if (!force && elapsed < 500000000LL)
+        return;
+    
+    const IngestStats ingest = node->m_server.ingest();
+    const std::vector<IngestStats> sessions = node->m_server.session_ingest();
+    const IngestStats& last = node->m_stats_last;
+    
+    const double secs = node->m_stats_shown == 0 ? 0.0 : elapsed / 1e9;
+    const double bytes_rate = secs > 0.0 ? (ingest.bytes - last.bytes) / secs : 0.0;
+    const double buckets_rate = secs > 0.0 ? (ingest.buckets - last.buckets) / secs : 0.0;
+    const long long decode_ns = ingest.decode_ns - last.decode_ns;
+    const double decode_rate = decode_ns > 0 ? (ingest.pixel_bytes - last.pixel_bytes) * 1e9 / decode_ns : 0.0;
+    
+    node->m_stats_shown = now;
+    node->m_stats_last = ingest;
+    
+    // Pixels of every Framebuffer, shared tiles count for each RenderBuffer,
+    // and the connections' delta references
+    long long resident_bytes = ingest.references, spilled_bytes = 0, renderbuffers = 0;
+    size_t framebuffers = 0;
+    {
+        ReadGuard lock(node->m_mutex);
+        
+        std::vector<FrameBuffer>& fbs = node->m_framebuffers;
+        framebuffers = fbs.size();
+        
+        std::vector<FrameBuffer>::iterator fb;
+        for (fb = fbs.begin(); fb != fbs.end(); ++fb)
+        {
+            const FrameBuffer::RenderBuffers& rbs = fb->get_renderbuffers();
+            FrameBuffer::RenderBuffers::const_iterator it;
+            for (it = rbs.begin(); it != rbs.end(); ++it, ++renderbuffers)
+            {
+                if ((*it)->spilled())
+                    spilled_bytes += (*it)->spilled_bytes();
+                else
+                    resident_bytes += (*it)->resident_bytes();
+            }
+        }
+    }
+    
+    long long updates, refreshes;
+    {
+        Guard lock(node->m_status_mutex);
+        updates = node->m_updates;
+        refreshes = node->m_refreshes;
+    }
+    
+    const long long dropped = node->m_dropped;
+    const long long lock_wait_ns = node->m_lock_wait_ns;
+    const unsigned long long row_waits = RowLocks::contention();
+    const unsigned long long row_wait_ns = RowLocks::wait_ns();
+    
+    // Buckets sent raw take no time to decode
+    std::string decode_str = "-";
+    if (decode_rate > 0.0)
+        decode_str = (boost::format("%.0f MB/s")%(decode_rate / 1048576.0)).str();
+    
+    std::string ingest_str = (boost::format("%.1f MB/s | %.0f buckets/s | Decode: %s | "
+                                            "%s clients, %sKB queued")%(bytes_rate / 1048576.0)
+                                                                       %buckets_rate%decode_str
+                                                                       %sessions.size()
+                                                                       %(ingest.queued >> 10)).str();
+    std::string wait_str = (boost::format("Writer: %.1f ms | Rows: %.1f ms in %s waits")%(lock_wait_ns / 1e6)
+                                                                                     %(row_wait_ns / 1e6)
+                                                                                     %row_waits).str();
+    std::string memory_str = (boost::format("%sMB resident (%sMB delta references) | %sMB spilled | "
+                                            "%s Framebuffers, %s RenderBuffers")%(resident_bytes >> 20)
+                                                                                %(ingest.references >> 20)
+                                                                                %(spilled_bytes >> 20)
+                                                                                %framebuffers
+                                                                                %renderbuffers).str();
+    std::string updates_str = (boost::format("%s buckets | %s refreshes | %s coalesced | %s dropped")%updates
+                                                                                                     %refreshes
+                                                                                                     %(updates - refreshes)
+                                                                                                     %dropped).str();
+    
+    // Same as the knobs, for scripts to json.loads
+    std::string json = (boost::format("{\"buckets\": %s, \"bytes\": %s, \"pixel_bytes\": %s, "
+                                      "\"decode_ns\": %s, \"queued_bytes\": %s, "
+                                      "\"bytes_per_s\": %.1f, \"buckets_per_s\": %.1f, \"decode_bytes_per_s\": %.1f, "
+                                      "\"lock_wait_ns\": %s, \"row_lock_waits\": %s, \"row_lock_wait_ns\": %s, "
+                                      "\"resident_bytes\": %s, \"reference_bytes\": %s, \"spilled_bytes\": %s, "
+                                      "\"framebuffers\": %s, \"renderbuffers\": %s, "
+                                      "\"updates\": %s, \"refreshes\": %s, \"coalesced\": %s, \"dropped\": %s")
+                                      %ingest.buckets%ingest.bytes%ingest.pixel_bytes
+                                      %ingest.decode_ns%ingest.queued
+                                      %bytes_rate%buckets_rate%decode_rate
+                                      %lock_wait_ns%row_waits%row_wait_ns
+                                      %resident_bytes%ingest.references%spilled_bytes
+                                      %framebuffers%renderbuffers
+                                      %updates%refreshes%(updates - refreshes)%dropped).str();
+    
+    json += ", \"latency_ms\": {";
+    for (int i = 0; i < latency_stages; ++i)
+    {
+        const LatencyHistogram& latency = node->m_latency[i];
+        json += (boost::format("%s\"%s\": {\"count\": %s, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}")
+                               %(i == 0 ? "" : ", ")%latency_names[i]%latency.count()
+                               %(latency.percentile(0.5) / 1e6)
+                               %(latency.percentile(0.99) / 1e6)
+                               %(latency.max() / 1e6)).str();
+    }
+    
+    // One entry per connected driver, with the render session it sends
+    json += "}, \"connections\": [";
+    for (size_t i = 0; i < sessions.size(); ++i)
+    {
+        const IngestStats& session = sessions[i];
+        json += (boost::format("%s{\"session\": %s, \"buckets\": %s, \"bytes\": %s, "
+                               "\"pixel_bytes\": %s, \"decode_ns\": %s, \"queued_bytes\": %s, "
+                               "\"reference_bytes\": %s}")
+                               %(i == 0 ? "" : ", ")%session.session%session.buckets%session.bytes
+                               %session.pixel_bytes%session.decode_ns%session.queued
+                               %session.references).str();
+    }
+    json += "]}";
+    
+    if (ingest_str != node->m_stats_ingest)
+        node->knob("stats_ingest_knob")->set_text(ingest_str.c_str());
+    if (wait_str != node->m_stats_wait)
+        node->knob("stats_wait_knob")->set_text(wait_str.c_str());
+    if (memory_str != node->m_stats_memory)
+        node->knob("stats_memory_knob")->set_text(memory_str.c_str());
+    if (updates_str != node->m_stats_updates)
+        node->knob("stats_updates_knob")->set_text(updates_str.c_str());
+    if (json != node->m_stats_json)
+        node->knob("stats_knob")->set_text(json.c_str());
+    
+    set_latency_status(force);
+}
+
+void Aton::dump_latency_cmd()
+{
+    std::cout << (boost::format("Aton | %s bucket latencies in ms\n"
+                                "%-8s %10s %9s %9s %9s %9s %9s")%m_node->m_node_name
+                                                                %"stage"%"count"%"p50"%"p90"
+                                                                %"p99"%"p99.9"%"max").str() << std::endl;
+    
+    for (int i = 0; i < latency_stages; ++i)
+    {
+        const LatencyHistogram& latency = m_node->m_latency[i];
+        std::cout << (boost::format("%-8s %10d %9.3f %9.3f %9.3f %9.3f %9.3f")%latency_names[i]
+                                                                             %latency.count()
+                                                                             %(latency.percentile(0.5) / 1e6)
+                                                                             %(latency.percentile(0.9) / 1e6)
+                                                                             %(latency.percentile(0.99) / 1e6)
+                                                                             %(latency.percentile(0.999) / 1e6)
+                                                                             %(latency.max() / 1e6)).str() << std::endl;
+    }
+}
+
+void Aton::reset_latency_cmd()
+{
+    for (int i = 0; i < latency_stages; ++i)
+        m_node->m_latency[i].reset();
+    
+    set_latency_status(true);
+}
+
 void Aton::multiframe_cmd()
 {
     WriteGuard lock(m_node->m_mutex);
@@ -723,7 +1219,7 @@ void Aton::multiframe_cmd()
         fb->set_frame(uiContext().frame());
 
     if (m_node->m_multiframes)
-        Thread::spawn(::fb_updater, 1, m_node);
+        wake_updater(event_frame);
 }
 
 void Aton::select_output_cmd()
@@ -772,6 +1268,7 @@ void Aton::snapshot_cmd()
             idx = idx > 0 ? idx-- : 0;
             fbs.insert(fbs.begin() + idx, *fb);
             fbs[idx].set_session(0);
+            index_framebuffers();
             m_node->m_output_changed = Aton::item_copied;
             flag_update();
         }
@@ -797,6 +1294,7 @@ void Aton::move_cmd(bool direction)
                 std::swap(fbs[idx], fbs[idx-1]);
                 m_node->m_output_changed = Aton::item_moved_down;
             }
+            index_framebuffers();
             flag_update();
        }
     }
@@ -815,6 +1313,7 @@ void Aton::remove_selected_cmd()
         for(it = indexes.begin(); it != indexes.end(); ++it)
             if (*it >= 0)
                 fbs.erase(fbs.begin() + *it);
+        index_framebuffers();
 
         m_node->m_output_changed = Aton::item_removed;
 
@@ -20,6 +20,14 @@ using namespace DD::Image;
 #include "aton_client.h"
 #include "aton_server.h"
 #include "aton_framebuffer.h"
+#include "aton_refresh.h"
+#include "aton_latency.h"
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <condition_variable>
 
 // Class name
 static const char* const CLASS = "Aton";
@@ -30,33 +38,47 @@ static const char* const HELP =
     "Listens for renders coming from the Aton display driver. "
     "For more info go to http://sosoyan.github.io/Aton/";
 
-std::string get_date()
+// Nuke channels to the aov index and component holding them
+struct ChannelMap
 {
-    // Returns date and time
-    time_t rawtime;
-    struct tm *timeinfo;
-    char time_buffer[15];
-    
-    time (&rawtime);
-    timeinfo = localtime(&rawtime);
+    ChannelMap(): aovs(0) {}
     
-    // Setting up the Date and Time format style
-    strftime(time_buffer, 20, "%m.%d_%H:%M:%S", timeinfo);
-    
-    return std::string(time_buffer);
-}
+    std::vector<std::pair<int, int> > map;  // Indexed by channel
+    ChannelSet channels;                    // Channels the map was built for
+    unsigned long long aovs;                // Aovs key the map was built for
+};
 
 // Nuke node
 class Aton: public Iop
 {
     public:
+        // Stages of a bucket's way from the renderer to the viewer
+        enum LatencyStage
+        {
+            latency_receive = 0,    // Rendered until its message came in
+            latency_decode,         // Came in until it was decoded
+            latency_blit,           // Decoded until it was written
+            latency_refresh,        // Written until the viewer was flagged
+            latency_display,        // Flagged until the engine drew it
+            latency_total,          // Rendered until the engine drew it
+            latency_stages
+        };
+    
         Aton*                     m_node;               // First node pointer
         Server                    m_server;             // Aton::Server
-        ReadWriteLock             m_mutex;              // Mutex for locking the pixel buffer
+        ServerHandler*            m_writer;             // Writes incoming data to the framebuffers
+        ReadWriteLock             m_mutex;              // Mutex for locking the buffers structure
+        Lock                      m_status_mutex;       // Mutex for the status and update hash
+        std::mutex                m_updater_mutex;      // Mutex for the updater's events
+        std::condition_variable   m_updater_cond;       // Wakes the updater thread
+        unsigned int              m_updater_events;     // Events waiting for the updater
+        double                    m_ui_frame;           // Viewer frame the updater last saw
         Format                    m_fmt;                // The nuke display format
         FormatPair                m_fmtp;               // Buffer format (knob)
         ChannelSet                m_channels;           // Channels aka AOVs object
         int                       m_port;               // Port we're listening on (knob)
+        int                       m_memory_budget;      // RenderBuffers memory budget in MB (knob)
+        int                       m_refresh_rate;       // Viewer refreshes per second while rendering (knob)
         int                       m_output_changed;     // If Snapshots needs to be updated
         float                     m_cam_fov;            // Default Camera fov
         float                     m_cam_matrix;         // Default Camera matrix value
@@ -67,45 +89,97 @@ class Aton: public Iop
         bool                      m_inError;            // Error handling
         bool                      m_format_exists;      // If the format was already exist
         bool                      m_capturing;          // Capturing signal
-        bool                      m_legit;              // Used to throw the threads
+        std::atomic<bool>         m_legit;              // Used to throw the threads
         bool                      m_running;            // Thread Rendering
         unsigned int              m_hash_count;         // Refresh hash counter
+        RefreshRegion             m_refresh;            // Buckets waiting for the viewer
+        long long                 m_refresh_since;      // Oldest waiting bucket's write time
+        long long                 m_refresh_stamp;      // Oldest waiting bucket's render time
+        std::atomic<long long>    m_display_flagged;    // Refresh the engine hasn't drawn yet
+        std::atomic<long long>    m_display_stamp;      // Render time of its oldest bucket
+        LatencyHistogram          m_latency[latency_stages]; // Bucket latencies per stage
+        long long                 m_latency_shown;      // Last time the latency knob was set
+        std::atomic<long long>    m_dropped;            // Buckets the writer had nowhere to write
+        std::atomic<long long>    m_lock_wait_ns;       // Writer's waits for the buffers structure
+        long long                 m_updates;            // Buckets added to the refresh region
+        long long                 m_refreshes;          // Viewer refreshes they were merged into
+        long long                 m_stats_shown;        // Last time the stats knobs were set
+        IngestStats               m_stats_last;         // Server's counters at that time
+        unsigned long long        m_cache_tick;         // Last RenderBuffer use
+        long long                 m_resident_bytes;     // RenderBuffers pixels in memory
+        long long                 m_spilled_bytes;      // RenderBuffers pixels on disk
         const char*               m_path;               // Default path for Write node
         double                    m_region[4];          // Render Region Data
         std::string               m_node_name;          // Node name
         std::string               m_status;             // Status bar text
+        std::string               m_latency_status;     // Latency percentiles text
+        std::string               m_stats_ingest;       // Ingest rates text
+        std::string               m_stats_wait;         // Lock waits text
+        std::string               m_stats_memory;       // Framebuffers memory text
+        std::string               m_stats_updates;      // Viewer updates text
+        std::string               m_stats_json;         // All of the stats, for scripts
         std::string               m_connection_error;   // Connection error report
         Knob*                     m_outputKnob;         // Shapshots Knob
         std::vector<FrameBuffer>  m_framebuffers;       // Framebuffers List
+        std::unordered_map<long long, size_t> m_fb_index; // Session to its Framebuffer's index
+        unsigned long long        m_fb_generation;      // Changes with the Framebuffers List
+        std::shared_ptr<const ChannelMap> m_channel_map; // Channel map built by _validate
+        std::mutex                m_channel_map_mutex;  // Guards swapping the channel map
         MetaData::Bundle          m_metadata;           // Metadata object
 
         Aton(Node* node): Iop(node),
                           m_node(first_node()),
+                          m_writer(NULL),
+                          m_updater_events(0),
+                          m_ui_frame(0),
                           m_fmt(Format(0, 0, 1.0)),
                           m_channels(Mask_RGBA),
                           m_port(get_port()),
+                          m_memory_budget(0),
+                          m_refresh_rate(30),
+                          m_output_changed(0),
                           m_cam_fov(0),
                           m_cam_matrix(0),
-                          m_output_changed(0),
                           m_multiframes(false),
+                          m_write_frames(false),
                           m_enable_aovs(true),
                           m_live_camera(false),
-                          m_write_frames(false),
                           m_inError(false),
                           m_format_exists(false),
                           m_capturing(false),
                           m_legit(false),
                           m_running(false),
+                          m_refresh_since(0),
+                          m_refresh_stamp(0),
+                          m_display_flagged(0),
+                          m_display_stamp(0),
+                          m_latency_shown(0),
+                          m_dropped(0),
+                          m_lock_wait_ns(0),
+                          m_updates(0),
+                          m_refreshes(0),
+                          m_stats_shown(0),
+                          m_stats_last(),
+                          m_cache_tick(0),
+                          m_resident_bytes(0),
+                          m_spilled_bytes(0),
                           m_path(""),
                           m_node_name(""),
                           m_status(""),
-                          m_connection_error("")
+                          m_latency_status(""),
+                          m_stats_ingest(""),
+                          m_stats_wait(""),
+                          m_stats_memory(""),
+                          m_stats_updates(""),
+                          m_stats_json(""),
+                          m_connection_error(""),
+                          m_fb_generation(0)
         {
             inputs(0);
             m_region[0] = m_region[1] = m_region[2] =  m_region[3] = 0.0f;
         }
 
-        ~Aton() { disconnect(); }
+        ~Aton() { m_legit = false; disconnect(); delete m_writer; }
         
         Aton* first_node() { return dynamic_cast<Aton*>(firstOp()); }
     
@@ -119,6 +193,14 @@ class Aton: public Iop
         void knobs(Knob_Callback f);
         int knob_changed(Knob* _knob);
     
+        // What woke the updater thread
+        enum UpdaterEvent
+        {
+            event_none = 0,
+            event_frame = 1,        // The viewer changed frames
+            event_refresh = 2       // Buckets wait for the refresh rate
+        };
+    
         enum KnobChanged
         {
             item_not_changed = 0,
@@ -135,11 +217,18 @@ class Aton: public Iop
         void disconnect();
         void change_port(int port);
         void flag_update(const Box& box = Box(0,0,0,0));
+        void refresh_area(const int area[4]);
+        void record_display();
+        void wake_updater(const unsigned int& events = event_none);
 
         FrameBuffer* add_framebuffer();
         FrameBuffer* current_framebuffer();
         FrameBuffer* get_framebuffer(const long long& session);
+        void index_framebuffers();
         RenderBuffer* current_renderbuffer();
+    
+        void touch_renderbuffer();
+        void cache_renderbuffers(RenderBuffer* keep = NULL);
 
         int current_fb_index(bool direction = true);
         std::vector<int> selected_fb_indexes();
@@ -151,6 +240,8 @@ class Aton: public Iop
         void set_channels(std::vector<std::string>& aovs,
                           const bool& ready);
         void reset_channels(ChannelSet& channels);
+        void map_channels(RenderBuffer* rb);
+        std::shared_ptr<const ChannelMap> channel_map();
         void set_camera(const float& fov,
                         const Matrix4& matrix);
         void set_current_frame(const double& frame);
@@ -162,6 +253,8 @@ class Aton: public Iop
                         const char* version = "",
                         const char* samples = "",
                         const char* output = "");
+        void set_latency_status(const bool& force = false);
+        void set_stats(const bool& force = false);
     
         void live_camera_toogle();
         bool path_valid(std::string path);
@@ -177,6 +270,8 @@ class Aton: public Iop
         void copy_region_cmd();
         void capture_cmd();
         void import_cmd(bool all);
+        void dump_latency_cmd();
+        void reset_latency_cmd();
     
         bool firstEngineRendersWholeRequest() const { return true; }
         const char* Class() const { return CLASS; }
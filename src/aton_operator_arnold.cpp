@@ -78,7 +78,17 @@ node_parameters
     AiParameterStr("output", "");
     AiParameterInt("session", 0);
     AiParameterInt("reconnect", 0);
+    AiParameterInt("queue_size", 64);
+    AiParameterInt("queue_policy", 0);
+    AiParameterStr("reduced_aovs", "");
+    AiParameterInt("reduced_format", 1);
     AiParameterBool("keep_existing_outputs", false);
+    
+    // Passed on to the driver, as documented there
+    AiMetaDataSetStr(nentry, "reduced_format", AtString("desc"),
+                     AtString("Format of the reduced AOVs: 0 float, 1 half, 2 u16, 3 u8. "
+                              "Half keeps 11 bits of precision, u16 and u8 store steps of "
+                              "a range which coarsens as brighter or darker pixels arrive."));
 }
 
 operator_init
@@ -92,6 +102,10 @@ operator_init
     AiNodeSetStr(data->driver, "output", AiNodeGetStr(op, "output"));
     AiNodeSetInt(data->driver, "session", AiNodeGetInt(op, "session"));
     AiNodeSetInt(data->driver, "reconnect", AiNodeGetInt(op, "reconnect"));
+    AiNodeSetInt(data->driver, "queue_size", AiNodeGetInt(op, "queue_size"));
+    AiNodeSetInt(data->driver, "queue_policy", AiNodeGetInt(op, "queue_policy"));
+    AiNodeSetStr(data->driver, "reduced_aovs", AiNodeGetStr(op, "reduced_aovs"));
+    AiNodeSetInt(data->driver, "reduced_format", AiNodeGetInt(op, "reduced_format"));
     AiNodeSetLocalData(op, data);
     
     return true;
@@ -0,0 +1,233 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Headless receiver, listens like the Nuke node and keeps the images
+// in memory, for benchmarking and soak testing without Nuke.
+// Usage: aton_recv [port or unix:/path] [threads] [seconds]
+
+#include "aton_server.h"
+#include "aton_framebuffer.h"
+#include "aton_latency.h"
+
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+
+static std::atomic<bool> running(true);
+
+static void stop(int)
+{
+    running = false;
+}
+
+// Images of one render session
+struct Image
+{
+    std::mutex mutex;
+    FrameBuffer fb;
+};
+
+// Writes incoming buckets to the images, one per render session
+// Buckets of different sessions get written concurrently.
+class Receiver: public ServerHandler
+{
+public:
+    Receiver(): mBuckets(0), mBytes(0), mHeaders(0) {}
+
+    void header_received(Session& session, DataHeader& dh)
+    {
+        Image* image = get_image(dh);
+        session.set_data(image);
+        mHeaders++;
+
+        std::lock_guard<std::mutex> lock(image->mutex);
+        FrameBuffer& fb = image->fb;
+
+        const double frame = dh.frame();
+        RenderBuffer* rb;
+        if (fb.renderbuffer_exists(frame))
+        {
+            fb.update_renderbuffer(&dh);
+            rb = fb.get_renderbuffer(frame);
+        }
+        else
+            rb = fb.add_renderbuffer(&dh);
+
+        rb->set_frame(frame);
+        rb->set_name(dh.output_name());
+        rb->set_camera(dh.camera_fov(), dh.camera_matrix());
+        rb->set_version(dh.version());
+        rb->set_region_area(dh.region_area());
+        if (dh.samples().size() == 6)
+            rb->set_samples(dh.samples());
+    }
+
+    void pixels_received(Session& session, DataPixels& dp)
+    {
+        const long long decoded = get_clock();
+        if (dp.stamp() != 0)
+            mLatency[0].record(dp.received() - dp.stamp());
+        mLatency[1].record(decoded - dp.received());
+        
+        // Reconnecting drivers send buckets without a header
+        Image* image = reinterpret_cast<Image*>(session.data());
+        if (image == NULL)
+        {
+            DataHeader dh(dp.session(), dp.xres(), dp.yres(), 1.0f,
+                          0, 0, 0.0f, 0.0f, NULL, NULL, "");
+            image = get_image(dh);
+            session.set_data(image);
+        }
+
+        std::lock_guard<std::mutex> lock(image->mutex);
+        RenderBuffer* rb = image->fb.current_renderbuffer();
+
+        if (rb->resolution_changed(dp.xres(), dp.yres()))
+            rb->set_resolution(dp.xres(), dp.yres());
+
+        int b = rb->find_aov(dp.aov_name());
+        if (b < 0)
+        {
+            rb->add_aov(dp.aov_name(), dp.spp(), dp.format());
+            b = static_cast<int>(rb->size() - 1);
+        }
+        else if (rb->get_aov_format(b) != dp.format())
+            rb->set_aov_format(b, dp.format());
+
+        rb->write_bucket(b, dp.bucket_xo(), dp.bucket_yo(),
+                         dp.bucket_size_x(), dp.bucket_size_y(),
+                         dp.spp(), &dp.pixel(),
+                         dp.steps(), dp.offset(), dp.scale());
+        mLatency[2].record(get_clock() - decoded);
+
+        mBuckets++;
+        mBytes += sizeof(float) * dp.bucket_size_x() * dp.bucket_size_y() * dp.spp();
+    }
+
+    // Pixels in memory, over every image
+    long long resident_bytes()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        long long bytes = 0;
+        std::map<long long, std::unique_ptr<Image> >::iterator it;
+        for (it = mImages.begin(); it != mImages.end(); ++it)
+        {
+            std::lock_guard<std::mutex> image_lock(it->second->mutex);
+
+            const FrameBuffer::RenderBuffers& rbs = it->second->fb.get_renderbuffers();
+            for (size_t i = 0; i < rbs.size(); ++i)
+                bytes += rbs[i]->resident_bytes();
+        }
+        return bytes;
+    }
+
+    size_t images()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mImages.size();
+    }
+
+    std::atomic<long long> mBuckets, mBytes, mHeaders;
+    
+    // Rendered until received, received until decoded, decoded until written
+    LatencyHistogram mLatency[3];
+
+private:
+    Image* get_image(DataHeader& dh)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        std::unique_ptr<Image>& image = mImages[dh.session()];
+        if (image == NULL)
+        {
+            image.reset(new Image());
+            image->fb.add_renderbuffer(&dh);
+        }
+        return image.get();
+    }
+
+    std::mutex mMutex;
+    std::map<long long, std::unique_ptr<Image> > mImages;
+};
+
+int main(int argc, char* argv[])
+{
+    const std::string endpoint = argc > 1 ? argv[1] : std::to_string(get_port());
+    const int threads = argc > 2 ? atoi(argv[2]) : 4;
+    const int seconds = argc > 3 ? atoi(argv[3]) : 0;
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    Receiver receiver;
+    Server server;
+
+    try
+    {
+        server.connect(endpoint, true);
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "aton_recv: could not listen on %s: %s\n", endpoint.c_str(), e.what());
+        return 1;
+    }
+    server.start(&receiver, threads);
+
+    if (server.get_path().empty())
+        printf("Listening on port %d with %d threads\n", server.get_port(), threads);
+    else
+        printf("Listening on %s with %d threads\n", server.get_path().c_str(), threads);
+    fflush(stdout);
+
+    // Once a second, until stopped or the time is up
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    long long buckets = 0, bytes = 0, wire = 0;
+    for (int elapsed = 1; running && (seconds <= 0 || elapsed <= seconds); ++elapsed)
+    {
+        std::this_thread::sleep_until(start + std::chrono::seconds(elapsed));
+
+        const long long now_buckets = receiver.mBuckets;
+        const long long now_bytes = receiver.mBytes;
+        const IngestStats ingest = server.ingest();
+
+        printf("%ds: %zu clients, %zu images, %lld headers, %lld buckets/s, %.1f MB/s "
+               "(%.1f MB/s wire, %lld KB queued), %.1f MB resident\n",
+               elapsed, server.sessions(), receiver.images(),
+               static_cast<long long>(receiver.mHeaders), now_buckets - buckets,
+               (now_bytes - bytes) / 1048576.0, (ingest.bytes - wire) / 1048576.0,
+               ingest.queued >> 10, (receiver.resident_bytes() + ingest.references) / 1048576.0);
+        fflush(stdout);
+
+        buckets = now_buckets;
+        bytes = now_bytes;
+        wire = ingest.bytes;
+    }
+
+    server.quit();
+
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Received %lld buckets, %.1f MB in %.1f s, %.1f MB/s\n",
+           static_cast<long long>(receiver.mBuckets), receiver.mBytes / 1048576.0,
+           secs, receiver.mBytes / 1048576.0 / secs);
+    
+    const IngestStats ingest = server.ingest();
+    printf("Wire %.1f MB for %.1f MB of pixels, %.1f ms decoding\n",
+           ingest.bytes / 1048576.0, ingest.pixel_bytes / 1048576.0, ingest.decode_ns / 1e6);
+    
+    const char* stages[3] = {"receive", "decode", "blit"};
+    for (int i = 0; i < 3; ++i)
+        if (receiver.mLatency[i].count() > 0)
+            printf("%-8s latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", stages[i],
+                   receiver.mLatency[i].percentile(0.5) / 1e6,
+                   receiver.mLatency[i].percentile(0.99) / 1e6,
+                   receiver.mLatency[i].max() / 1e6);
+    return 0;
+}
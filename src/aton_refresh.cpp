@@ -0,0 +1,65 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_refresh.h"
+
+#include <algorithm>
+
+RefreshRegion::RefreshRegion(): _pending(false), _merged(0)
+{
+    _box[0] = _box[1] = _box[2] = _box[3] = 0;
+}
+
+void RefreshRegion::add(const int& x, const int& y, const int& r, const int& t)
+{
+    if (!_pending)
+    {
+        _box[0] = x;
+        _box[1] = y;
+        _box[2] = r;
+        _box[3] = t;
+        _pending = true;
+    }
+    else
+    {
+        _box[0] = std::min(_box[0], x);
+        _box[1] = std::min(_box[1], y);
+        _box[2] = std::max(_box[2], r);
+        _box[3] = std::max(_box[3], t);
+    }
+    ++_merged;
+}
+
+bool RefreshRegion::take(int box[4], const int& rate)
+{
+    if (!_pending)
+        return false;
+    
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < due(rate))
+        return false;
+    
+    _last = now;
+    return flush(box);
+}
+
+std::chrono::steady_clock::time_point RefreshRegion::due(const int& rate) const
+{
+    if (rate < 1)
+        return _last;
+    return _last + std::chrono::microseconds(1000000 / rate);
+}
+
+bool RefreshRegion::flush(int box[4])
+{
+    if (!_pending)
+        return false;
+    
+    std::copy(_box, _box + 4, box);
+    _pending = false;
+    _merged = 0;
+    return true;
+}
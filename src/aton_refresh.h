@@ -0,0 +1,47 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_REFRESH_H_
+#define ATON_REFRESH_H_
+
+#include <chrono>
+
+// Area of the image changed since the viewer was last refreshed
+// Bucket boxes get merged into one, which is handed out at most
+// once per interval. Not thread safe, callers hold their own lock.
+class RefreshRegion
+{
+public:
+    RefreshRegion();
+    
+    // Merges a box given as x, y, right and top
+    void add(const int& x, const int& y, const int& r, const int& t);
+    
+    // Takes the merged box if the last one was taken more than a
+    // 1/rate second ago, any rate below 1 takes it every time.
+    // Returns false if there's nothing to refresh or it's too early.
+    bool take(int box[4], const int& rate);
+    
+    // Takes the merged box right away, false if there's nothing to refresh
+    bool flush(int box[4]);
+    
+    // Whether boxes are waiting to be taken
+    bool pending() const { return _pending; }
+    
+    // When take() will hand the merged box out at the given rate
+    std::chrono::steady_clock::time_point due(const int& rate) const;
+    
+    // Number of boxes merged since the viewer was last refreshed
+    const int& merged() const { return _merged; }
+    
+private:
+    bool _pending;
+    int _merged;
+    int _box[4];
+    std::chrono::steady_clock::time_point _last;
+};
+
+#endif // ATON_REFRESH_H_
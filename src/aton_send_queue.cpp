@@ -0,0 +1,242 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_send_queue.h"
+
+#include <chrono>
+#include <algorithm>
+
+// SendBucket class
+void SendBucket::add_aov(const char* aov_name,
+                         const int& spp,
+                         const float* data,
+                         const int& format)
+{
+    if (mCount == mPixels.size())
+    {
+        mSpp.push_back(0);
+        mFormats.push_back(format_float);
+        mNames.push_back(std::string());
+        mPixels.push_back(std::vector<float>());
+    }
+    
+    const size_t num_samples = bucket_size_x * bucket_size_y * spp;
+    
+    // Reuses the capacity of previous buckets
+    mSpp[mCount] = spp;
+    mFormats[mCount] = format;
+    mNames[mCount] = aov_name;
+    mPixels[mCount].assign(data, data + num_samples);
+    ++mCount;
+}
+
+bool SendBucket::same_tile(const SendBucket& other) const
+{
+    return (session == other.session &&
+            bucket_xo == other.bucket_xo &&
+            bucket_yo == other.bucket_yo &&
+            bucket_size_x == other.bucket_size_x &&
+            bucket_size_y == other.bucket_size_y);
+}
+
+bool SendBucket::replaces(const SendBucket& older) const
+{
+    if (!same_tile(older) || mCount != older.mCount)
+        return false;
+    
+    for (size_t i = 0; i < mCount; ++i)
+        if (mSpp[i] != older.mSpp[i] || mNames[i] != older.mNames[i])
+            return false;
+    return true;
+}
+
+// SendQueue class
+SendQueue::SendQueue(Client* client,
+                     const size_t& capacity,
+                     const int& policy): mClient(client),
+                                         mCapacity(capacity > 0 ? capacity : 1),
+                                         mPolicy(policy),
+                                         mStop(false),
+                                         mSending(false)
+{
+    mStats = SendStats();
+    mThread = std::thread(&SendQueue::run, this);
+}
+
+SendQueue::~SendQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mNotEmpty.notify_all();
+    mNotFull.notify_all();
+    mThread.join();
+    
+    std::vector<SendBucket*>::iterator it;
+    for (it = mPool.begin(); it != mPool.end(); ++it)
+        delete *it;
+}
+
+SendBucket* SendQueue::acquire()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    
+    if (mPool.empty())
+        return new SendBucket();
+    
+    SendBucket* bucket = mPool.back();
+    mPool.pop_back();
+    return bucket;
+}
+
+void SendQueue::push(SendBucket* bucket)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    
+    if (mQueue.size() >= mCapacity)
+    {
+        if (mPolicy == drop_oldest)
+        {
+            // Only buckets whose pixels get sent again anyway, a dropped
+            // bucket of the final pass would leave a hole in the image
+            std::deque<SendBucket*>::iterator it;
+            for (it = mQueue.begin(); it != mQueue.end(); ++it)
+            {
+                if ((*it)->preview || bucket->replaces(**it) ||
+                    std::find_if(it + 1, mQueue.end(), [it](const SendBucket* newer)
+                                 { return newer->replaces(**it); }) != mQueue.end())
+                {
+                    recycle(*it);
+                    mQueue.erase(it);
+                    mStats.dropped++;
+                    break;
+                }
+            }
+        }
+        else if (mPolicy == coalesce)
+        {
+            std::deque<SendBucket*>::iterator it;
+            for (it = mQueue.begin(); it != mQueue.end(); ++it)
+            {
+                if (bucket->replaces(**it))
+                {
+                    recycle(*it);
+                    *it = bucket;
+                    mStats.coalesced++;
+                    return;
+                }
+            }
+        }
+        
+        // Wait for the sender thread to make room
+        if (mQueue.size() >= mCapacity)
+        {
+            using namespace std::chrono;
+            const steady_clock::time_point start = steady_clock::now();
+            mNotFull.wait(lock, [this] { return mQueue.size() < mCapacity || mStop; });
+            mStats.blocked_ms += duration<double, std::milli>(steady_clock::now() - start).count();
+            mStats.blocked++;
+        }
+    }
+    
+    mQueue.push_back(bucket);
+    mNotEmpty.notify_one();
+}
+
+void SendQueue::flush()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mIdle.wait(lock, [this] { return mQueue.empty() && !mSending; });
+}
+
+SendStats SendQueue::stats()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+std::string SendQueue::last_error()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mError;
+}
+
+// Sender thread
+void SendQueue::run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    
+    while (true)
+    {
+        mNotEmpty.wait(lock, [this] { return !mQueue.empty() || mStop; });
+        
+        // Stop only once everything queued went out
+        if (mQueue.empty())
+            break;
+        
+        SendBucket* bucket = mQueue.front();
+        mQueue.pop_front();
+        mSending = true;
+        mNotFull.notify_one();
+        
+        lock.unlock();
+        send(bucket);
+        lock.lock();
+        
+        recycle(bucket);
+        mSending = false;
+        mIdle.notify_all();
+    }
+}
+
+void SendQueue::send(SendBucket* bucket)
+{
+    try
+    {
+        if (bucket->reconnect)
+            mClient->connect();
+        
+        for (size_t i = 0; i < bucket->mCount; ++i)
+        {
+            DataPixels dp(bucket->session,
+                          bucket->xres,
+                          bucket->yres,
+                          bucket->bucket_xo,
+                          bucket->bucket_yo,
+                          bucket->bucket_size_x,
+                          bucket->bucket_size_y,
+                          bucket->mSpp[i],
+                          bucket->ram,
+                          bucket->time,
+                          bucket->mNames[i].c_str(),
+                          &bucket->mPixels[i][0],
+                          bucket->mFormats[i]);
+            
+            dp.set_stamp(bucket->stamp);
+            mClient->send_pixels(dp);
+        }
+        
+        if (bucket->disconnect)
+            mClient->disconnect();
+        
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStats.sent++;
+    }
+    catch (const std::exception& e)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStats.errors++;
+        mError = e.what();
+    }
+}
+
+// Returns a bucket to the pool, expects the lock to be held
+void SendQueue::recycle(SendBucket* bucket)
+{
+    bucket->mCount = 0;
+    mPool.push_back(bucket);
+}
@@ -0,0 +1,141 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_SEND_QUEUE_H_
+#define ATON_SEND_QUEUE_H_
+
+#include "aton_client.h"
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+// All AOVs of a single bucket, copied out of the renderer
+class SendBucket
+{
+    friend class SendQueue;
+    
+public:
+    SendBucket(): session(0), xres(0), yres(0),
+                  bucket_xo(0), bucket_yo(0),
+                  bucket_size_x(0), bucket_size_y(0),
+                  ram(0), time(0), stamp(0), preview(false),
+                  reconnect(false), disconnect(false),
+                  mCount(0) {}
+    
+    // Copies one AOV into the bucket, reusing pooled storage
+    void add_aov(const char* aov_name,
+                 const int& spp,
+                 const float* data,
+                 const int& format = format_float);
+    
+    // Number of AOVs in the bucket
+    size_t size() const { return mCount; }
+    
+    // Check if both buckets cover the same tile
+    bool same_tile(const SendBucket& other) const;
+    
+    // Check if this bucket has new pixels for everything the older one
+    // holds, the same tile and the same aovs
+    bool replaces(const SendBucket& older) const;
+    
+    long long session;
+    int xres, yres;
+    int bucket_xo, bucket_yo;
+    int bucket_size_x, bucket_size_y;
+    long long ram;
+    unsigned int time;
+    
+    // get_clock() time the renderer finished it
+    long long stamp;
+    
+    // Of a progressive pass a later one renders over
+    bool preview;
+    
+    // Connect before and disconnect after sending
+    bool reconnect, disconnect;
+    
+private:
+    size_t mCount;
+    std::vector<int> mSpp;
+    std::vector<int> mFormats;
+    std::vector<std::string> mNames;
+    std::vector<std::vector<float> > mPixels;
+};
+
+// Counters of the SendQueue
+struct SendStats
+{
+    long long sent;         // Buckets sent to the server
+    long long dropped;      // Buckets dropped while the queue was full
+    long long coalesced;    // Buckets replaced by a newer one of the same tile
+    long long blocked;      // Pushes which had to wait for a free slot
+    long long errors;       // Buckets which failed to send
+    double blocked_ms;      // Time the render threads spent waiting
+};
+
+// Bounded producer/consumer queue feeding a Client from its own thread
+// The render threads fill pooled buckets with acquire() and hand them
+// over with push(), which returns immediately unless the queue is full.
+class SendQueue
+{
+public:
+    // What push() does when the queue is full
+    enum policy
+    {
+        block = 0,      // Wait for the sender thread
+        drop_oldest,    // Drop the oldest preview or replaced bucket, else wait
+        coalesce        // Replace a queued bucket of the same tile, else wait
+    };
+    
+    SendQueue(Client* client,
+              const size_t& capacity = 64,
+              const int& policy = block);
+    
+    // Sends the remaining buckets and stops the sender thread
+    ~SendQueue();
+    
+    // Get an empty bucket from the pool
+    SendBucket* acquire();
+    
+    // Queue a bucket obtained from acquire()
+    void push(SendBucket* bucket);
+    
+    // Blocks until every queued bucket has been sent
+    void flush();
+    
+    // Snapshot of the counters
+    SendStats stats();
+    
+    // Last send error, empty if none
+    std::string last_error();
+    
+    // Settings the queue was built with
+    const size_t& capacity() const { return mCapacity; }
+    const int& policy() const { return mPolicy; }
+    
+private:
+    void run();
+    void send(SendBucket* bucket);
+    void recycle(SendBucket* bucket);
+    
+    Client* mClient;
+    size_t mCapacity;
+    int mPolicy;
+    bool mStop, mSending;
+    SendStats mStats;
+    std::string mError;
+    std::deque<SendBucket*> mQueue;
+    std::vector<SendBucket*> mPool;
+    std::mutex mMutex;
+    std::condition_variable mNotEmpty, mNotFull, mIdle;
+    std::thread mThread;
+};
+
+#endif // ATON_SEND_QUEUE_H_
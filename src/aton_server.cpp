@@ -6,18 +6,663 @@ All rights reserved. See COPYING.txt for more details.
 
 #include "aton_server.h"
 #include "aton_client.h"
+#include <cstring>
+#include <limits>
+#include <boost/array.hpp>
 #include <boost/lexical_cast.hpp>
 
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+#include <unistd.h>
+#endif
+
 using namespace boost::asio;
 
+void IngestStats::add(const IngestStats& other)
+{
+    buckets += other.buckets;
+    bytes += other.bytes;
+    pixel_bytes += other.pixel_bytes;
+    decode_ns += other.decode_ns;
+    queued += other.queued;
+    references += other.references;
+}
+
+// Only the Session's handlers write its counters, one at a time
+static inline void count(std::atomic<long long>& counter, const long long& n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Longest names and biggest images a message may describe,
+// anything beyond them is garbage or hostile
+static const size_t max_name_size = 4096;
+static const int max_resolution = 1 << 16;
+static const int max_spp = 4;
+
+// Samples of the bucket a pixels frame describes, 0 if it can't be right.
+// Every factor is bounded, so the product can't overflow.
+static size_t frame_samples(const PixelsFrame& frame)
+{
+    if (frame.aov_size == 0 || frame.aov_size > max_name_size ||
+        frame.xres <= 0 || frame.xres > max_resolution ||
+        frame.yres <= 0 || frame.yres > max_resolution ||
+        frame.bucket_size_x <= 0 || frame.bucket_size_x > frame.xres ||
+        frame.bucket_size_y <= 0 || frame.bucket_size_y > frame.yres ||
+        frame.spp <= 0 || frame.spp > max_spp)
+        return 0;
+    
+    const unsigned long long samples = static_cast<unsigned long long>(frame.bucket_size_x) *
+                                       frame.bucket_size_y * frame.spp;
+    if (samples > std::numeric_limits<size_t>::max() / sizeof(float))
+        return 0;
+    return static_cast<size_t>(samples);
+}
+
+// Sizes a message buffer, false if there's no memory for it
+template <typename T>
+static bool resize_storage(std::vector<T>& storage, const size_t& size)
+{
+    try
+    {
+        storage.resize(size);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+    return true;
+}
+
+// Session class
+Session::Session(Server* server, const int& id): mServer(server),
+                                                 mId(id),
+                                                 mType(0),
+                                                 mVersion(protocol_current),
+                                                 mData(NULL),
+                                                 mStamp(0),
+                                                 mReceived(0),
+                                                 mClock(0),
+                                                 mInSession(0),
+                                                 mInBuckets(0),
+                                                 mInBytes(0),
+                                                 mInPixelBytes(0),
+                                                 mInDecodeNs(0),
+                                                 mInQueued(0),
+                                                 mInReferences(0),
+                                                 mDecodeStart(0),
+                                                 mAovIndex(0),
+                                                 mDeltaBudget(0),
+                                                 mSocket(server->mIoService)
+{
+}
+
+void Session::read_type()
+{
+    std::shared_ptr<Session> self(shared_from_this());
+    async_read(mSocket, buffer(reinterpret_cast<char*>(&mType), sizeof(int)),
+               [this, self](const boost::system::error_code& ec, size_t)
+    {
+        if (ec)
+            return close();
+        
+        mReceived = get_clock();
+        
+        switch (mType)
+        {
+            case 0: // Open a new image
+                mStamp = 0;
+                read_header();
+                break;
+            case 1: // Legacy pixels
+                read_pixels(false);
+                break;
+            case 4: // Framed pixels
+                read_pixels(true);
+                break;
+            case 5: // Shared memory ring
+                read_ring();
+                break;
+            case 6: // Pixels in the shared memory ring
+                read_ring_pixels();
+                break;
+            case 7: // Compressed pixels
+                read_encoded();
+                break;
+            case 8: // Half or quantized pixels
+                read_reduced(false);
+                break;
+            case 9: // Deltas to the previous pass
+                read_reduced(true);
+                break;
+            case 10: // Render stamp of the next bucket
+            {
+                async_read(mSocket, buffer(reinterpret_cast<char*>(&mStamp), sizeof(long long)),
+                           [this, self](const boost::system::error_code& ec, size_t)
+                {
+                    if (ec)
+                        return close();
+                    read_type();
+                });
+                break;
+            }
+            case 11: // Clock synchronisation
+            {
+                mClock = get_clock();
+                async_write(mSocket, buffer(reinterpret_cast<char*>(&mClock), sizeof(long long)),
+                            [this, self](const boost::system::error_code& ec, size_t)
+                {
+                    if (ec)
+                        return close();
+                    read_type();
+                });
+                break;
+            }
+            case 12: // Delta budget, part of the handshake
+            {
+                mDeltaBudget = mServer->mDeltaSize;
+                async_write(mSocket, buffer(reinterpret_cast<char*>(&mDeltaBudget),
+                                            sizeof(unsigned long long)),
+                            [this, self](const boost::system::error_code& ec, size_t)
+                {
+                    if (ec)
+                        return close();
+                    read_type();
+                });
+                break;
+            }
+            case 3: // Protocol handshake
+            {
+                async_write(mSocket, buffer(reinterpret_cast<char*>(&mVersion), sizeof(int)),
+                            [this, self](const boost::system::error_code& ec, size_t)
+                {
+                    if (ec)
+                        return close();
+                    read_type();
+                });
+                break;
+            }
+            default: // Close image, quit or garbage
+                close();
+        }
+    });
+}
+
+void Session::read_header()
+{
+    std::shared_ptr<Session> self(shared_from_this());
+    async_read(mSocket, buffer(reinterpret_cast<char*>(&mHeaderFrame), sizeof(HeaderFrame)),
+               [this, self](const boost::system::error_code& ec, size_t)
+    {
+        if (ec || mHeaderFrame.output_size == 0 || mHeaderFrame.output_size > max_name_size)
+            return close();
+        
+        mName.resize(mHeaderFrame.output_size);
+        async_read(mSocket, buffer(mName),
+                   [this, self](const boost::system::error_code& ec, size_t)
+        {
+            if (ec || mName.empty())
+                return close();
+            
+            const HeaderFrame& frame = mHeaderFrame;
+            mName.back() = '\0';
+            mHeader.mSession = frame.session;
+            mHeader.mXres = frame.xres;
+            mHeader.mYres = frame.yres;
+            mHeader.mPixAspectRatio = frame.pix_aspect;
+            mHeader.mRArea = frame.region_area;
+            mHeader.mVersion = frame.version;
+            mHeader.mFrame = frame.frame;
+            mHeader.mCamFov = frame.cam_fov;
+            mHeader.mCamMatrixStore.assign(frame.cam_matrix, frame.cam_matrix + 16);
+            mHeader.mSamplesStore.assign(frame.samples, frame.samples + 6);
+            mHeader.mOutputName = &mName[0];
+            
+            try
+            {
+                mServer->mHandler->header_received(*this, mHeader);
+            }
+            catch (...)
+            {
+                return close();
+            }
+            read_type();
+        });
+    });
+}
+
+void Session::read_pixels(const bool& framed)
+{
+    std::shared_ptr<Session> self(shared_from_this());
+    
+    if (framed)
+    {
+        async_read(mSocket, buffer(reinterpret_cast<char*>(&mPixelsFrame), sizeof(PixelsFrame)),
+                   [this, self](const boost::system::error_code& ec, size_t)
+        {
+            if (ec)
+                return close();
+            read_payload();
+        });
+        return;
+    }
+    
+    async_read(mSocket, buffer(reinterpret_cast<char*>(&mLegacyFrame), sizeof(LegacyPixelsFrame)),
+               [this, self](const boost::system::error_code& ec, size_t)
+    {
+        if (ec || mLegacyFrame.aov_size > max_name_size)
+            return close();
+        
+        const LegacyPixelsFrame& legacy = mLegacyFrame;
+        PixelsFrame frame = { legacy.session,
+                              legacy.xres,
+                              legacy.yres,
+                              legacy.bucket_xo,
+                              legacy.bucket_yo,
+                              legacy.bucket_size_x,
+                              legacy.bucket_size_y,
+                              legacy.spp,
+                              legacy.ram,
+                              legacy.time,
+                              static_cast<unsigned int>(legacy.aov_size) };
+        mPixelsFrame = frame;
+        read_payload();
+    });
+}
+
+void Session::read_payload()
+{
+    const PixelsFrame& frame = mPixelsFrame;
+    const size_t num_samples = frame_samples(frame);
+    
+    if (num_samples == 0)
+        return close();
+    
+    // Aov name and pixels with a single read
+    mName.resize(frame.aov_size);
+    if (!resize_storage(mPixels.mPixelStore, num_samples))
+        return close();
+    
+    boost::array<mutable_buffer, 2> payload = {{
+        buffer(mName),
+        buffer(reinterpret_cast<char*>(&mPixels.mPixelStore[0]), sizeof(float)*num_samples) }};
+    
+    std::shared_ptr<Session> self(shared_from_this());
+    async_read(mSocket, payload,
+               [this, self](const boost::system::error_code& ec, size_t)
+    {
+        if (ec)
+            return close();
+        
+        mDecodeStart = get_clock();
+        const size_t frame_size = mType == 4 ? sizeof(PixelsFrame) : sizeof(LegacyPixelsFrame);
+        
+        mName.back() = '\0';
+        if (!dispatch_pixels(&mName[0], &mPixels.mPixelStore[0],
+                             sizeof(int) + frame_size + mName.size() +
+                             sizeof(float) * mPixels.mPixelStore.size()))
+            return close();
+        read_type();
+    });
+}
+
+void Session::read_encoded()
+{
+    std::shared_ptr<Session> self(shared_from_this());
+    async_read(mSocket, buffer(reinterpret_cast<char*>(&mCodecFrame), sizeof(CodecPixelsFrame)),
+               [this, self](const boost::system::error_code& ec, size_t)
+    {
+        if (ec)
+            return close();
+        
+        mPixelsFrame = mCodecFrame.pixels;
+        const PixelsFrame& frame = mPixelsFrame;
+        const size_t num_samples = frame_samples(frame);
+        
+        if (num_samples == 0 || mCodecFrame.codec != codec_shuffle_lz ||
+            mCodecFrame.size > encode_bound(num_samples))
+            return close();
+        
+        mName.resize(frame.aov_size);
+        if (!resize_storage(mEncoded, mCodecFrame.size) ||
+            !resize_storage(mPixels.mPixelStore, num_samples))
+            return close();
+        
+        boost::array<mutable_buffer, 2> payload = {{ buffer(mName), buffer(mEncoded) }};
+        
+        async_read(mSocket, payload,
+                   [this, self](const boost::system::error_code& ec, size_t)
+        {
+            if (ec)
+                return close();
+            
+            // Decoded on the Server's thread with the codec's pool helping,
+            // in parallel with other sessions
+            mDecodeStart = get_clock();
+            const PixelsFrame& frame = mPixelsFrame;
+            
+            if (!decode_pixels(mEncoded.data(), mEncoded.size(),
+                               frame.bucket_size_x * frame.bucket_size_y,
+                               frame.spp, &mPixels.mPixelStore[0]))
+                return close();
+            
+            mName.back() = '\0';
+            if (!dispatch_pixels(&mName[0], &mPixels.mPixelStore[0],
+                                 sizeof(int) + sizeof(CodecPixelsFrame) +
+                                 mName.size() + mEncoded.size()))
+                return close();
+            read_type();
+        });
+    });
+}
+
+void Session::read_reduced(const bool& delta)
+{
+    // Reduced frames are the start of delta frames
+    mDeltaFrame.delta = delta_none;
+    const size_t frame_size = delta ? sizeof(DeltaPixelsFrame) : sizeof(ReducedPixelsFrame);
+    
+    std::shared_ptr<Session> self(shared_from_this());
+    async_read(mSocket, buffer(reinterpret_cast<char*>(&mDeltaFrame), frame_size),
+               [this, self](const boost::system::error_code& ec, size_t)
+    {
+        if (ec)
+            return close();
+        
+        const ReducedPixelsFrame& reduced = mDeltaFrame.reduced;
+        mPixelsFrame = reduced.pixels;
+        const PixelsFrame& frame = mPixelsFrame;
+        const size_t num_samples = frame_samples(frame);
+        const int format = reduced.format;
+        const size_t bytes = format_bytes(format);
+        
+        if (num_samples == 0 || bytes == 0 ||
+            mDeltaFrame.delta > delta_xor ||
+            (reduced.codec != codec_none && reduced.codec != codec_shuffle_lz) ||
+            (reduced.codec == codec_none && reduced.size != num_samples * bytes) ||
+            reduced.size > encode_bound(num_samples, static_cast<int>(bytes)))
+            return close();
+        
+        mName.resize(frame.aov_size);
+        if (!resize_storage(mEncoded, reduced.size) ||
+            !resize_storage(mReduced, num_samples * bytes) ||
+            !resize_storage(mPixels.mPixelStore, num_samples))
+            return close();
+        
+        boost::array<mutable_buffer, 2> payload = {{ buffer(mName), buffer(mEncoded) }};
+        
+        async_read(mSocket, payload,
+                   [this, self](const boost::system::error_code& ec, size_t)
+        {
+            if (ec)
+                return close();
+            
+            mDecodeStart = get_clock();
+            
+            // Packed fields, copied out before passing them by reference
+            const ReducedPixelsFrame& reduced = mDeltaFrame.reduced;
+            const int format = reduced.format;
+            const float offset = reduced.offset;
+            const float scale = reduced.scale;
+            
+            const PixelsFrame& frame = mPixelsFrame;
+            const int count = frame.bucket_size_x * frame.bucket_size_y;
+            const size_t num_samples = static_cast<size_t>(count) * frame.spp;
+            const int bytes = static_cast<int>(format_bytes(format));
+            const size_t size = num_samples * bytes;
+            
+            // Undo the codec, then the delta, then widen to floats for the
+            // handler, which gets the quantized steps too to store them as
+            // they are
+            char* samples = &mEncoded[0];
+            if (reduced.codec == codec_shuffle_lz)
+            {
+                if (!decode_pixels(mEncoded.data(), mEncoded.size(), count,
+                                   frame.spp, &mReduced[0], bytes))
+                    return close();
+                samples = &mReduced[0];
+            }
+            
+            if (mDeltaFrame.delta != delta_none)
+            {
+                mName.back() = '\0';
+                const int tile[6] = { frame.bucket_xo,
+                                      frame.bucket_yo,
+                                      frame.bucket_size_x,
+                                      frame.bucket_size_y,
+                                      frame.spp,
+                                      format };
+                mDeltaKey.assign(&mName[0]);
+                mDeltaKey.append(reinterpret_cast<const char*>(tile), sizeof(tile));
+                
+                if (mDeltaFrame.delta == delta_key)
+                {
+                    // Keyed tiles replace the former reference of the tile,
+                    // past the budget the tile is taken without one
+                    std::vector<char>& reference = mDeltaTiles[mDeltaKey];
+                    const long long kept = mInReferences.load(std::memory_order_relaxed) -
+                                           reference.size();
+                    const long long references = kept + size;
+                    if (references > static_cast<long long>(mServer->mDeltaSize) ||
+                        !resize_storage(reference, size))
+                    {
+                        mDeltaTiles.erase(mDeltaKey);
+                        mInReferences.store(kept, std::memory_order_relaxed);
+                    }
+                    else
+                    {
+                        memcpy(&reference[0], samples, size);
+                        mInReferences.store(references, std::memory_order_relaxed);
+                    }
+                }
+                else
+                {
+                    // Deltas to a tile never keyed mean the streams diverged
+                    std::unordered_map<std::string, std::vector<char> >::iterator it;
+                    it = mDeltaTiles.find(mDeltaKey);
+                    if (it == mDeltaTiles.end() || it->second.size() != size)
+                        return close();
+                    delta_decode(samples, &it->second[0], size);
+                }
+            }
+            
+            unpack_samples(samples, num_samples, format, offset, scale,
+                           &mPixels.mPixelStore[0]);
+            
+            const size_t frame_size = mType == 9 ? sizeof(DeltaPixelsFrame)
+                                                 : sizeof(ReducedPixelsFrame);
+            
+            mName.back() = '\0';
+            if (!dispatch_pixels(&mName[0], &mPixels.mPixelStore[0],
+                                 sizeof(int) + frame_size + mName.size() + mEncoded.size(),
+                                 format, format_quantized(format) ? samples : NULL,
+                                 offset, scale))
+                return close();
+            read_type();
+        });
+    });
+}
+
+void Session::read_ring()
+{
+    std::shared_ptr<Session> self(shared_from_this());
+    async_read(mSocket, buffer(reinterpret_cast<char*>(&mRingName), sizeof(unsigned int)),
+               [this, self](const boost::system::error_code& ec, size_t)
+    {
+        if (ec || mRingName == 0 || mRingName > 255)
+            return close();
+        
+        mName.resize(mRingName);
+        async_read(mSocket, buffer(mName),
+                   [this, self](const boost::system::error_code& ec, size_t)
+        {
+            if (ec)
+                return close();
+            
+            // Tell the Client whether it can use the ring
+            mType = mRing.open(std::string(mName.begin(), mName.end()));
+            async_write(mSocket, buffer(reinterpret_cast<char*>(&mType), sizeof(int)),
+                        [this, self](const boost::system::error_code& ec, size_t)
+            {
+                if (ec)
+                    return close();
+                read_type();
+            });
+        });
+    });
+}
+
+void Session::read_ring_pixels()
+{
+    std::shared_ptr<Session> self(shared_from_this());
+    async_read(mSocket, buffer(reinterpret_cast<char*>(&mShmFrame), sizeof(ShmPixelsFrame)),
+               [this, self](const boost::system::error_code& ec, size_t)
+    {
+        if (ec)
+            return close();
+        
+        mDecodeStart = get_clock();
+        
+        // Packed fields, copied out before passing them by reference
+        const unsigned long long position = mShmFrame.position;
+        const size_t size = mShmFrame.size;
+        
+        const char* record = mRing.record(position, size);
+        if (record == NULL || size < sizeof(PixelsFrame))
+            return close();
+        
+        memcpy(&mPixelsFrame, record, sizeof(PixelsFrame));
+        
+        // The record must hold what the frame says
+        const PixelsFrame& frame = mPixelsFrame;
+        const size_t num_samples = frame_samples(frame);
+        const size_t offset = shm_pixels_offset(frame.aov_size);
+        
+        if (num_samples == 0 || offset > size ||
+            sizeof(float) * num_samples > size - offset ||
+            record[sizeof(PixelsFrame) + frame.aov_size - 1] != '\0')
+            return close();
+        
+        // Straight from the ring, then give its space back
+        if (!dispatch_pixels(record + sizeof(PixelsFrame),
+                             reinterpret_cast<const float*>(record + offset),
+                             sizeof(int) + sizeof(ShmPixelsFrame) + size))
+            return close();
+        
+        mRing.release(position, size);
+        read_type();
+    });
+}
+
+bool Session::dispatch_pixels(const char* name,
+                              const float* data,
+                              const size_t& bytes,
+                              const int& format,
+                              const void* steps,
+                              const float& offset,
+                              const float& scale)
+{
+    const PixelsFrame& frame = mPixelsFrame;
+    const long long buckets = mInBuckets.load(std::memory_order_relaxed) + 1;
+    
+    mInSession.store(frame.session, std::memory_order_relaxed);
+    mInBuckets.store(buckets, std::memory_order_relaxed);
+    count(mInBytes, bytes);
+    count(mInPixelBytes, sizeof(float) * frame.bucket_size_x * frame.bucket_size_y * frame.spp);
+    count(mInDecodeNs, get_clock() - mDecodeStart);
+    
+    // What the Client has sent ahead, now and then
+    if (buckets % 16 == 1)
+    {
+        boost::system::error_code ec;
+        mInQueued.store(mSocket.available(ec), std::memory_order_relaxed);
+    }
+    
+    mPixels.mSession = frame.session;
+    mPixels.mXres = frame.xres;
+    mPixels.mYres = frame.yres;
+    mPixels.mBucket_xo = frame.bucket_xo;
+    mPixels.mBucket_yo = frame.bucket_yo;
+    mPixels.mBucket_size_x = frame.bucket_size_x;
+    mPixels.mBucket_size_y = frame.bucket_size_y;
+    mPixels.mSpp = frame.spp;
+    mPixels.mRam = frame.ram;
+    mPixels.mTime = frame.time;
+    mPixels.mAovName = intern(name);
+    mPixels.mFormat = format;
+    mPixels.mStamp = mStamp;
+    mPixels.mReceived = mReceived;
+    mPixels.mpData = const_cast<float*>(data);
+    mPixels.mpSteps = steps;
+    mPixels.mOffset = offset;
+    mPixels.mScale = scale;
+    
+    try
+    {
+        mServer->mHandler->pixels_received(*this, mPixels);
+    }
+    catch (...)
+    {
+        return false;
+    }
+    return true;
+}
+
+const char* Session::intern(const char* name)
+{
+    // Drivers send the aovs of a bucket in the same order every time,
+    // so the search starts right after the last name found
+    const size_t count = mAovNames.size();
+    for (size_t i = 1; i <= count; ++i)
+    {
+        const size_t index = (mAovIndex + i) % count;
+        if (mAovNames[index] == name)
+        {
+            mAovIndex = index;
+            return mAovNames[index].c_str();
+        }
+    }
+    
+    // The deque never moves its strings
+    mAovNames.push_back(name);
+    mAovIndex = count;
+    return mAovNames.back().c_str();
+}
+
+IngestStats Session::ingest() const
+{
+    IngestStats stats = { mInSession.load(std::memory_order_relaxed),
+                          mInBuckets.load(std::memory_order_relaxed),
+                          mInBytes.load(std::memory_order_relaxed),
+                          mInPixelBytes.load(std::memory_order_relaxed),
+                          mInDecodeNs.load(std::memory_order_relaxed),
+                          mInQueued.load(std::memory_order_relaxed),
+                          mInReferences.load(std::memory_order_relaxed) };
+    return stats;
+}
+
+void Session::close()
+{
+    boost::system::error_code ec;
+    mSocket.close(ec);
+    mServer->remove(this);
+}
+
+
+// Server class
 Server::Server(): mPort(0),
-                  mSocket(mIoService),
+                  mSessionId(0),
+                  mDeltaSize(::get_delta_size()),
+                  mHandler(NULL),
+                  mClosed(),
                   mAcceptor(mIoService)
 {
 }
 
 Server::Server(int port): mPort(0),
-                          mSocket(mIoService),
+                          mSessionId(0),
+                          mDeltaSize(::get_delta_size()),
+                          mHandler(NULL),
+                          mClosed(),
                           mAcceptor(mIoService)
 {
     connect(port);
@@ -25,8 +670,7 @@ Server::Server(int port): mPort(0),
 
 Server::~Server()
 {
-    if (mAcceptor.is_open())
-        mAcceptor.close();
+    quit();
 }
 
 void Server::connect(int port, bool search)
@@ -34,6 +678,7 @@ void Server::connect(int port, bool search)
     // Disconnect if necessary
     if (mAcceptor.is_open())
         mAcceptor.close();
+    mPath.clear();
 
     // Reconnect at specified port
     int start_port = port;
@@ -42,7 +687,7 @@ void Server::connect(int port, bool search)
         try
         {
             using boost::asio::ip::tcp;
-            tcp::endpoint endpoint(ip::tcp::v4(), port);
+            generic::stream_protocol::endpoint endpoint(tcp::endpoint(ip::tcp::v4(), port));
             mAcceptor.open(endpoint.protocol());
             mAcceptor.set_option(ip::tcp::acceptor::reuse_address(false));
             mAcceptor.bind(endpoint);
@@ -72,107 +717,191 @@ void Server::connect(int port, bool search)
     }
 }
 
-void Server::quit()
+void Server::connect(const std::string& endpoint, bool search)
 {
-    std::string hostname("localhost");
-    Client client(hostname, mPort);
-    client.quit();
+    const std::string path = get_unix_path(endpoint);
+    if (path.empty())
+        return connect(atoi(endpoint.c_str()), search);
+    
+    // Disconnect if necessary
+    if (mAcceptor.is_open())
+        mAcceptor.close();
+    mPath.clear();
+    
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    try
+    {
+        local::stream_protocol::endpoint local_endpoint(path);
+        
+        // Take over the path if it's left from a dead server
+        local::stream_protocol::socket probe(mIoService);
+        boost::system::error_code ec;
+        probe.connect(local_endpoint, ec);
+        if (ec == error::connection_refused)
+            ::unlink(path.c_str());
+        
+        generic::stream_protocol::endpoint generic_endpoint(local_endpoint);
+        mAcceptor.open(generic_endpoint.protocol());
+        mAcceptor.bind(generic_endpoint);
+        mAcceptor.listen();
+        mPort = 0;
+        mPath = path;
+    }
+    catch (...)
+    {
+        mAcceptor.close();
+    }
+#endif
+    
+    // Handle failed connection
+    if (!mAcceptor.is_open())
+    {
+        std::string error = "Failed to connect to socket ";
+        error += path;
+        throw std::runtime_error( error.c_str() );
+    }
 }
 
-void Server::accept()
+void Server::start(ServerHandler* handler, const int& threads)
 {
-    if (mSocket.is_open())
-        mSocket.close();
-    mAcceptor.accept(mSocket);
+    mHandler = handler;
+    mIoService.reset();
+    accept();
+    
+    for (int i = 0; i < threads; ++i)
+        mThreads.push_back(std::thread([this]
+        {
+            // A handler that throws loses its Session, not the process.
+            // The io_service can run again after an exception.
+            while (true)
+            {
+                try
+                {
+                    mIoService.run();
+                    break;
+                }
+                catch (...)
+                {
+                }
+            }
+        }));
 }
 
-int Server::listen_type()
+void Server::quit()
 {
-    int type;
+    boost::system::error_code ec;
+    if (mAcceptor.is_open())
+        mAcceptor.close(ec);
     
-    try
+    // Free the socket path for the next server
+    if (!mPath.empty())
     {
-        read(mSocket, buffer(reinterpret_cast<char*>(&type), sizeof(int)));
-    
-        if (type == 2 || type == 9)
-        {
-            mSocket.close();
-            if (type == 9)
-                mAcceptor.close();
-        }
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+        ::unlink(mPath.c_str());
+#endif
+        mPath.clear();
     }
-    catch( ... )
+    
+    // Stop decoding
+    mIoService.stop();
+    
+    std::vector<std::thread>::iterator it;
+    for (it = mThreads.begin(); it != mThreads.end(); ++it)
+        it->join();
+    mThreads.clear();
+    
+    // Drop the remaining connections
+    std::set<std::shared_ptr<Session> > sessions;
     {
-        mSocket.close();
-        throw std::runtime_error("Could not read from socket!");
+        std::lock_guard<std::mutex> lock(mMutex);
+        sessions.swap(mSessions);
     }
     
-    return type;
+    std::set<std::shared_ptr<Session> >::iterator s_it;
+    for (s_it = sessions.begin(); s_it != sessions.end(); ++s_it)
+    {
+        (*s_it)->mSocket.close(ec);
+        if (mHandler != NULL)
+            mHandler->session_closed(**s_it);
+    }
 }
 
-DataHeader Server::listenHeader()
+size_t Server::sessions()
 {
-    DataHeader dh;
-    
-    // Read data from the buffer
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mSession), sizeof(long long)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mXres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mYres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mPixAspectRatio), sizeof(float)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mRArea), sizeof(long long)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mVersion), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mFrame), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mCamFov), sizeof(float)));
-    
-    const int camMatrixSize = 16;
-    dh.mCamMatrixStore.resize(camMatrixSize);
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mCamMatrixStore[0]), sizeof(float)*camMatrixSize));
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSessions.size();
+}
 
-    const int samplesSize = 6;
-    dh.mSamplesStore.resize(samplesSize);
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mSamplesStore[0]), sizeof(int)*samplesSize));
-    
-    // Get output size
-    size_t output_size;
-    read(mSocket, buffer(reinterpret_cast<char*>(&output_size), sizeof(size_t)));
+IngestStats Server::ingest()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
     
-    // Get output name
-    char* output_name = new char[output_size];
-    read(mSocket, buffer(output_name, output_size));
-    dh.mOutputName = output_name;
-
-    return dh;
+    IngestStats stats = mClosed;
+    std::set<std::shared_ptr<Session> >::iterator it;
+    for (it = mSessions.begin(); it != mSessions.end(); ++it)
+        stats.add((*it)->ingest());
+    return stats;
 }
 
-DataPixels Server::listenPixels()
+std::vector<IngestStats> Server::session_ingest()
 {
-    DataPixels dp;
-
-    // Read data from the buffer
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mSession), sizeof(long long)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mXres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mYres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_xo), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_yo), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_size_x), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_size_y), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mSpp), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mRam), sizeof(long long)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mTime), sizeof(int)));
-
-    // Get aov name's size
-    size_t aov_size;
-    read(mSocket, buffer(reinterpret_cast<char*>(&aov_size), sizeof(size_t)));
-
-    // Get aov name
-    char* aov_name = new char[aov_size];
-    read(mSocket, buffer(aov_name, aov_size));
-    dp.mAovName = aov_name;
+    std::lock_guard<std::mutex> lock(mMutex);
+    
+    std::vector<IngestStats> stats;
+    std::set<std::shared_ptr<Session> >::iterator it;
+    for (it = mSessions.begin(); it != mSessions.end(); ++it)
+        stats.push_back((*it)->ingest());
+    return stats;
+}
 
-    // Get pixels
-    const int num_samples = dp.bucket_size_x() * dp.bucket_size_y() * dp.spp();
-    dp.mPixelStore.resize(num_samples);
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mPixelStore[0]), sizeof(float)*num_samples));
-    return dp;
+void Server::accept()
+{
+    std::shared_ptr<Session> session(new Session(this, ++mSessionId));
+    
+    mAcceptor.async_accept(session->mSocket,
+                           [this, session](const boost::system::error_code& ec)
+    {
+        // Acceptor was closed
+        if (ec == error::operation_aborted || !mAcceptor.is_open())
+            return;
+        
+        if (!ec)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mSessions.insert(session);
+            }
+            mHandler->session_opened(*session);
+            session->read_type();
+        }
+        accept();
+    });
 }
 
+void Server::remove(Session* session)
+{
+    std::shared_ptr<Session> removed;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::set<std::shared_ptr<Session> >::iterator it;
+        for (it = mSessions.begin(); it != mSessions.end(); ++it)
+        {
+            if (it->get() == session)
+            {
+                removed = *it;
+                mSessions.erase(it);
+                
+                // Nothing waits for a closed Session, nor is kept for it
+                IngestStats stats = session->ingest();
+                stats.queued = 0;
+                stats.references = 0;
+                mClosed.add(stats);
+                break;
+            }
+        }
+    }
+    
+    // Already closed by quit()
+    if (removed)
+        mHandler->session_closed(*removed);
+}
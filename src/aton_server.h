@@ -10,11 +10,148 @@ All rights reserved. See COPYING.txt for more details.
 #include "aton_client.h"
 #include <boost/asio.hpp>
 
+#include <set>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+
+class Server;
+class Session;
+
+// Ingest counters of a Session, or summed over the Sessions of a Server
+struct IngestStats
+{
+    long long session;      // Render session of the last bucket, 0 in sums
+    long long buckets;      // Pixels messages handled
+    long long bytes;        // Their bytes on the socket or in shared memory
+    long long pixel_bytes;  // Bytes of the float pixels they decoded to
+    long long decode_ns;    // Time spent decoding them
+    long long queued;       // Bytes waiting in the socket when last looked
+    long long references;   // Bytes of the samples the Client's deltas refer to
+    
+    void add(const IngestStats& other);
+};
+
+// Receives the messages decoded by the Server
+// Called from the Server's threads, so different sessions may run
+// concurrently, while calls for the same session never overlap.
+class ServerHandler
+{
+public:
+    virtual ~ServerHandler() {}
+    
+    // A Client has connected
+    virtual void session_opened(Session& /*session*/) {}
+    
+    // A Client has opened a new image
+    virtual void header_received(Session& session, DataHeader& dh) = 0;
+    
+    // A Client has sent a bucket
+    // The pixels are only valid during the call, while the aov name is
+    // interned and keeps its address for the whole session.
+    virtual void pixels_received(Session& session, DataPixels& dp) = 0;
+    
+    // A Client has closed the image or the connection dropped
+    virtual void session_closed(Session& /*session*/) {}
+};
+
+// A connected Client
+// Each Session reads and decodes its own messages asynchronously.
+class Session: public std::enable_shared_from_this<Session>
+{
+    friend class Server;
+    
+public:
+    Session(Server* server, const int& id);
+    
+    // Connection index
+    const int& id() const { return mId; }
+    
+    // Per connection data owned by the ServerHandler
+    void* data() { return mData; }
+    void set_data(void* data) { mData = data; }
+    
+    // Snapshot of the counters, callable from any thread
+    IngestStats ingest() const;
+    
+private:
+    void read_type();
+    void read_header();
+    void read_pixels(const bool& framed);
+    void read_payload();
+    void read_encoded();
+    void read_reduced(const bool& delta);
+    void read_ring();
+    void read_ring_pixels();
+    bool dispatch_pixels(const char* name,
+                         const float* data,
+                         const size_t& bytes,
+                         const int& format = format_float,
+                         const void* steps = NULL,
+                         const float& offset = 0.0f,
+                         const float& scale = 0.0f);
+    const char* intern(const char* name);
+    void close();
+    
+    Server* mServer;
+    int mId;
+    int mType;
+    int mVersion;
+    void* mData;
+    
+    // Message storage, reused for every message of the session
+    HeaderFrame mHeaderFrame;
+    PixelsFrame mPixelsFrame;
+    LegacyPixelsFrame mLegacyFrame;
+    ShmPixelsFrame mShmFrame;
+    CodecPixelsFrame mCodecFrame;
+    DeltaPixelsFrame mDeltaFrame;
+    unsigned int mRingName;
+    std::vector<char> mName;
+    std::vector<char> mEncoded;
+    std::vector<char> mReduced;
+    DataHeader mHeader;
+    DataPixels mPixels;
+    
+    // Render stamp of the current bucket in our clock, the time its
+    // message came in, and our clock's time for the Client
+    long long mStamp, mReceived, mClock;
+    
+    // Counters, only written by the Session's handlers, and when
+    // the current message was read and its decoding started
+    std::atomic<long long> mInSession, mInBuckets, mInBytes;
+    std::atomic<long long> mInPixelBytes, mInDecodeNs, mInQueued, mInReferences;
+    long long mDecodeStart;
+    
+    // Aov names seen by the session, stored once
+    std::deque<std::string> mAovNames;
+    size_t mAovIndex;
+    
+    // Shared memory ring of a local Client
+    ShmRing mRing;
+    
+    // Samples the Client's deltas refer to, per aov and tile,
+    // their bytes are counted in mInReferences
+    std::string mDeltaKey;
+    std::unordered_map<std::string, std::vector<char> > mDeltaTiles;
+    
+    // Server's delta budget, as told to the Client
+    unsigned long long mDeltaBudget;
+    
+    boost::asio::generic::stream_protocol::socket mSocket;
+};
+
  // Represents a listening Server, ready to accept incoming images
  // This class wraps up the provision of a TCP port, and handles incoming
  // connections from Client objects when they're ready to send image data
 class Server
 {
+    friend class Session;
+    
 public:
     // Creates a new server. By default the Server is not connected at creation time
     Server();
@@ -31,34 +168,67 @@ public:
     // call get_port() afterwards
     void connect(int port, bool search=false);
     
-    // Sets up the server to accept an incoming Client connections.
-    void accept();
-
-    // This function blocks (and so may be require running on a separate thread),
-    // returning once a Client has sent a message.
-    // The returned Data object is filled with the relevant information and
-    // passed back ready for handling by the parent application
-    int listen_type();
-    DataHeader listenHeader();
-    DataPixels listenPixels();
-    
-    // This can be used to exit a listening loop running on a separate thread
+    // Listens on a "unix:/path" Unix domain socket, or on the TCP
+    // port given as a number, searching as above
+    void connect(const std::string& endpoint, bool search=false);
+    
+    // Starts accepting Client connections, any number at a time.
+    // Messages are decoded on a pool of threads and passed to the handler.
+    void start(ServerHandler* handler, const int& threads = 2);
+    
+    // Stops the threads and closes the port and all connections
     void quit();
 
     // Returns whether or not the server is connected to a port
     bool connected() { return mAcceptor.is_open(); }
 
-    //! Returns the port the server is currently connected to
+    //! Returns the port the server is currently connected to, 0 for Unix domain sockets
     int get_port() { return mPort; }
+    
+    // Returns the Unix domain socket path, empty for TCP
+    const std::string& get_path() { return mPath; }
+    
+    // Number of connected Clients
+    size_t sessions();
+    
+    // Counters of every Session so far, and of the connected ones
+    IngestStats ingest();
+    std::vector<IngestStats> session_ingest();
+    
+    // Most bytes of delta references a Session may keep, told to the
+    // Clients on their handshake. Tiles keyed past it are taken without
+    // keeping a reference. ATON_DELTA_SIZE by default.
+    void set_delta_size(const size_t& size) { mDeltaSize = size; }
+    const size_t& get_delta_size() const { return mDeltaSize; }
 
 private:
-    // Port we're listening to
+    void accept();
+    void remove(Session* session);
+    
+    // Port or socket path we're listening to
     int mPort;
+    std::string mPath;
+    
+    // Connection counter
+    int mSessionId;
+    
+    // Cap of each Session's delta references
+    size_t mDeltaSize;
+    
+    // Decoded messages receiver
+    ServerHandler* mHandler;
+    
+    // Connected Clients
+    std::mutex mMutex;
+    std::set<std::shared_ptr<Session> > mSessions;
+    std::vector<std::thread> mThreads;
+    
+    // Counters of the Sessions already closed
+    IngestStats mClosed;
     
-    // TCP stuff
+    // TCP or Unix domain socket stuff
     boost::asio::io_service mIoService;
-    boost::asio::ip::tcp::socket mSocket;
-    boost::asio::ip::tcp::acceptor mAcceptor;
+    boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol> mAcceptor;
 };
 
 #endif // ATON_SERVER_H_
@@ -0,0 +1,222 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_shm.h"
+
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#ifdef ATON_SHM
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory rings need lock free atomics");
+
+static const unsigned int shm_magic = 0x4154524e;
+
+// Ring positions, at the start of the mapping
+// Head and tail live on their own cache lines.
+struct ShmControl
+{
+    unsigned int magic;
+    unsigned int pad0;
+    unsigned long long capacity;
+    std::atomic<unsigned long long> head;
+    char pad1[64 - 24];
+    std::atomic<unsigned long long> tail;
+    char pad2[64 - 8];
+};
+
+
+// ShmRing class
+ShmRing::ShmRing(): mCapacity(0),
+                    mMapped(0),
+                    mHead(0),
+                    mControl(NULL),
+                    mData(NULL)
+{
+}
+
+ShmRing::~ShmRing()
+{
+    close();
+}
+
+bool ShmRing::create(const size_t& capacity)
+{
+    close();
+#ifdef ATON_SHM
+    static std::atomic<int> rings(0);
+
+    // Short, macOS limits the names to 31 characters
+    char name[32];
+    snprintf(name, sizeof(name), "/aton_%d_%d", static_cast<int>(getpid()), ++rings);
+
+    const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return false;
+
+    mName = name;
+
+    // Whole cache lines
+    mCapacity = (capacity + 63) / 64 * 64;
+    mMapped = sizeof(ShmControl) + mCapacity;
+
+    if (ftruncate(fd, mMapped) != 0 || !map(fd, true))
+    {
+        ::close(fd);
+        unlink();
+        close();
+        return false;
+    }
+    ::close(fd);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool ShmRing::open(const std::string& name)
+{
+    close();
+#ifdef ATON_SHM
+    const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0)
+        return false;
+
+    mName = name;
+
+    struct stat st;
+    const bool sized = fstat(fd, &st) == 0 && st.st_size > static_cast<off_t>(sizeof(ShmControl));
+    mMapped = sized ? st.st_size : 0;
+
+    if (!sized || !map(fd, false))
+    {
+        ::close(fd);
+        close();
+        return false;
+    }
+    ::close(fd);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool ShmRing::map(const int& fd, const bool& create)
+{
+#ifdef ATON_SHM
+    void* address = mmap(NULL, mMapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+        return false;
+
+    mControl = static_cast<ShmControl*>(address);
+    mData = static_cast<char*>(address) + sizeof(ShmControl);
+
+    if (create)
+    {
+        mControl->magic = shm_magic;
+        mControl->capacity = mCapacity;
+        mControl->head.store(0);
+        mControl->tail.store(0);
+    }
+    else if (mControl->magic != shm_magic ||
+             mControl->capacity + sizeof(ShmControl) != mMapped)
+    {
+        return false;
+    }
+
+    mCapacity = mControl->capacity;
+    mHead = mControl->head.load();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void ShmRing::unlink()
+{
+#ifdef ATON_SHM
+    if (!mName.empty())
+        shm_unlink(mName.c_str());
+#endif
+}
+
+void ShmRing::close()
+{
+#ifdef ATON_SHM
+    if (mControl != NULL)
+        munmap(mControl, mMapped);
+#endif
+    mControl = NULL;
+    mData = NULL;
+    mName.clear();
+    mCapacity = mMapped = 0;
+    mHead = 0;
+}
+
+char* ShmRing::reserve(const size_t& size,
+                       const int& timeout,
+                       unsigned long long& position)
+{
+    if (mControl == NULL || size > mCapacity)
+        return NULL;
+
+    // Skip the end of the ring if the record doesn't fit there
+    position = mHead;
+    const size_t offset = position % mCapacity;
+    if (offset + size > mCapacity)
+        position += mCapacity - offset;
+
+    // Wait for the consumer, sleeping longer the longer it takes
+    using namespace std::chrono;
+    const steady_clock::time_point deadline = steady_clock::now() + milliseconds(timeout);
+    int wait = 1;
+
+    while (position + size - mControl->tail.load(std::memory_order_acquire) > mCapacity)
+    {
+        if (steady_clock::now() >= deadline)
+            return NULL;
+
+        std::this_thread::sleep_for(microseconds(wait));
+        wait = std::min(wait * 2, 1000);
+    }
+
+    return mData + position % mCapacity;
+}
+
+void ShmRing::commit(const unsigned long long& position, const size_t& size)
+{
+    mHead = position + size;
+    mControl->head.store(mHead, std::memory_order_release);
+}
+
+const char* ShmRing::record(const unsigned long long& position,
+                            const size_t& size) const
+{
+    if (mControl == NULL)
+        return NULL;
+
+    const unsigned long long head = mControl->head.load(std::memory_order_acquire);
+    const unsigned long long tail = mControl->tail.load(std::memory_order_relaxed);
+
+    if (position < tail || position + size > head ||
+        position % mCapacity + size > mCapacity)
+        return NULL;
+
+    return mData + position % mCapacity;
+}
+
+void ShmRing::release(const unsigned long long& position, const size_t& size)
+{
+    mControl->tail.store(position + size, std::memory_order_release);
+}
@@ -0,0 +1,77 @@
+/*
+Copyright (c) 2019,
+Dan Bethell, Johannes Saam, Vahan Sosoyan.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_SHM_H_
+#define ATON_SHM_H_
+
+#include <string>
+#include <cstddef>
+
+// Shared memory rings need POSIX shm_open
+#if defined(__unix__) || defined(__APPLE__)
+#define ATON_SHM
+#endif
+
+struct ShmControl;
+
+// Byte ring in POSIX shared memory, for one producer and one consumer
+// in different processes. Records are always contiguous, one that doesn't
+// fit before the end of the ring starts over at its beginning. Positions
+// only grow, the producer tells the consumer where each record is.
+class ShmRing
+{
+public:
+    ShmRing();
+    ~ShmRing();
+
+    // Creates and maps a new ring with a unique name
+    bool create(const size_t& capacity);
+
+    // Maps a ring created by another process
+    bool open(const std::string& name);
+
+    // Removes the name, mappings stay valid until closed
+    void unlink();
+
+    // Unmaps the ring
+    void close();
+
+    bool is_open() const { return mControl != NULL; }
+
+    const std::string& name() const { return mName; }
+
+    const size_t& capacity() const { return mCapacity; }
+
+    // Producer, space for a record of size bytes at the returned position.
+    // Waits up to timeout milliseconds for the consumer to make room,
+    // returns NULL if it didn't.
+    char* reserve(const size_t& size,
+                  const int& timeout,
+                  unsigned long long& position);
+
+    // Producer, publishes the reserved record
+    void commit(const unsigned long long& position, const size_t& size);
+
+    // Consumer, the published record at the position,
+    // NULL if the position and size don't describe one
+    const char* record(const unsigned long long& position,
+                       const size_t& size) const;
+
+    // Consumer, hands the ring up to the end of the record back
+    void release(const unsigned long long& position, const size_t& size);
+
+private:
+    bool map(const int& fd, const bool& create);
+
+    std::string mName;
+    size_t mCapacity;
+    size_t mMapped;
+    unsigned long long mHead;
+    ShmControl* mControl;
+    char* mData;
+};
+
+#endif // ATON_SHM_H_